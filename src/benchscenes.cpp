@@ -0,0 +1,533 @@
+/*
+ * Benchmarks the built-in scenes and their scaled up copies and
+ * writes the results as JSON.
+ *
+ * usage: bench_scenes [-n steps] [-w warmup steps] [-dt seconds]
+ *                     [-scale 1,10,100] [-order period] [-skin distance]
+ *                     [-pairs] [-clusters] [-simd] [-sort comparison|radix|incremental]
+ *                     [-cells rows|morton] [-distance jacobi|gauss-seidel]
+ *                     [-iterations n] [-substeps n] [-compliance c] [-o file]
+ *                     [scene keys]
+ *
+ * Every run reports the time it took to build the scene, the
+ * p50/p95/p99 step time, the mean time per step of each stage recorded
+ * by the TRACE_SCOPE timers and the throughput in particles * solver
+ * iterations per second.
+ * All scenes (1-9, B, N, M) are run at scale 1 and 10 by default.
+ * -order keeps the particle arrays in grid order, permuting them
+ * every period steps (see ParticleSystem::setSpatialOrder). -skin
+ * reuses neighbor lists within that distance (setNeighborSkin), the
+ * number of neighbor searches per step is reported with each run.
+ * -pairs computes contacts and fluid terms once per pair
+ * (setPairTraversal), -clusters in SIMD tiles of particle clusters
+ * (setClusterPairs). -simd solves the fluids over SIMD lanes of
+ * neighbors (setSimdFluids). -sort picks the sort of the grid hashes
+ * (setGridSort), incremental by default. -cells picks the order of the
+ * cell keys (setCellOrder). -distance picks the solver of the distance
+ * constraints (setDistanceSolver), after the timed steps every run
+ * reports how many iterations of either solver the constraints need
+ * from there to converge (distanceIterations) and how far they are
+ * stretched (distanceError), and how far the fluids are compressed
+ * (fluidDensityError). -iterations overrides the solver iterations of
+ * the scenes (setSolverIterations), -substeps solves every step in that
+ * many substeps of one iteration instead (setSubsteps), the throughput
+ * then counts substeps as iterations. -compliance gives
+ * all distance constraints that compliance (setDistanceCompliance, 0
+ * by default keeps them rigid). Where the hardware
+ * counters are available (Linux perf events) every run also reports
+ * the L1 data read misses and last level cache misses per step of all
+ * threads, and null otherwise.
+ */
+
+#include <ctype.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <string>
+#include <utility>
+#include <vector>
+
+#ifdef __linux__
+#include <dirent.h>
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include "particlesystem.h"
+#include "scenes.h"
+#include "trace.h"
+#include "util.cuh"
+
+#ifndef THESIS_TRACE
+#error "bench_scenes needs the stage timers, build it with THESIS_TRACE defined"
+#endif
+
+#if defined(CUDA)
+static const char *backend = "CUDA";
+#else
+static const char *backend = "CPU";
+#endif
+
+// the ParticleSystem options all runs use
+struct Settings
+{
+    uint orderPeriod;
+    float skin;
+    bool pairs;
+    bool clusters;
+    bool simd;
+    GridSort sort;
+    CellOrder cells;
+    DistanceSolver distance;
+    uint iterations;            // 0 keeps those of the scene
+    uint substeps;
+    float compliance;
+};
+
+static const char *sortNames[] = { "comparison", "radix", "incremental" };   // by GridSort
+static const uint numSorts = sizeof(sortNames) / sizeof(sortNames[0]);
+static const char *cellNames[] = { "rows", "morton" };                       // by CellOrder
+static const uint numCellOrders = sizeof(cellNames) / sizeof(cellNames[0]);
+static const char *distanceNames[] = { "jacobi", "gauss-seidel" };           // by DistanceSolver
+static const uint numDistanceSolvers = sizeof(distanceNames) / sizeof(distanceNames[0]);
+
+// the distance constraints converged once their mean error (relative
+// to the rest distances) is this close to where it settles
+static const float distanceTolerance = 1e-2f;
+static const uint maxDistanceIterations = 10000;
+
+// the cache events counted during the timed steps
+enum CacheEvent { L1D_READ_MISSES, LLC_MISSES, NUM_CACHE_EVENTS };
+static const char *cacheEventNames[] = { "l1d_read_misses", "llc_misses" };
+
+struct Run
+{
+    char key;
+    uint scale;
+    uint particles;
+    uint iterations;
+    uint steps;
+    double build;                  // seconds to create the scene
+    uint searches;                 // neighbor searches during the timed steps
+    uint distanceIterations[numDistanceSolvers]; // to converge from the last step, by DistanceSolver
+    float distanceError;           // mean relative stretch after the last step
+    float densityError;            // mean relative compression of the fluids after the last step
+    double total;                  // seconds
+    std::vector<double> stepTimes; // seconds
+    std::vector<std::pair<std::string, double> > stages; // name, total seconds
+    bool counted;                  // the cache counters could be read
+    unsigned long long cacheMisses[NUM_CACHE_EVENTS];
+};
+
+// Counts cache misses in user space of every thread of the process
+// (the calling thread and the backend workers), one perf event per
+// thread and event. Counting fails quietly without perf events or
+// hardware counters.
+class CacheCounters
+{
+public:
+    CacheCounters() : m_ok(false)
+    {
+#ifdef __linux__
+        DIR *tasks = opendir("/proc/self/task");
+        if (!tasks)
+            return;
+
+        m_ok = true;
+        while (struct dirent *entry = readdir(tasks))
+        {
+            if (entry->d_name[0] == '.')
+                continue;
+            pid_t tid = static_cast<pid_t>(atoi(entry->d_name));
+
+            for (uint e = 0; e < NUM_CACHE_EVENTS && m_ok; e++)
+            {
+                struct perf_event_attr attr;
+                memset(&attr, 0, sizeof(attr));
+                attr.size = sizeof(attr);
+                attr.exclude_kernel = 1;
+                attr.exclude_hv = 1;
+                if (e == L1D_READ_MISSES)
+                {
+                    attr.type = PERF_TYPE_HW_CACHE;
+                    attr.config = PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                                  (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+                }
+                else
+                {
+                    attr.type = PERF_TYPE_HARDWARE;
+                    attr.config = PERF_COUNT_HW_CACHE_MISSES;
+                }
+
+                int fd = static_cast<int>(syscall(SYS_perf_event_open, &attr, tid, -1, -1, 0));
+                if (fd < 0)
+                    m_ok = false;
+                else
+                    m_fds[e].push_back(fd);
+            }
+        }
+        closedir(tasks);
+#endif
+    }
+
+    ~CacheCounters()
+    {
+#ifdef __linux__
+        for (uint e = 0; e < NUM_CACHE_EVENTS; e++)
+        {
+            for (int fd : m_fds[e])
+                close(fd);
+        }
+#endif
+    }
+
+    // false if any counter could not be opened
+    bool ok() const { return m_ok; }
+
+    unsigned long long read(CacheEvent e) const
+    {
+        unsigned long long total = 0;
+#ifdef __linux__
+        for (int fd : m_fds[e])
+        {
+            unsigned long long count = 0;
+            if (::read(fd, &count, sizeof(count)) == sizeof(count))
+                total += count;
+        }
+#endif
+        return total;
+    }
+
+private:
+    bool m_ok;
+    std::vector<int> m_fds[NUM_CACHE_EVENTS];
+};
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-n steps] [-w warmup steps] [-dt seconds] [-scale 1,10,100] [-order period] "
+            "[-skin distance] [-pairs] [-clusters] [-simd] [-sort comparison|radix|incremental] [-cells rows|morton] "
+            "[-distance jacobi|gauss-seidel] [-iterations n] [-substeps n] [-compliance c] [-o file] [scene keys]\n",
+            name);
+}
+
+// nearest rank percentile of sorted values
+static double percentile(const std::vector<double> &sorted, double p)
+{
+    if (sorted.empty())
+        return 0.0;
+    size_t rank = static_cast<size_t>(ceil(p / 100.0 * sorted.size()));
+    return sorted[std::min(std::max(rank, size_t(1)), sorted.size()) - 1];
+}
+
+static void addStages(std::vector<std::pair<std::string, double> > &stages, const std::vector<trace::Event> &events)
+{
+    for (const trace::Event &e : events)
+    {
+        double seconds = (e.end - e.begin) * 1e-9;
+
+        auto it = std::find_if(stages.begin(), stages.end(), [&](const std::pair<std::string, double> &s)
+        {
+            return s.first == e.name;
+        });
+
+        if (it == stages.end())
+            stages.push_back(std::make_pair(std::string(e.name), seconds));
+        else
+            it->second += seconds;
+    }
+}
+
+static Run runScene(char key, uint scale, uint steps, uint warmup, float deltaTime, const Settings &settings)
+{
+    Run run;
+    run.key = key;
+    run.scale = scale;
+
+    uint64_t buildStart = trace::now();
+    ParticleSystem *particleSystem = createScene(key, NULL, scale);
+    run.build = (trace::now() - buildStart) * 1e-9;
+
+    particleSystem->setSpatialOrder(settings.orderPeriod);
+    particleSystem->setNeighborSkin(settings.skin);
+    particleSystem->setPairTraversal(settings.pairs);
+    particleSystem->setClusterPairs(settings.clusters);
+    particleSystem->setSimdFluids(settings.simd);
+    particleSystem->setGridSort(settings.sort);
+    particleSystem->setCellOrder(settings.cells);
+    particleSystem->setDistanceSolver(settings.distance);
+    particleSystem->setDistanceCompliance(settings.compliance);
+    if (settings.iterations > 0)
+        particleSystem->setSolverIterations(settings.iterations);
+    particleSystem->setSubsteps(settings.substeps);
+
+    for (uint i = 0; i < warmup; i++)
+        particleSystem->update(deltaTime);
+
+    run.particles = particleSystem->getNumParticles();
+    run.iterations = settings.substeps > 0 ? settings.substeps : particleSystem->getSolverIterations();
+    run.steps = steps;
+    run.total = 0.0;
+
+    uint searches = particleSystem->getNeighborSearches();
+    trace::clear();
+
+    // the worker threads exist after the warmup, the counters start
+    // at zero when opened
+    CacheCounters counters;
+
+    for (uint i = 0; i < steps; i++)
+    {
+        uint64_t start = trace::now();
+        particleSystem->update(deltaTime);
+        double elapsed = (trace::now() - start) * 1e-9;
+
+        run.stepTimes.push_back(elapsed);
+        run.total += elapsed;
+
+        // drain every step so the ring buffers never wrap
+        addStages(run.stages, trace::collect());
+        trace::clear();
+    }
+
+    run.searches = particleSystem->getNeighborSearches() - searches;
+
+    run.counted = counters.ok();
+    for (uint e = 0; e < NUM_CACHE_EVENTS; e++)
+        run.cacheMisses[e] = run.counted ? counters.read((CacheEvent) e) : 0;
+
+    run.distanceError = particleSystem->distanceError();
+    run.densityError = particleSystem->fluidDensityError();
+
+    for (uint s = 0; s < numDistanceSolvers; s++)
+    {
+        run.distanceIterations[s] = particleSystem->distanceIterations((DistanceSolver) s, distanceTolerance,
+                                                                      maxDistanceIterations);
+    }
+
+    delete particleSystem;
+
+    return run;
+}
+
+static void writeJson(FILE *file, const std::vector<Run> &runs, float deltaTime, const Settings &settings)
+{
+    fprintf(file, "{\n  \"backend\": \"%s\",\n  \"dt\": %g,\n  \"spatial_order\": %u,\n  \"neighbor_skin\": %g,\n"
+            "  \"pair_traversal\": %s,\n  \"cluster_pairs\": %s,\n  \"simd_fluids\": %s,\n  \"grid_sort\": \"%s\",\n"
+            "  \"cell_order\": \"%s\",\n  \"distance_solver\": \"%s\",\n  \"distance_tolerance\": %g,\n"
+            "  \"substeps\": %u,\n  \"distance_compliance\": %g,\n  \"runs\": [\n",
+            backend, deltaTime, settings.orderPeriod, settings.skin, settings.pairs ? "true" : "false",
+            settings.clusters ? "true" : "false", settings.simd ? "true" : "false", sortNames[settings.sort],
+            cellNames[settings.cells], distanceNames[settings.distance], distanceTolerance, settings.substeps,
+            settings.compliance);
+
+    for (size_t r = 0; r < runs.size(); r++)
+    {
+        const Run &run = runs[r];
+
+        std::vector<double> sorted = run.stepTimes;
+        std::sort(sorted.begin(), sorted.end());
+
+        double mean = run.steps ? run.total / run.steps : 0.0;
+        double throughput = run.total > 0.0 ? double(run.particles) * run.iterations * run.steps / run.total : 0.0;
+
+        fprintf(file, "    {\n");
+        fprintf(file, "      \"scene\": \"%c\",\n", run.key);
+        fprintf(file, "      \"scale\": %u,\n", run.scale);
+        fprintf(file, "      \"particles\": %u,\n", run.particles);
+        fprintf(file, "      \"solver_iterations\": %u,\n", run.iterations);
+        fprintf(file, "      \"steps\": %u,\n", run.steps);
+        fprintf(file, "      \"build_ms\": %.4f,\n", run.build * 1e3);
+        fprintf(file, "      \"total_s\": %.6f,\n", run.total);
+        fprintf(file, "      \"step_ms\": { \"mean\": %.4f, \"p50\": %.4f, \"p95\": %.4f, \"p99\": %.4f, \"max\": %.4f },\n",
+                mean * 1e3, percentile(sorted, 50) * 1e3, percentile(sorted, 95) * 1e3,
+                percentile(sorted, 99) * 1e3, sorted.empty() ? 0.0 : sorted.back() * 1e3);
+        fprintf(file, "      \"particle_iterations_per_s\": %.1f,\n", throughput);
+        fprintf(file, "      \"neighbor_searches_per_step\": %.3f,\n", run.steps ? double(run.searches) / run.steps : 0.0);
+
+        // mean cache misses per step
+        fprintf(file, "      \"cache_misses_per_step\": ");
+        if (run.counted)
+        {
+            for (uint e = 0; e < NUM_CACHE_EVENTS; e++)
+            {
+                fprintf(file, "%s\"%s\": %.1f", e ? ", " : "{ ", cacheEventNames[e],
+                        run.steps ? double(run.cacheMisses[e]) / run.steps : 0.0);
+            }
+            fprintf(file, " },\n");
+        }
+        else
+            fprintf(file, "null,\n");
+
+        fprintf(file, "      \"distance_error\": %g,\n", run.distanceError);
+        fprintf(file, "      \"fluid_density_error\": %g,\n", run.densityError);
+
+        // iterations to converge, past the maximum means never
+        fprintf(file, "      \"distance_iterations\": ");
+        for (uint s = 0; s < numDistanceSolvers; s++)
+        {
+            if (run.distanceIterations[s] > maxDistanceIterations)
+                fprintf(file, "%s\"%s\": null", s ? ", " : "{ ", distanceNames[s]);
+            else
+                fprintf(file, "%s\"%s\": %u", s ? ", " : "{ ", distanceNames[s], run.distanceIterations[s]);
+        }
+        fprintf(file, " },\n");
+
+        // mean milliseconds per step, nested stages are included in their parents
+        fprintf(file, "      \"stage_ms\": {");
+        for (size_t s = 0; s < run.stages.size(); s++)
+        {
+            fprintf(file, "%s\n        \"%s\": %.4f", s ? "," : "", run.stages[s].first.c_str(),
+                    run.steps ? run.stages[s].second / run.steps * 1e3 : 0.0);
+        }
+        fprintf(file, "\n      }\n");
+        fprintf(file, "    }%s\n", r + 1 < runs.size() ? "," : "");
+    }
+
+    fprintf(file, "  ]\n}\n");
+}
+
+int main(int argc, char *argv[])
+{
+    uint steps = 200;
+    uint warmup = 10;
+    float deltaTime = 1.f / 60.f;
+    Settings settings = { 0, 0.f, false, false, false, GRID_SORT_INCREMENTAL, CELL_ORDER_ROWS, DISTANCE_JACOBI, 0, 0, 0.f };
+    std::vector<uint> scales;
+    std::string keys;
+    const char *outPath = NULL;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "-n") && i + 1 < argc)
+            steps = static_cast<uint>(atoi(argv[++i]));
+        else if (!strcmp(argv[i], "-w") && i + 1 < argc)
+            warmup = static_cast<uint>(atoi(argv[++i]));
+        else if (!strcmp(argv[i], "-dt") && i + 1 < argc)
+            deltaTime = static_cast<float>(atof(argv[++i]));
+        else if (!strcmp(argv[i], "-scale") && i + 1 < argc)
+        {
+            for (char *s = strtok(argv[++i], ","); s; s = strtok(NULL, ","))
+                scales.push_back(std::max(atoi(s), 1));
+        }
+        else if (!strcmp(argv[i], "-order") && i + 1 < argc)
+            settings.orderPeriod = static_cast<uint>(atoi(argv[++i]));
+        else if (!strcmp(argv[i], "-skin") && i + 1 < argc)
+            settings.skin = static_cast<float>(atof(argv[++i]));
+        else if (!strcmp(argv[i], "-pairs"))
+            settings.pairs = true;
+        else if (!strcmp(argv[i], "-clusters"))
+            settings.clusters = true;
+        else if (!strcmp(argv[i], "-simd"))
+            settings.simd = true;
+        else if (!strcmp(argv[i], "-sort") && i + 1 < argc)
+        {
+            const char *name = argv[++i];
+            uint sort = 0;
+            while (sort < numSorts && strcmp(name, sortNames[sort]))
+                sort++;
+            if (sort == numSorts)
+            {
+                usage(argv[0]);
+                return 1;
+            }
+            settings.sort = (GridSort) sort;
+        }
+        else if (!strcmp(argv[i], "-cells") && i + 1 < argc)
+        {
+            const char *name = argv[++i];
+            uint cells = 0;
+            while (cells < numCellOrders && strcmp(name, cellNames[cells]))
+                cells++;
+            if (cells == numCellOrders)
+            {
+                usage(argv[0]);
+                return 1;
+            }
+            settings.cells = (CellOrder) cells;
+        }
+        else if (!strcmp(argv[i], "-distance") && i + 1 < argc)
+        {
+            const char *name = argv[++i];
+            uint solver = 0;
+            while (solver < numDistanceSolvers && strcmp(name, distanceNames[solver]))
+                solver++;
+            if (solver == numDistanceSolvers)
+            {
+                usage(argv[0]);
+                return 1;
+            }
+            settings.distance = (DistanceSolver) solver;
+        }
+        else if (!strcmp(argv[i], "-iterations") && i + 1 < argc)
+            settings.iterations = static_cast<uint>(atoi(argv[++i]));
+        else if (!strcmp(argv[i], "-substeps") && i + 1 < argc)
+            settings.substeps = static_cast<uint>(atoi(argv[++i]));
+        else if (!strcmp(argv[i], "-compliance") && i + 1 < argc)
+            settings.compliance = static_cast<float>(atof(argv[++i]));
+        else if (!strcmp(argv[i], "-o") && i + 1 < argc)
+            outPath = argv[++i];
+        else if (argv[i][0] == '-')
+        {
+            usage(argv[0]);
+            return 1;
+        }
+        else
+            keys += argv[i];
+    }
+
+    if (keys.empty())
+        keys = sceneKeys + 1; // skip the empty scene
+    if (scales.empty())
+        scales = { 1, 10 };
+
+    cudaInit();
+
+    std::vector<Run> runs;
+    for (uint scale : scales)
+    {
+        for (char key : keys)
+        {
+            key = toupper(key);
+            if (!strchr(sceneKeys, key))
+            {
+                fprintf(stderr, "unknown scene '%c'\n", key);
+                usage(argv[0]);
+                return 1;
+            }
+
+            runs.push_back(runScene(key, scale, steps, warmup, deltaTime, settings));
+
+            const Run &run = runs.back();
+            fprintf(stderr, "scene %c x%-3u %7u particles %9.3f ms build %9.3f ms/step %6.2f searches/step", key,
+                    scale, run.particles, run.build * 1e3, run.total / std::max(run.steps, 1u) * 1e3,
+                    double(run.searches) / std::max(run.steps, 1u));
+            if (run.counted)
+            {
+                fprintf(stderr, " %10.0f L1D misses/step %9.0f LLC misses/step",
+                        double(run.cacheMisses[L1D_READ_MISSES]) / std::max(run.steps, 1u),
+                        double(run.cacheMisses[LLC_MISSES]) / std::max(run.steps, 1u));
+            }
+            fprintf(stderr, " %u/%u iterations jacobi/gauss-seidel", run.distanceIterations[DISTANCE_JACOBI],
+                    run.distanceIterations[DISTANCE_GAUSS_SEIDEL]);
+            fprintf(stderr, "\n");
+        }
+    }
+
+    FILE *file = outPath ? fopen(outPath, "w") : stdout;
+    if (!file)
+    {
+        fprintf(stderr, "could not write %s\n", outPath);
+        return 1;
+    }
+
+    writeJson(file, runs, deltaTime, settings);
+
+    if (outPath)
+        fclose(file);
+
+    return 0;
+}
@@ -0,0 +1,127 @@
+#ifndef CPU_CLUSTER_H
+#define CPU_CLUSTER_H
+
+#include <math.h>
+#include <string.h>
+
+#ifdef __SSE__
+#include <immintrin.h>
+#endif
+
+/*
+ * Particle clusters for the cluster pair kernels: runs of up to
+ * CLUSTER_SIZE sorted particles, one per lane of a SIMD register. The
+ * lanes are stored per coordinate, so a cluster loads with one vector
+ * move per field, and the kernels compute whole tiles of
+ * CLUSTER_SIZE x CLUSTER_SIZE particle pairs with lane masks instead of
+ * branches.
+ */
+
+#ifdef __AVX__
+#define CLUSTER_SIZE 8
+#else
+#define CLUSTER_SIZE 4
+#endif
+
+// the lanes of one cluster as GCC vector types, which map to SSE or AVX
+// registers depending on the target
+typedef float lanef __attribute__((vector_size(CLUSTER_SIZE * sizeof(float))));
+typedef int   lanei __attribute__((vector_size(CLUSTER_SIZE * sizeof(int))));
+
+// positions of the lanes of a cluster
+struct ClusterLanes
+{
+    float x[CLUSTER_SIZE];
+    float y[CLUSTER_SIZE];
+    float z[CLUSTER_SIZE];
+};
+
+// the particle data a cluster pair kernel reads. Unused lanes lie far
+// outside the world, out of reach of every other particle.
+struct Cluster
+{
+    ClusterLanes pos;
+    float w[CLUSTER_SIZE];
+    int   phase[CLUSTER_SIZE];
+};
+
+#define EMPTY_LANE_POS 1e18f
+
+// the arrays of the clusters are only float aligned
+inline lanef loadLanes(const float *p)
+{
+    lanef v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+inline lanei loadLanes(const int *p)
+{
+    lanei v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+inline void storeLanes(float *p, lanef v)
+{
+    memcpy(p, &v, sizeof(v));
+}
+
+inline lanef laneSqrt(lanef v)
+{
+#if defined(__AVX__)
+    return (lanef) _mm256_sqrt_ps((__m256) v);
+#elif defined(__SSE__)
+    return (lanef) _mm_sqrt_ps((__m128) v);
+#else
+    for (int l = 0; l < CLUSTER_SIZE; l++)
+        v[l] = sqrtf(v[l]);
+    return v;
+#endif
+}
+
+// whether any lane of a mask is set
+inline bool laneAny(lanei mask)
+{
+#if defined(__AVX__)
+    return _mm256_movemask_ps((__m256) mask) != 0;
+#elif defined(__SSE__)
+    return _mm_movemask_ps((__m128) mask) != 0;
+#else
+    for (int l = 0; l < CLUSTER_SIZE; l++)
+    {
+        if (mask[l])
+            return true;
+    }
+    return false;
+#endif
+}
+
+// lane l holds l
+inline lanei laneIndex()
+{
+    lanei v;
+    for (int l = 0; l < CLUSTER_SIZE; l++)
+        v[l] = l;
+    return v;
+}
+
+// the sum of all lanes
+inline float laneSum(lanef v)
+{
+    float sum = 0.f;
+    for (int l = 0; l < CLUSTER_SIZE; l++)
+        sum += v[l];
+    return sum;
+}
+
+// lane l holds p[index[l]], lanes from count on hold fill
+inline lanef gatherLanes(const float *p, const unsigned int *index, unsigned int count, float fill)
+{
+    lanef v;
+    for (unsigned int l = 0; l < CLUSTER_SIZE; l++)
+        v[l] = l < count ? p[index[l]] : fill;
+    return v;
+}
+
+#endif // CPU_CLUSTER_H
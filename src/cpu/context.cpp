@@ -0,0 +1,115 @@
+/*
+ * Host implementation of the simulation context functions
+ * declared in wrappers.cuh.
+ */
+
+#include <assert.h>
+#include <string.h>
+#include <algorithm>
+#include <numeric>
+
+#include "context.h"
+#include "wrappers.cuh"
+
+static thread_local SimContext *current = NULL;
+
+// resizes v to n elements, at least doubling the capacity whenever it
+// has to reallocate so appending particles is amortised O(1)
+template <typename T>
+static void grow(std::vector<T> &v, size_t n)
+{
+    if (n > v.capacity())
+        v.reserve(std::max(n, 2 * v.capacity()));
+    v.resize(n);
+}
+
+// appends num elements of data to v
+template <typename T>
+static void append(std::vector<T> &v, const T *data, size_t num)
+{
+    size_t size = v.size();
+    grow(v, size + num);
+    memcpy(v.data() + size, data, num * sizeof(T));
+}
+
+SimContext &currentContext()
+{
+    assert(current && "no simulation context bound to this thread");
+    return *current;
+}
+
+extern "C"
+{
+
+    SimContext *createContext()
+    {
+        SimContext *context = new SimContext;
+        context->gen.seed(1234);
+        return context;
+    }
+
+    void destroyContext(SimContext *context)
+    {
+        if (current == context)
+            current = NULL;
+        delete context;
+    }
+
+    void bindContext(SimContext *context)
+    {
+        current = context;
+    }
+
+    void reserveParticles(uint numParticles)
+    {
+        SimContext &c = currentContext();
+
+        c.V.reserve(4 * numParticles);
+        c.ros.reserve(numParticles);
+        c.W.reserve(numParticles);
+        c.phase.reserve(numParticles);
+
+        c.lambda.reserve(numParticles);
+        c.neighborStart.reserve(numParticles + 1);
+        c.neighborBands.reserve(numParticles);
+        c.Xstar.reserve(4 * numParticles);
+        c.occurences.reserve(numParticles);
+        c.distColourMask.reserve(numParticles);
+        c.particleSlot.reserve(numParticles);
+    }
+
+    void appendParticles(const float *vel, const float *ro, const float *w, const int *phase, uint numParticles)
+    {
+        SimContext &c = currentContext();
+
+        append(c.V, vel, 4 * numParticles);
+        append(c.ros, ro, numParticles);
+        append(c.W, w, numParticles);
+        append(c.phase, phase, numParticles);
+
+        uint total = c.W.size();
+
+        // resize but don't need to fill
+        grow(c.lambda, total);
+        grow(c.neighborStart, total + 1);
+        grow(c.neighborBands, total);
+        grow(c.Xstar, 4 * total);
+
+        // new particles are not part of any constraint yet
+        grow(c.occurences, total);
+        grow(c.distColourMask, total);
+
+        // and are stored after all others, so their slots are their handles
+        uint first = c.particleSlot.size();
+        grow(c.particleSlot, total);
+        std::iota(c.particleSlot.begin() + first, c.particleSlot.end(), first);
+    }
+
+    void findParticleSlots(uint *index, uint num)
+    {
+        const std::vector<uint> &particleSlot = currentContext().particleSlot;
+        for (uint i = 0; i < num; i++)
+            index[i] = particleSlot[index[i]];
+    }
+
+}
@@ -0,0 +1,150 @@
+#ifndef CPU_CONTEXT_H
+#define CPU_CONTEXT_H
+
+#include <random>
+#include <vector>
+
+#include "cluster.h"
+#include "kernel.cuh"
+#include "shared_variables.cuh"
+
+// Cluster pair mode: the sorted particles in clusters of up to
+// CLUSTER_SIZE, a cluster never spans two blocks
+struct ClusterSet
+{
+    std::vector<uint> start;        // first sorted particle of every cluster, and the end
+    std::vector<uint> clusterOf;    // cluster of every sorted particle
+    std::vector<float3> lo;         // bounding boxes at the last neighbor search
+    std::vector<float3> hi;
+    std::vector<Cluster> lanes;     // the particle data, packed for the kernels
+};
+
+/*
+ * All per-simulation state of the CPU backend. Every ParticleSystem
+ * owns one and binds it to its thread before calling into the backend,
+ * so independent simulations can live side by side and run on
+ * different threads at the same time.
+ */
+struct SimContext
+{
+    // simulation parameters, the host counterpart of constant memory
+    SimParams params;
+
+    /*
+     *   INTEGRATION
+     */
+    std::mt19937 gen;
+    std::uniform_real_distribution<float> uniform;
+    float rands[6];
+
+    std::vector<float> V; // particle velocities
+    std::vector<float> lambda;
+    std::vector<float> ros;
+
+    // neighbor lists in compressed rows: the neighbors of sorted
+    // particle i are neighbors[neighborStart[i] .. neighborStart[i + 1]),
+    // split into the contact, fluid and sdf bands of neighborBands[i]
+    std::vector<uint> neighbors;
+    std::vector<uint> neighborStart;
+    std::vector<uint3> neighborBands;
+    std::vector<std::vector<uint> > neighborChunks;  // scratch space for searching chunks of particles
+
+    // pair traversal: runs of sorted particles grouped by colour, the
+    // units of colour k are colourUnits[colourStart[k] .. colourStart[k + 1])
+    std::vector<uint2> colourUnits;
+    std::vector<uint> colourStart;
+    std::vector<uint2> pairUnits;     // scratch space for finding the units
+    std::vector<float4> pairSums;     // per particle sums of the pair sweeps
+    std::vector<float> pairCounts;
+
+    // cluster pair mode: the clusters of the particles and of the sdf
+    // particles, and the neighbor rows of the clusters (cluster indices
+    // in the bands of the particle rows)
+    ClusterSet clusters;
+    ClusterSet sdfClusters;
+    std::vector<uint> clusterNeighbors;
+    std::vector<uint> clusterNeighborStart;
+    std::vector<uint3> clusterNeighborBands;
+    std::vector<ClusterLanes> clusterPrev;  // positions at the start of the step
+    std::vector<float> clusterLambda;       // CLUSTER_SIZE lanes per cluster
+
+    // the sorted positions by coordinate, for the SIMD fluid kernels
+    std::vector<float> sortedX;
+    std::vector<float> sortedY;
+    std::vector<float> sortedZ;
+
+    // sorted positions the neighbor lists were built from
+    std::vector<float4> neighborPos;
+
+    std::vector<uint2> sortedKeys;   // scratch space for sorting (hash, index) pairs
+    std::vector<uint2> sortScratch;
+    std::vector<uint2> sortMoved;
+    std::vector<uint> sortCounts;
+
+    // the (hash, index) order of the last coherent sort, for the next one
+    std::vector<uint> sortOrder;
+    std::vector<uint> sortHashes;
+    std::vector<uint> cellRank;      // scratch space for numbering the occupied cells
+
+    // the sorted particles grouped by phase (fluid, gas, cloth, solid,
+    // rigid), each group in sorted order. The particles of phase class k
+    // are typeOrder[typeStart[k] .. typeStart[k + 1]), so the colliding
+    // ones (cloth and up) are the range from typeStart[CLOTH].
+    std::vector<uint> typeOrder;
+    uint typeStart[RIGID + 2];
+    std::vector<float4> permuted;    // scratch space for permuting the particle arrays in place
+
+    /*
+     *   SOLVER
+     */
+    std::vector<uint> distsI;
+    std::vector<float> dists;
+    std::vector<float> distCompliance;  // inverse stiffness, 0 for rigid constraints (XPBD)
+    std::vector<float> distLambda;      // Lagrange multipliers accumulated during a step
+
+    std::vector<uint> pointsI;
+    std::vector<float> points;
+    std::vector<float> pointCompliance;
+    std::vector<float3> pointLambda;
+
+    std::vector<float4> deltas;          // correction of the first particle of every constraint
+
+    // the distance constraints of every particle in compressed rows:
+    // those of particle i are distRows[distRowStart[i] .. distRowStart[i + 1]),
+    // as 2 * constraint + 1 if it is the second particle of the constraint.
+    // Rebuilt when constraints or particles were added or permuted.
+    std::vector<uint> distRows;
+    std::vector<uint> distRowStart;
+
+    std::vector<uint> occurences;     // number of constraints affecting a particle
+
+    // graph colouring of the distance constraints, no two constraints
+    // of a colour share a particle: the colour of every constraint and
+    // the colours taken by the constraints of every particle (a bit
+    // each). The constraints of colour k are
+    // distColourOrder[distColourStart[k] .. distColourStart[k + 1]),
+    // rebuilt when constraints were added.
+    std::vector<uint> distColour;
+    std::vector<unsigned long long> distColourMask;
+    std::vector<uint> distColourOrder;
+    std::vector<uint> distColourStart;
+
+    /*
+     *   SHARED
+     */
+    std::vector<float> Xstar;   // guess vectors
+    std::vector<float> W;       // vector of inverse masses
+    std::vector<int> phase;
+
+    // storage slot of every particle handle (its index in order of
+    // creation), the identity until permuteParticles() reorders them
+    std::vector<uint> particleSlot;
+    std::vector<uint> inverseOrder;  // scratch space, old slot -> new slot
+
+    SimContext() : params(), uniform(0.f, 1.f) {}
+};
+
+// the context bound to the calling thread with bindContext()
+SimContext &currentContext();
+
+#endif // CPU_CONTEXT_H
@@ -0,0 +1,22 @@
+/*
+ * Host stand-in for the CUDA toolkit's cuda_runtime.h.
+ *
+ * Only what the shared headers need is provided: the vector types
+ * and empty function space qualifiers, so helper_math.h compiles
+ * as plain C++.
+ */
+
+#ifndef CPU_CUDA_RUNTIME_H
+#define CPU_CUDA_RUNTIME_H
+
+#include "vector_types.h"
+
+#ifndef __host__
+#define __host__
+#endif
+
+#ifndef __device__
+#define __device__
+#endif
+
+#endif // CPU_CUDA_RUNTIME_H
@@ -0,0 +1,1056 @@
+/*
+ * Host implementation of the integration, grid and collision
+ * functions declared in wrappers.cuh. Every CUDA kernel of
+ * integration.cu becomes a parallel loop on the thread pool.
+ */
+
+#include <string.h>
+#include <algorithm>
+#include <mutex>
+#include <numeric>
+#include <vector>
+
+#include "context.h"
+#include "integration_kernel.h"
+#include "threadpool.h"
+#include "util.cuh"
+#include "wrappers.cuh"
+
+// particles searched for neighbors in one go
+#define NEIGHBOR_CHUNK 256
+
+// (hash, index) pairs sorted in one go, and the most bits of the hash
+// one radix sort pass looks at
+#define SORT_CHUNK 16384
+#define RADIX_BITS 11
+
+// pairs in the order of the grid: by hash, then by particle index
+static bool lessPair(const uint2 &a, const uint2 &b)
+{
+    return a.x < b.x || (a.x == b.x && a.y < b.y);
+}
+
+// turns the per particle counts stored in start[1..n] into row
+// offsets and sizes rows to hold all of them
+static void scanRows(std::vector<uint> &start, std::vector<uint> &rows)
+{
+    start[0] = 0;
+    std::partial_sum(start.begin() + 1, start.end(), start.begin() + 1);
+    rows.resize(start.back());
+}
+
+// Fills the neighbor rows of numRows rows (particles or clusters) with
+// findRow(index, row), into rows in compressed form with the band sizes
+// of every row. Every chunk of rows searches once into a buffer of its
+// own, the rows are copied together once their offsets are known.
+template <typename F>
+static void buildRows(SimContext &c, uint numRows, std::vector<uint> &rows, std::vector<uint> &rowStart,
+                      std::vector<uint3> &rowBands, const F &findRow)
+{
+    rowStart.resize(numRows + 1);
+    rowBands.resize(numRows);
+    uint *dRowStart = rowStart.data();
+    uint3 *dRowBands = rowBands.data();
+
+    uint numChunks = (numRows + NEIGHBOR_CHUNK - 1) / NEIGHBOR_CHUNK;
+    if (c.neighborChunks.size() < numChunks)
+        c.neighborChunks.resize(numChunks);
+    std::vector<uint> *chunks = c.neighborChunks.data();
+
+    parallelFor(numChunks, [&](uint chunk)
+    {
+        std::vector<uint> &buffer = chunks[chunk];
+        buffer.clear();
+
+        NeighborRow row;
+        uint end = std::min((chunk + 1) * NEIGHBOR_CHUNK, numRows);
+        for (uint index = chunk * NEIGHBOR_CHUNK; index < end; index++)
+        {
+            findRow(index, row);
+
+            for (int b = 0; b < NUM_BANDS; b++)
+                buffer.insert(buffer.end(), row.band[b].begin(), row.band[b].end());
+
+            dRowBands[index] = make_uint3(row.band[CONTACT_BAND].size(), row.band[FLUID_BAND].size(),
+                                          row.band[SDF_BAND].size());
+            dRowStart[index + 1] = row.band[CONTACT_BAND].size() + row.band[FLUID_BAND].size() +
+                                   row.band[SDF_BAND].size();
+        }
+    }, 1);
+
+    scanRows(rowStart, rows);
+    uint *dRows = rows.data();
+
+    parallelFor(numChunks, [&](uint chunk)
+    {
+        const std::vector<uint> &buffer = chunks[chunk];
+        if (!buffer.empty())
+            memcpy(dRows + dRowStart[chunk * NEIGHBOR_CHUNK], buffer.data(), buffer.size() * sizeof(uint));
+    }, 1);
+}
+
+// Splits the sorted particles into clusters of up to CLUSTER_SIZE
+// particles of the same block and finds their bounding boxes
+static void findClusters(const SimParams &params, const float4 *sortedPos, uint numParticles, ClusterSet &set)
+{
+    // the block of every particle first
+    set.clusterOf.resize(numParticles);
+    uint *clusterOf = set.clusterOf.data();
+    parallelFor(numParticles, [=, &params](uint i)
+    {
+        int3 gridPos = calcGridPos(params, make_float3(sortedPos[i]));
+        clusterOf[i] = calcBlockHash(params, calcBlockPos(params, gridPos));
+    });
+
+    set.start.clear();
+    uint lastBlock = EMPTY_CELL;
+    for (uint i = 0; i < numParticles; i++)
+    {
+        uint block = clusterOf[i];
+        if (block != lastBlock || i - set.start.back() == CLUSTER_SIZE)
+            set.start.push_back(i);
+        lastBlock = block;
+        clusterOf[i] = set.start.size() - 1;
+    }
+    set.start.push_back(numParticles);
+
+    uint numClusters = set.start.size() - 1;
+    set.lo.resize(numClusters);
+    set.hi.resize(numClusters);
+    const uint *start = set.start.data();
+    float3 *lo = set.lo.data();
+    float3 *hi = set.hi.data();
+
+    parallelFor(numClusters, [=](uint cluster)
+    {
+        float3 pos = make_float3(sortedPos[start[cluster]]);
+        lo[cluster] = pos;
+        hi[cluster] = pos;
+        for (uint i = start[cluster] + 1; i < start[cluster + 1]; i++)
+        {
+            pos = make_float3(sortedPos[i]);
+            lo[cluster] = fminf(lo[cluster], pos);
+            hi[cluster] = fmaxf(hi[cluster], pos);
+        }
+    });
+}
+
+// copies the current particle data into the lanes of the clusters. The
+// sdf particles have no masses or phases, they are packed as static
+// solids.
+static void packClusters(ClusterSet &set, const float4 *sortedPos, const float *sortedW, const int *sortedPhase)
+{
+    uint numClusters = set.start.size() - 1;
+    set.lanes.resize(numClusters);
+    const uint *start = set.start.data();
+    Cluster *lanes = set.lanes.data();
+
+    parallelFor(numClusters, [=](uint cluster)
+    {
+        Cluster &lane = lanes[cluster];
+        uint size = start[cluster + 1] - start[cluster];
+        for (uint l = 0; l < CLUSTER_SIZE; l++)
+        {
+            uint i = start[cluster] + l;
+            float4 pos = make_float4(EMPTY_LANE_POS);
+            float w = 1.f;
+            int phase = -1;
+
+            if (l < size)
+            {
+                pos = sortedPos[i];
+                w = sortedW ? sortedW[i] : 0.f;
+                phase = sortedPhase ? sortedPhase[i] : SOLID;
+            }
+
+            lane.pos.x[l] = pos.x;
+            lane.pos.y[l] = pos.y;
+            lane.pos.z[l] = pos.z;
+            lane.w[l] = w;
+            lane.phase[l] = phase;
+        }
+    }, 64);
+}
+
+// Stable LSD radix sort of the pairs by the low sortBits bits of their
+// hash, in passes of at most RADIX_BITS bits. Every chunk of pairs
+// counts its digits, the offsets of all chunks are found in one scan
+// and every chunk scatters its pairs on its own.
+static void radixSortPairs(SimContext &c, std::vector<uint2> &pairs, uint sortBits)
+{
+    uint n = pairs.size();
+    uint numPasses = (sortBits + RADIX_BITS - 1) / RADIX_BITS;
+    if (numPasses == 0)
+        return;
+
+    uint digitBits = (sortBits + numPasses - 1) / numPasses;
+    uint numDigits = 1u << digitBits;
+    uint numChunks = (n + SORT_CHUNK - 1) / SORT_CHUNK;
+
+    c.sortScratch.resize(n);
+    c.sortCounts.resize(numChunks * numDigits);
+    uint *counts = c.sortCounts.data();
+
+    for (uint pass = 0; pass < numPasses; pass++)
+    {
+        uint shift = pass * digitBits;
+        uint mask = numDigits - 1;
+        const uint2 *in = pairs.data();
+        uint2 *out = c.sortScratch.data();
+
+        parallelFor(numChunks, [=](uint chunk)
+        {
+            uint *chunkCounts = counts + chunk * numDigits;
+            memset(chunkCounts, 0, numDigits * sizeof(uint));
+
+            uint end = std::min((chunk + 1) * SORT_CHUNK, n);
+            for (uint i = chunk * SORT_CHUNK; i < end; i++)
+                chunkCounts[(in[i].x >> shift) & mask]++;
+        }, 1);
+
+        // a digit of a chunk goes after the smaller digits and after the
+        // same digit of the chunks before it
+        uint offset = 0;
+        for (uint digit = 0; digit < numDigits; digit++)
+        {
+            for (uint chunk = 0; chunk < numChunks; chunk++)
+            {
+                uint count = counts[chunk * numDigits + digit];
+                counts[chunk * numDigits + digit] = offset;
+                offset += count;
+            }
+        }
+
+        parallelFor(numChunks, [=](uint chunk)
+        {
+            uint *chunkOffsets = counts + chunk * numDigits;
+
+            uint end = std::min((chunk + 1) * SORT_CHUNK, n);
+            for (uint i = chunk * SORT_CHUNK; i < end; i++)
+                out[chunkOffsets[(in[i].x >> shift) & mask]++] = in[i];
+        }, 1);
+
+        pairs.swap(c.sortScratch);
+    }
+}
+
+// Sorts the pairs from the order of the previous sort: the particles that
+// kept their hash are still in order, the few others are sorted on their
+// own and merged in. Returns false, leaving the pairs alone, if too many
+// particles changed their hash for this to pay off.
+static bool repairSortedPairs(SimContext &c, const uint *gridParticleHash, uint numParticles,
+                              std::vector<uint2> &pairs)
+{
+    const uint *order = c.sortOrder.data();
+    const uint *prevHash = c.sortHashes.data();
+    uint numChunks = (numParticles + SORT_CHUNK - 1) / SORT_CHUNK;
+
+    // the particles of every chunk of the previous order that moved
+    c.sortCounts.resize(numChunks + 1);
+    uint *numMoved = c.sortCounts.data();
+    parallelFor(numChunks, [=](uint chunk)
+    {
+        uint end = std::min((chunk + 1) * SORT_CHUNK, numParticles);
+        uint moved = 0;
+        for (uint k = chunk * SORT_CHUNK; k < end; k++)
+            moved += gridParticleHash[order[k]] != prevHash[k];
+        numMoved[chunk + 1] = moved;
+    }, 1);
+
+    numMoved[0] = 0;
+    std::partial_sum(numMoved, numMoved + numChunks + 1, numMoved);
+    uint totalMoved = numMoved[numChunks];
+    if (totalMoved > numParticles / 8)
+        return false;
+
+    // split into the particles still in order and the moved ones
+    c.sortScratch.resize(numParticles - totalMoved);
+    c.sortMoved.resize(totalMoved);
+    uint2 *kept = c.sortScratch.data();
+    uint2 *moved = c.sortMoved.data();
+    parallelFor(numChunks, [=](uint chunk)
+    {
+        uint end = std::min((chunk + 1) * SORT_CHUNK, numParticles);
+        uint nextMoved = numMoved[chunk];
+        uint nextKept = chunk * SORT_CHUNK - nextMoved;
+        for (uint k = chunk * SORT_CHUNK; k < end; k++)
+        {
+            uint2 pair = make_uint2(gridParticleHash[order[k]], order[k]);
+            if (pair.x != prevHash[k])
+                moved[nextMoved++] = pair;
+            else
+                kept[nextKept++] = pair;
+        }
+    }, 1);
+
+    std::sort(c.sortMoved.begin(), c.sortMoved.end(), lessPair);
+
+    pairs.resize(numParticles);
+    std::merge(c.sortScratch.begin(), c.sortScratch.end(), c.sortMoved.begin(), c.sortMoved.end(), pairs.begin(),
+               lessPair);
+    return true;
+}
+
+// gathers the first n elements of data into the order given by
+// sortedIndex, using scratch (float4s, so suitably aligned) in between
+template <typename T>
+static void permuteArray(T *data, const uint *sortedIndex, uint n, std::vector<float4> &scratch)
+{
+    scratch.resize((n * sizeof(T) + sizeof(float4) - 1) / sizeof(float4));
+    T *permuted = (T *) scratch.data();
+
+    parallelFor(n, [=](uint i)
+    {
+        permuted[i] = data[sortedIndex[i]];
+    });
+    memcpy(data, permuted, n * sizeof(T));
+}
+
+// replaces every index by its new slot
+static void remapIndices(std::vector<uint> &indices, const uint *newSlot)
+{
+    uint *dIndices = indices.data();
+    parallelFor(indices.size(), [=](uint i)
+    {
+        dIndices[i] = newSlot[dIndices[i]];
+    });
+}
+
+// Groups the sorted particles for the pair sweeps. The particles of a
+// row of blocks (same block y and z) follow each other, and a pair in
+// the row of a particle reaches at most R = (H + skin) / block width
+// blocks further, at a higher or equal block z. Rows R + 1 apart in z or
+// 2R + 1 apart in y therefore never touch the same particles, so the
+// rows of one colour of that pattern can be swept in parallel. In
+// Z-order only the particles of a block follow each other and a pair
+// reaches R blocks in every direction, so the units are blocks and
+// their colours repeat every 2R + 1 blocks along all three axes.
+static void findColourUnits(SimContext &c, const float4 *sortedPos, uint numParticles)
+{
+    const SimParams &params = c.params;
+    bool morton = params.cellOrder == CELL_ORDER_MORTON;
+
+    float blockWidth = params.blockSize * params.cellSize.x;
+    uint reach = (uint) ceilf((H + params.neighborSkin) / blockWidth);
+    uint periodX = morton ? 2 * reach + 1 : 1;
+    uint periodY = 2 * reach + 1;
+    uint periodZ = morton ? 2 * reach + 1 : reach + 1;
+
+    // the runs of particles in one row (one block in Z-order), with
+    // their colour
+    std::vector<uint2> &units = c.pairUnits;
+    std::vector<uint> unitColour;
+    units.clear();
+
+    int3 maxBlock = make_int3(params.blockGridSize) - 1;
+    uint lastUnit = EMPTY_CELL;
+    for (uint i = 0; i < numParticles; i++)
+    {
+        int3 blockPos = calcBlockPos(params, calcGridPos(params, make_float3(sortedPos[i])));
+        blockPos = clamp(blockPos, make_int3(0), maxBlock);
+        uint unit = calcBlockHash(params, blockPos);
+        if (!morton)
+            unit /= params.blockGridSize.x;
+
+        if (unit != lastUnit)
+        {
+            if (!units.empty())
+                units.back().y = i;
+            units.push_back(make_uint2(i, numParticles));
+
+            uint x = blockPos.x % periodX;
+            uint y = blockPos.y % periodY;
+            uint z = blockPos.z % periodZ;
+            unitColour.push_back((z * periodY + y) * periodX + x);
+            lastUnit = unit;
+        }
+    }
+
+    // sort the runs by colour
+    c.colourStart.assign(periodZ * periodY * periodX + 1, 0);
+    for (uint u = 0; u < units.size(); u++)
+        c.colourStart[unitColour[u] + 1]++;
+    std::partial_sum(c.colourStart.begin(), c.colourStart.end(), c.colourStart.begin());
+
+    c.colourUnits.resize(units.size());
+    std::vector<uint> next(c.colourStart.begin(), c.colourStart.end() - 1);
+    for (uint u = 0; u < units.size(); u++)
+        c.colourUnits[next[unitColour[u]]++] = units[u];
+}
+
+// runs body(index) for the sorted particles of the phase classes first
+// to last (see sortByType)
+template <typename F>
+static void parallelForTypes(const SimContext &c, int first, int last, const F &body, uint minGrain)
+{
+    const uint *order = c.typeOrder.data() + c.typeStart[first];
+    parallelFor(c.typeStart[last + 1] - c.typeStart[first], [&](uint i)
+    {
+        body(order[i]);
+    }, minGrain);
+}
+
+// runs body(index) for every particle, one colour of findColourUnits
+// after the other
+template <typename F>
+static void sweepColours(const SimContext &c, const F &body)
+{
+    for (uint colour = 0; colour + 1 < c.colourStart.size(); colour++)
+    {
+        const uint2 *units = c.colourUnits.data() + c.colourStart[colour];
+        parallelFor(c.colourStart[colour + 1] - c.colourStart[colour], [&](uint u)
+        {
+            for (uint index = units[u].x; index < units[u].y; index++)
+                body(index);
+        }, 1);
+    }
+}
+
+extern "C"
+{
+    /*****************************************************************************
+     *                              INITIALIZATION
+     *****************************************************************************/
+
+
+    void setParameters(SimParams *hostParams)
+    {
+        currentContext().params = *hostParams;
+    }
+
+
+    /*****************************************************************************
+     *                              UPDATE POSITIONS
+     *****************************************************************************/
+
+    void integrateSystem(float *pos, float deltaTime, uint numParticles, float prevDeltaTime, uint numPending,
+                         uint *gridParticleHash, uint *gridParticleIndex)
+    {
+        SimContext &c = currentContext();
+        const SimParams &params = c.params;
+
+        float4 *pos4 = (float4 *) pos;
+        float4 *vel4 = (float4 *) c.V.data();
+        float4 *Xstar = (float4 *) c.Xstar.data();
+
+        // every attribute is read and written once
+        parallelFor(numParticles, [=, &params](uint i)
+        {
+            float4 p = pos4[i];
+
+            // the velocity the last step ended with
+            if (i < numPending)
+                vel4[i] = (p - Xstar[i]) / prevDeltaTime;
+
+            // keep the current position for reference later, then guess
+            // the new one based on forces
+            Xstar[i] = p;
+            integrateParticle(params, p, vel4[i], deltaTime);
+            pos4[i] = p;
+
+            if (gridParticleHash != NULL)
+            {
+                gridParticleHash[i] = calcGridHash(params, calcGridPos(params, make_float3(p)));
+                gridParticleIndex[i] = i;
+            }
+        });
+    }
+
+
+    /*****************************************************************************
+     *                              BUILD GRID
+     *****************************************************************************/
+
+    void calcHash(uint *gridParticleHash, uint *gridParticleIndex, float *pos, int numParticles)
+    {
+        const SimParams &params = currentContext().params;
+        const float4 *pos4 = (const float4 *) pos;
+
+        parallelFor(numParticles, [=](uint i)
+        {
+            int3 gridPos = calcGridPos(params, make_float3(pos4[i]));
+            gridParticleHash[i] = calcGridHash(params, gridPos);
+            gridParticleIndex[i] = i;
+        });
+    }
+
+
+    void reorderDataAndFindCellStart(uint  *blockKeys,
+                                     unsigned long long *blockCells,
+                                     uint  *blockFirstCell,
+                                     uint  *cellStart,
+                                     uint  *cellEnd,
+                                     float *sortedPos,
+                                     float *sortedW,
+                                     int   *sortedPhase,
+                                     uint  *gridParticleHash,
+                                     uint  *gridParticleIndex,
+                                     float *oldPos,
+                                     uint   numParticles,
+                                     uint   tableSize)
+    {
+        SimContext &c = currentContext();
+        const SimParams &params = c.params;
+        uint cellsPerBlock = params.blockSize * params.blockSize * params.blockSize;
+        uint tableMask = tableSize - 1;
+
+        // set all table slots to empty
+        memset(blockKeys, 0xff, tableSize * sizeof(uint));
+        memset(blockCells, 0, tableSize * sizeof(unsigned long long));
+
+        const float *dW = getWRawPtr();
+        const int *dPhase = getPhaseRawPtr();
+        const float4 *oldPos4 = (const float4 *) oldPos;
+        float4 *sortedPos4 = (float4 *) sortedPos;
+
+        // mark the first particle of every cell
+        c.cellRank.resize(numParticles);
+        uint *cellRank = c.cellRank.data();
+
+        parallelFor(numParticles, [=](uint index)
+        {
+            uint hash = gridParticleHash[index];
+            cellRank[index] = index == 0 || hash != gridParticleHash[index - 1];
+
+            // use the sorted index to reorder the particle data
+            uint sortedIndex = gridParticleIndex[index];
+
+            if (sortedPos != NULL)
+                sortedPos4[index] = oldPos4[sortedIndex];
+            if (sortedW != NULL)
+                sortedW[index] = dW[sortedIndex];
+            if (sortedPhase != NULL)
+                sortedPhase[index] = dPhase[sortedIndex];
+        });
+
+        // number the occupied cells in key order
+        std::partial_sum(c.cellRank.begin(), c.cellRank.end(), c.cellRank.begin());
+
+        parallelFor(numParticles, [=](uint index)
+        {
+            uint hash = gridParticleHash[index];
+            uint cell = cellRank[index] - 1;
+
+            // the first particle of a cell adds it to its block
+            if (index == 0 || hash != gridParticleHash[index - 1])
+            {
+                cellStart[cell] = index;
+
+                uint block = hash / cellsPerBlock;
+                uint slot = insertBlock(blockKeys, tableMask, block);
+                __sync_fetch_and_or(&blockCells[slot], 1ull << (hash % cellsPerBlock));
+
+                if (index == 0 || block != gridParticleHash[index - 1] / cellsPerBlock)
+                    blockFirstCell[slot] = cell;
+            }
+
+            // the last particle of a cell marks its end
+            if (index == numParticles - 1 || hash != gridParticleHash[index + 1])
+                cellEnd[cell] = index + 1;
+        });
+    }
+
+    void sortParticles(uint *dGridParticleHash, uint *dGridParticleIndex, uint numParticles, uint sortBits,
+                       bool coherent)
+    {
+        SimContext &c = currentContext();
+        std::vector<uint2> &sortedKeys = c.sortedKeys;
+
+        // calcHash leaves the indices in order, so all sorts give pairs
+        // ordered by hash and then by index
+        bool repaired = false;
+        if (c.params.gridSort == GRID_SORT_INCREMENTAL && coherent && c.sortOrder.size() == numParticles)
+            repaired = repairSortedPairs(c, dGridParticleHash, numParticles, sortedKeys);
+
+        if (!repaired)
+        {
+            sortedKeys.resize(numParticles);
+            uint2 *pairs = sortedKeys.data();
+            parallelFor(numParticles, [=](uint i)
+            {
+                pairs[i] = make_uint2(dGridParticleHash[i], dGridParticleIndex[i]);
+            });
+
+            if (c.params.gridSort == GRID_SORT_COMPARISON)
+            {
+                // stable, like the radix sort behind thrust::sort_by_key
+                std::stable_sort(sortedKeys.begin(), sortedKeys.end(), [](const uint2 &a, const uint2 &b)
+                {
+                    return a.x < b.x;
+                });
+            }
+            else
+                radixSortPairs(c, sortedKeys, sortBits);
+        }
+
+        const uint2 *pairs = sortedKeys.data();
+        parallelFor(numParticles, [=](uint i)
+        {
+            dGridParticleHash[i] = pairs[i].x;
+            dGridParticleIndex[i] = pairs[i].y;
+        });
+
+        // the next coherent sort starts from here
+        if (coherent)
+        {
+            c.sortOrder.assign(dGridParticleIndex, dGridParticleIndex + numParticles);
+            c.sortHashes.assign(dGridParticleHash, dGridParticleHash + numParticles);
+        }
+    }
+
+
+    float reorderPositions(float *sortedPos, uint *gridParticleIndex, float *oldPos, uint numParticles)
+    {
+        SimContext &c = currentContext();
+
+        const float4 *oldPos4 = (const float4 *) oldPos;
+        const float4 *neighborPos = c.neighborPos.data();
+        float4 *sortedPos4 = (float4 *) sortedPos;
+
+        // gather, and find the largest squared distance from the neighbor
+        // search positions on the way
+        float maxDist2 = 0.f;
+        std::mutex maxMutex;
+
+        ThreadPool::instance().parallelFor(0, numParticles, [&](uint begin, uint end)
+        {
+            float chunkMax = 0.f;
+            for (uint i = begin; i < end; i++)
+            {
+                float4 pos = oldPos4[gridParticleIndex[i]];
+                sortedPos4[i] = pos;
+
+                float3 moved = make_float3(pos - neighborPos[i]);
+                chunkMax = fmaxf(chunkMax, dot(moved, moved));
+            }
+
+            std::lock_guard<std::mutex> lock(maxMutex);
+            maxDist2 = fmaxf(maxDist2, chunkMax);
+        });
+
+        return sqrtf(maxDist2);
+    }
+
+    void permuteParticles(float *pos, float *sortedPos, uint *gridParticleIndex, uint numParticles)
+    {
+        SimContext &c = currentContext();
+        const uint *sortedIndex = gridParticleIndex;
+
+        // positions go through sortedPos, which keeps the copy
+        float4 *pos4 = (float4 *) pos;
+        float4 *sortedPos4 = (float4 *) sortedPos;
+        parallelFor(numParticles, [=](uint i)
+        {
+            sortedPos4[i] = pos4[sortedIndex[i]];
+        });
+        memcpy(pos, sortedPos, numParticles * sizeof(float4));
+
+        permuteArray((float4 *) c.V.data(), sortedIndex, numParticles, c.permuted);
+        permuteArray((float4 *) c.Xstar.data(), sortedIndex, numParticles, c.permuted);
+        permuteArray(c.W.data(), sortedIndex, numParticles, c.permuted);
+        permuteArray(c.phase.data(), sortedIndex, numParticles, c.permuted);
+        permuteArray(c.ros.data(), sortedIndex, numParticles, c.permuted);
+        permuteArray(c.occurences.data(), sortedIndex, numParticles, c.permuted);
+        permuteArray(c.distColourMask.data(), sortedIndex, numParticles, c.permuted);
+
+        // everything that refers to particles by slot follows them
+        c.inverseOrder.resize(numParticles);
+        uint *newSlot = c.inverseOrder.data();
+        parallelFor(numParticles, [=](uint i)
+        {
+            newSlot[sortedIndex[i]] = i;
+        });
+
+        remapIndices(c.distsI, newSlot);
+        remapIndices(c.pointsI, newSlot);
+        remapIndices(c.particleSlot, newSlot);
+
+        // the constraint rows of the particles are built again from there
+        c.distRowStart.clear();
+
+        // the sorted order is the storage order now
+        if (c.sortOrder.size() == numParticles)
+            std::iota(c.sortOrder.begin(), c.sortOrder.end(), 0u);
+
+        parallelFor(numParticles, [=](uint i)
+        {
+            gridParticleIndex[i] = i;
+        });
+    }
+
+
+    /*****************************************************************************
+     *                              PROCESS COLLISIONS
+     *****************************************************************************/
+
+    void sortByType(int *sortedPhase, uint numParticles)
+    {
+        SimContext &c = currentContext();
+
+        // a stable counting sort by phase class, rigid bodies all fall
+        // into the last class. Chunks count their classes, then write
+        // them out after the same class of the chunks before them.
+        const uint numTypes = RIGID + 1;
+        uint numChunks = (numParticles + SORT_CHUNK - 1) / SORT_CHUNK;
+        c.sortCounts.resize(numChunks * numTypes);
+        uint *counts = c.sortCounts.data();
+
+        parallelFor(numChunks, [=](uint chunk)
+        {
+            uint *chunkCounts = counts + chunk * numTypes;
+            memset(chunkCounts, 0, numTypes * sizeof(uint));
+
+            uint end = std::min((chunk + 1) * SORT_CHUNK, numParticles);
+            for (uint i = chunk * SORT_CHUNK; i < end; i++)
+                chunkCounts[min(max(sortedPhase[i], FLUID), RIGID)]++;
+        }, 1);
+
+        uint offset = 0;
+        for (uint type = 0; type < numTypes; type++)
+        {
+            c.typeStart[type] = offset;
+            for (uint chunk = 0; chunk < numChunks; chunk++)
+            {
+                uint count = counts[chunk * numTypes + type];
+                counts[chunk * numTypes + type] = offset;
+                offset += count;
+            }
+        }
+        c.typeStart[numTypes] = offset;
+
+        c.typeOrder.resize(numParticles);
+        uint *typeOrder = c.typeOrder.data();
+        parallelFor(numChunks, [=](uint chunk)
+        {
+            uint *chunkOffsets = counts + chunk * numTypes;
+
+            uint end = std::min((chunk + 1) * SORT_CHUNK, numParticles);
+            for (uint i = chunk * SORT_CHUNK; i < end; i++)
+                typeOrder[chunkOffsets[min(max(sortedPhase[i], FLUID), RIGID)]++] = i;
+        }, 1);
+    }
+
+    void collideWorld(float *pos, float *sortedPos, uint numParticles, int3 minBounds, int3 maxBounds)
+    {
+        SimContext &c = currentContext();
+        const SimParams &params = c.params;
+
+        float4 *pos4 = (float4 *) pos;
+        const float4 *Xstar = (const float4 *) getXstarRawPtr();
+        const int *phase = getPhaseRawPtr();
+
+        // create random vars for boundary collisions
+        for (uint i = 0; i < 6; i++)
+            c.rands[i] = c.uniform(c.gen);
+        const float *rands = c.rands;
+
+        parallelFor(numParticles, [=](uint i)
+        {
+            collideWorldParticle(params, pos4[i], Xstar[i], phase[i], rands, minBounds, maxBounds);
+        });
+    }
+
+    void findNeighbors(float *sortedPos,
+                       float *sortedW,
+                       int   *sortedPhase,
+                       float *sortedPosSdf,
+                       uint  *blockKeys,
+                       unsigned long long *blockCells,
+                       uint  *blockFirstCell,
+                       uint  *cellStart,
+                       uint  *cellEnd,
+                       uint  *blockKeysSdf,
+                       unsigned long long *blockCellsSdf,
+                       uint  *blockFirstCellSdf,
+                       uint  *cellStartSdf,
+                       uint  *cellEndSdf,
+                       uint   numParticles,
+                       uint   numParticlesSdf,
+                       uint   tableSize,
+                       uint   tableSizeSdf)
+    {
+        GridData grid = { (const float4 *) sortedPos, sortedW, sortedPhase, blockKeys, blockCells, blockFirstCell,
+                          cellStart, cellEnd, tableSize - 1 };
+        GridData sdf = { (const float4 *) sortedPosSdf, NULL, NULL, blockKeysSdf, blockCellsSdf, blockFirstCellSdf,
+                         cellStartSdf, cellEndSdf, tableSizeSdf - 1 };
+
+        SimContext &c = currentContext();
+        const SimParams &params = c.params;
+
+        if (params.clusterPairs)
+        {
+            // rows of clusters instead of particles
+            ClusterSet &clusters = c.clusters;
+            ClusterSet &clustersSdf = c.sdfClusters;
+            findClusters(params, grid.sortedPos, numParticles, clusters);
+            findClusters(params, sdf.sortedPos, numParticlesSdf, clustersSdf);
+            packClusters(clustersSdf, sdf.sortedPos, NULL, NULL);
+
+            buildRows(c, clusters.start.size() - 1, c.clusterNeighbors, c.clusterNeighborStart,
+                      c.clusterNeighborBands, [&](uint cluster, NeighborRow &row)
+            {
+                findClusterRow(params, cluster, clusters.start.data(), grid, clusters.clusterOf.data(),
+                               clusters.lo.data(), clusters.hi.data(), sdf, numParticlesSdf,
+                               clustersSdf.clusterOf.data(), clustersSdf.lo.data(), clustersSdf.hi.data(), row);
+            });
+        }
+        else
+        {
+            buildRows(c, numParticles, c.neighbors, c.neighborStart, c.neighborBands, [&](uint index, NeighborRow &row)
+            {
+                findNeighborRow(params, index, grid, sdf, numParticlesSdf, row);
+            });
+
+            if (params.pairTraversal)
+                findColourUnits(c, grid.sortedPos, numParticles);
+        }
+
+        // the lists hold until a particle moved half the skin away
+        c.neighborPos.assign(grid.sortedPos, grid.sortedPos + numParticles);
+    }
+
+    void collide(float *particles,
+                 float *sortedPos,
+                 float *sortedW,
+                 int   *sortedPhase,
+                 float *sortedPosSdf,
+                 uint  *gridParticleIndex,
+                 uint   numParticles,
+                 uint   numParticlesSdf)
+    {
+        GridData grid = { (const float4 *) sortedPos, sortedW, sortedPhase, NULL, NULL, NULL, NULL, NULL, 0 };
+        GridData sdf = { (const float4 *) sortedPosSdf, NULL, NULL, NULL, NULL, NULL, NULL, NULL, 0 };
+
+        SimContext &c = currentContext();
+        const SimParams &params = c.params;
+
+        const uint *dNeighbors = c.neighbors.data();
+        const uint *dNeighborStart = c.neighborStart.data();
+        const uint3 *dNeighborBands = c.neighborBands.data();
+        const float4 *dXstar = (const float4 *) getXstarRawPtr();
+
+        float4 *newPos = (float4 *) particles;
+
+        if (params.clusterPairs)
+        {
+            ClusterSet &clusters = c.clusters;
+            packClusters(clusters, grid.sortedPos, grid.sortedW, grid.sortedPhase);
+
+            // the positions at the start of the step, for friction
+            uint numClusters = clusters.start.size() - 1;
+            c.clusterPrev.resize(numClusters);
+            ClusterLanes *dPrev = c.clusterPrev.data();
+            const uint *dClusterStart = clusters.start.data();
+            parallelFor(numClusters, [&](uint cluster)
+            {
+                uint first = dClusterStart[cluster];
+                uint size = dClusterStart[cluster + 1] - first;
+                for (uint l = 0; l < CLUSTER_SIZE; l++)
+                {
+                    float4 pos = l < size ? dXstar[gridParticleIndex[first + l]] : make_float4(EMPTY_LANE_POS);
+                    dPrev[cluster].x[l] = pos.x;
+                    dPrev[cluster].y[l] = pos.y;
+                    dPrev[cluster].z[l] = pos.z;
+                }
+            }, 64);
+
+            const Cluster *dClusters = clusters.lanes.data();
+            const Cluster *dClustersSdf = c.sdfClusters.lanes.data();
+            const uint *dClusterNeighbors = c.clusterNeighbors.data();
+            const uint *dClusterNeighborStart = c.clusterNeighborStart.data();
+            const uint3 *dClusterNeighborBands = c.clusterNeighborBands.data();
+
+            parallelFor(numClusters, [&](uint cluster)
+            {
+                collideCluster(params, cluster, newPos, gridParticleIndex, dClusterStart, dClusters, dPrev,
+                               dClustersSdf, dClusterNeighbors, dClusterNeighborStart, dClusterNeighborBands);
+            }, 16);
+            return;
+        }
+
+        if (!params.pairTraversal)
+        {
+            parallelForTypes(c, CLOTH, RIGID, [&](uint index)
+            {
+                collideParticle(params, index, newPos, dXstar, gridParticleIndex, grid, sdf, dNeighbors, dNeighborStart,
+                                dNeighborBands);
+            }, 64);
+            return;
+        }
+
+        // count the contacts of both sides of every pair, then resolve them
+        c.pairSums.assign(numParticles, make_float4(0.f));
+        c.pairCounts.assign(numParticles, 0.f);
+        float4 *dSums = c.pairSums.data();
+        float *dCounts = c.pairCounts.data();
+
+        sweepColours(c, [&](uint index)
+        {
+            countContactPairs(params, index, grid, sdf, dNeighbors, dNeighborStart, dNeighborBands, dCounts);
+        });
+
+        sweepColours(c, [&](uint index)
+        {
+            collidePairs(params, index, dXstar, gridParticleIndex, grid, dNeighbors, dNeighborStart, dNeighborBands,
+                         dCounts, dSums);
+        });
+
+        parallelForTypes(c, CLOTH, RIGID, [&](uint index)
+        {
+            applyContactPairs(params, index, newPos, dXstar, gridParticleIndex, grid, sdf, dNeighbors, dNeighborStart,
+                              dNeighborBands, dCounts, dSums);
+        }, 64);
+    }
+
+
+    /*****************************************************************************
+     *                              UPDATE VELOCITIES
+     *****************************************************************************/
+
+    void calcVelocity(float *dpos, float deltaTime, uint numParticles)
+    {
+        const float4 *Xstar = (const float4 *) getXstarRawPtr();
+        const float4 *pos = (const float4 *) dpos;
+        float4 *vel = (float4 *) currentContext().V.data();
+
+        parallelFor(numParticles, [=](uint i)
+        {
+            vel[i] = (pos[i] - Xstar[i]) / deltaTime;
+        });
+    }
+
+
+    /*****************************************************************************
+     *                              SOLVE FLUIDS
+     *****************************************************************************/
+    void solveFluids(float *sortedPos,
+                     float *sortedW,
+                     int   *sortedPhase,
+                     uint  *gridParticleIndex,
+                     float *particles,
+                     uint   numParticles)
+    {
+        GridData grid = { (const float4 *) sortedPos, sortedW, sortedPhase, NULL, NULL, NULL, NULL, NULL, 0 };
+
+        SimContext &c = currentContext();
+
+        float *dLambda = c.lambda.data();
+        const uint *dNeighbors = c.neighbors.data();
+        const uint *dNeighborStart = c.neighborStart.data();
+        const uint3 *dNeighborBands = c.neighborBands.data();
+        const float *dRos = c.ros.data();
+        float4 *dParticles = (float4 *) particles;
+
+        if (c.params.clusterPairs)
+        {
+            ClusterSet &clusters = c.clusters;
+            packClusters(clusters, grid.sortedPos, grid.sortedW, grid.sortedPhase);
+
+            uint numClusters = clusters.start.size() - 1;
+            const uint *dClusterStart = clusters.start.data();
+            const Cluster *dClusters = clusters.lanes.data();
+            const uint *dClusterNeighbors = c.clusterNeighbors.data();
+            const uint *dClusterNeighborStart = c.clusterNeighborStart.data();
+            const uint3 *dClusterNeighborBands = c.clusterNeighborBands.data();
+
+            parallelFor(numClusters, [&](uint cluster)
+            {
+                findLambdaCluster(cluster, dLambda, gridParticleIndex, dClusterStart, dClusters, dClusterNeighbors,
+                                  dClusterNeighborStart, dClusterNeighborBands, dRos);
+            }, 16);
+
+            // the lambdas by lane
+            c.clusterLambda.resize(numClusters * CLUSTER_SIZE);
+            float *dClusterLambda = c.clusterLambda.data();
+            parallelFor(numClusters, [&](uint cluster)
+            {
+                uint first = dClusterStart[cluster];
+                uint size = dClusterStart[cluster + 1] - first;
+                for (uint l = 0; l < CLUSTER_SIZE; l++)
+                    dClusterLambda[cluster * CLUSTER_SIZE + l] = l < size ? dLambda[first + l] : 0.f;
+            }, 64);
+
+            parallelFor(numClusters, [&](uint cluster)
+            {
+                solveFluidCluster(cluster, dClusterLambda, gridParticleIndex, dClusterStart, dClusters, dParticles,
+                                  dClusterNeighbors, dClusterNeighborStart, dClusterNeighborBands, dRos);
+            }, 16);
+            return;
+        }
+
+        if (!c.params.pairTraversal && c.params.simdFluids)
+        {
+            c.sortedX.resize(numParticles);
+            c.sortedY.resize(numParticles);
+            c.sortedZ.resize(numParticles);
+            float *dX = c.sortedX.data(), *dY = c.sortedY.data(), *dZ = c.sortedZ.data();
+            parallelFor(numParticles, [=](uint i)
+            {
+                float4 pos = grid.sortedPos[i];
+                dX[i] = pos.x;
+                dY[i] = pos.y;
+                dZ[i] = pos.z;
+            });
+
+            parallelForTypes(c, FLUID, FLUID, [&](uint index)
+            {
+                findLambdaLanes(index, dLambda, gridParticleIndex, grid, dX, dY, dZ, dNeighbors, dNeighborStart,
+                                dNeighborBands, dRos);
+            }, 64);
+
+            parallelForTypes(c, FLUID, FLUID, [&](uint index)
+            {
+                solveFluidLanes(index, dLambda, gridParticleIndex, grid, dX, dY, dZ, dParticles, dNeighbors,
+                                dNeighborStart, dNeighborBands, dRos);
+            }, 64);
+            return;
+        }
+
+        if (!c.params.pairTraversal)
+        {
+            parallelForTypes(c, FLUID, FLUID, [&](uint index)
+            {
+                findLambda(index, dLambda, gridParticleIndex, grid, dNeighbors, dNeighborStart, dNeighborBands, dRos);
+            }, 64);
+
+            parallelForTypes(c, FLUID, FLUID, [&](uint index)
+            {
+                solveFluidParticle(index, dLambda, gridParticleIndex, grid, dParticles, dNeighbors, dNeighborStart,
+                                   dNeighborBands, dRos);
+            }, 64);
+            return;
+        }
+
+        // the density terms of both sides of every pair, then lambda
+        c.pairSums.assign(numParticles, make_float4(0.f));
+        c.pairCounts.assign(numParticles, 0.f);
+        float4 *dSums = c.pairSums.data();
+        float *dDenoms = c.pairCounts.data();
+
+        sweepColours(c, [&](uint index)
+        {
+            findLambdaPairs(index, gridParticleIndex, grid, dNeighbors, dNeighborStart, dNeighborBands, dRos, dSums,
+                            dDenoms);
+        });
+
+        parallelForTypes(c, FLUID, FLUID, [&](uint index)
+        {
+            lambdaFromPairs(index, dLambda, gridParticleIndex, grid, dRos, dSums, dDenoms);
+        }, 64);
+
+        // and the position corrections
+        c.pairSums.assign(numParticles, make_float4(0.f));
+
+        sweepColours(c, [&](uint index)
+        {
+            solveFluidPairs(index, dLambda, grid, dNeighbors, dNeighborStart, dNeighborBands, dSums);
+        });
+
+        parallelForTypes(c, FLUID, FLUID, [&](uint index)
+        {
+            uint origIndex = gridParticleIndex[index];
+            float4 sum = dSums[index];
+            dParticles[origIndex] += make_float4(make_float3(sum) / (dRos[origIndex] + sum.w), 0.f);
+        }, 64);
+    }
+}
@@ -0,0 +1,1732 @@
+#ifndef CPU_INTEGRATION_KERNEL_H
+#define CPU_INTEGRATION_KERNEL_H
+
+#include <math.h>
+#include <vector>
+
+#include "cluster.h"
+#include "helper_math.h"
+#include "kernel.cuh"
+#include "constants.cuh"
+#include "shared_variables.cuh"
+
+// sorted particle data of one grid, replaces the texture bindings.
+// The occupied blocks are kept in a hash table of tableMask + 1 slots:
+// blockKeys holds the block of each slot (EMPTY_CELL when unused),
+// blockCells has a bit for each occupied cell of the block and
+// blockFirstCell is the index of its first one. cellStart and cellEnd
+// are stored densely for the occupied cells, in key order.
+struct GridData
+{
+    const float4 *sortedPos;
+    const float  *sortedW;
+    const int    *sortedPhase;
+    const uint   *blockKeys;
+    const unsigned long long *blockCells;
+    const uint   *blockFirstCell;
+    const uint   *cellStart;
+    const uint   *cellEnd;
+    uint          tableMask;
+};
+
+#define EMPTY_CELL 0xffffffff
+
+
+inline void integrateParticle(const SimParams &params, float4 &posData, const float4 &velData, float deltaTime)
+{
+    float3 pos = make_float3(posData);
+    float3 vel = make_float3(velData);
+
+    vel += params.gravity * deltaTime;
+
+    // new position = old position + velocity * deltaTime
+    pos += vel * deltaTime;
+
+    posData = make_float4(pos, posData.w);
+}
+
+
+inline void collideWorldParticle(const SimParams &params, float4 &posData, const float4 &Xstar, int phase,
+                                 const float *rands, int3 minBounds, int3 maxBounds)
+{
+    float3 epos = make_float3(posData);
+    float3 pos = make_float3(Xstar);
+
+    float3 n = make_float3(0.f);
+
+    float d = params.particleRadius;
+    float eps = d * 0.f;
+    if (phase < SOLID)
+        eps = d * 0.01f;
+
+    if (epos.y < minBounds.y + params.particleRadius)
+    {
+        epos.y = minBounds.y + params.particleRadius + rands[5] * eps;
+        n += make_float3(0,1,0);
+    }
+
+    eps = d * 0.01f;
+
+    if (epos.x > maxBounds.x - params.particleRadius)
+    {
+        epos.x = maxBounds.x - (params.particleRadius + rands[0] * eps);
+        n += make_float3(-1,0,0);
+    }
+
+    if (epos.x < minBounds.x + params.particleRadius)
+    {
+        epos.x = minBounds.x + (params.particleRadius + rands[1] * eps);
+        n += make_float3(1,0,0);
+    }
+
+    if (epos.y > maxBounds.y - params.particleRadius)
+    {
+        epos.y = maxBounds.y - (params.particleRadius + rands[2] * eps);
+        n += make_float3(0,-1,0);
+    }
+
+#ifndef TWOD
+    if (epos.z > maxBounds.z - params.particleRadius)
+    {
+        epos.z = maxBounds.z - (params.particleRadius + rands[3] * eps);
+        n += make_float3(0,0,-1);
+    }
+
+    if (epos.z < minBounds.z + params.particleRadius)
+    {
+        epos.z = minBounds.z + (params.particleRadius + rands[4] * eps);
+        n += make_float3(0,0,1);
+    }
+#endif
+
+#ifdef TWOD
+    epos.z = ZPOS; // 2D
+    pos.z = ZPOS;
+#endif
+
+    if (length(n) < EPS || phase < CLOTH)
+    {
+        posData = make_float4(epos, posData.w);
+        return;
+    }
+
+    float3 dp = (epos - pos);
+    float3 dpt = dp - dot(dp, n) * n;
+    float ldpt = length(dpt);
+
+    if (ldpt < EPS)
+    {
+        posData = make_float4(epos, posData.w);
+        return;
+    }
+
+    if (ldpt < sqrtf(S_FRICTION) * d)
+        epos -= dpt;
+    else
+        epos -= dpt * fminf(sqrtf(K_FRICTION) * d / ldpt, 1.f);
+
+    posData = make_float4(epos, posData.w);
+}
+
+
+// calculate position in uniform grid
+inline int3 calcGridPos(const SimParams &params, float3 p)
+{
+    int3 gridPos;
+    gridPos.x = (int)floorf((p.x - params.worldOrigin.x) / params.cellSize.x);
+    gridPos.y = (int)floorf((p.y - params.worldOrigin.y) / params.cellSize.y);
+    gridPos.z = (int)floorf((p.z - params.worldOrigin.z) / params.cellSize.z);
+    return gridPos;
+}
+
+// block containing a grid cell (rounding towards negative infinity)
+inline int3 calcBlockPos(const SimParams &params, int3 gridPos)
+{
+    int s = params.blockSize;
+    return make_int3((gridPos.x >= 0 ? gridPos.x : gridPos.x - s + 1) / s,
+                     (gridPos.y >= 0 ? gridPos.y : gridPos.y - s + 1) / s,
+                     (gridPos.z >= 0 ? gridPos.z : gridPos.z - s + 1) / s);
+}
+
+// spreads the lower 10 bits of v to every third bit
+inline uint spreadBits(uint v)
+{
+    v &= 0x3ff;
+    v = (v | (v << 16)) & 0x030000ff;
+    v = (v | (v << 8)) & 0x0300f00f;
+    v = (v | (v << 4)) & 0x030c30c3;
+    v = (v | (v << 2)) & 0x09249249;
+    return v;
+}
+
+// position of a block along the Z-order curve
+inline uint mortonKey(int3 blockPos)
+{
+    return (spreadBits(blockPos.z) << 2) | (spreadBits(blockPos.y) << 1) | spreadBits(blockPos.x);
+}
+
+// calculate the key of a block from its true coordinates. Blocks
+// outside the world are clamped to the border blocks, which keeps
+// neighboring blocks neighbors, so nothing aliases inside the world.
+inline uint calcBlockHash(const SimParams &params, int3 blockPos)
+{
+    blockPos.x = min(max(blockPos.x, 0), (int)params.blockGridSize.x - 1);
+    blockPos.y = min(max(blockPos.y, 0), (int)params.blockGridSize.y - 1);
+    blockPos.z = min(max(blockPos.z, 0), (int)params.blockGridSize.z - 1);
+    if (params.cellOrder == CELL_ORDER_MORTON)
+        return mortonKey(blockPos);
+    return (blockPos.z * params.blockGridSize.y + blockPos.y) * params.blockGridSize.x + blockPos.x;
+}
+
+// calculate the key of a cell, the cells of a block are consecutive so
+// sorting by cell also sorts by block
+inline uint calcGridHash(const SimParams &params, int3 gridPos)
+{
+    int s = params.blockSize;
+    int3 blockPos = calcBlockPos(params, gridPos);
+    int3 sub = make_int3(gridPos.x - blockPos.x * s, gridPos.y - blockPos.y * s, gridPos.z - blockPos.z * s);
+    return calcBlockHash(params, blockPos) * (s * s * s) + (sub.z * s + sub.y) * s + sub.x;
+}
+
+
+// all cells of a block
+inline unsigned long long blockCellMask(const SimParams &params)
+{
+    uint cellsPerBlock = params.blockSize * params.blockSize * params.blockSize;
+    return cellsPerBlock == 64 ? ~0ull : (1ull << cellsPerBlock) - 1;
+}
+
+// slot of a block key in a hash table with mask + 1 slots
+inline uint hashBlockKey(uint key, uint mask)
+{
+    uint h = key * 2654435761u;
+    return (h ^ (h >> 16)) & mask;
+}
+
+// adds a key with linear probing, returns the slot of the key
+inline uint insertBlock(uint *blockKeys, uint mask, uint key)
+{
+    uint slot = hashBlockKey(key, mask);
+    while (true)
+    {
+        uint prev = __sync_val_compare_and_swap(&blockKeys[slot], EMPTY_CELL, key);
+        if (prev == EMPTY_CELL || prev == key)
+            return slot;
+        slot = (slot + 1) & mask;
+    }
+}
+
+// slot of a key or EMPTY_CELL if no particle lies in that block
+inline uint findBlock(const uint *blockKeys, uint mask, uint key)
+{
+    uint slot = hashBlockKey(key, mask);
+    while (true)
+    {
+        uint k = blockKeys[slot];
+        if (k == key)
+            return slot;
+        if (k == EMPTY_CELL)
+            return EMPTY_CELL;
+        slot = (slot + 1) & mask;
+    }
+}
+
+// sorted particle range (start, end) of the occupied cells among a
+// run of consecutive cells of one block. Cells are sorted by key, so
+// their particles follow each other and one range covers the run.
+inline uint2 cellRange(const GridData &grid, uint blockHash, unsigned long long cells)
+{
+    uint slot = findBlock(grid.blockKeys, grid.tableMask, blockHash);
+    if (slot == EMPTY_CELL)
+        return make_uint2(0, 0);
+
+    unsigned long long occupied = grid.blockCells[slot];
+    unsigned long long hit = occupied & cells;
+    if (hit == 0)
+        return make_uint2(0, 0);
+
+    // occupied cells before the run, and in it
+    uint first = grid.blockFirstCell[slot] + __builtin_popcountll(occupied & ((hit & (~hit + 1)) - 1));
+    uint last = first + __builtin_popcountll(hit) - 1;
+    return make_uint2(grid.cellStart[first], grid.cellEnd[last]);
+}
+
+// the cells gridPos.x - reach .. gridPos.x + reach of a row, as runs
+// of consecutive cells in the blocks the row passes through
+#define MAX_ROW_BLOCKS 5    // a row of 2 * 2 + 1 cells in blocks of one cell
+
+struct CellRow
+{
+    uint numBlocks;
+    uint blockHash[MAX_ROW_BLOCKS];
+    unsigned long long cells[MAX_ROW_BLOCKS];
+};
+
+inline CellRow calcCellRow(const SimParams &params, int3 gridPos, int reach)
+{
+    int s = params.blockSize;
+    int3 first = make_int3(gridPos.x - reach, gridPos.y, gridPos.z);
+    int3 blockPos = calcBlockPos(params, first);
+    int3 sub = first - blockPos * s;
+    uint row = (sub.z * s + sub.y) * s;
+
+    CellRow cellRow;
+
+    // without a skin: three cells in at most two blocks (unless the
+    // blocks are a single cell)
+    if (reach == 1 && s >= 2)
+    {
+        cellRow.numBlocks = 1;
+        cellRow.blockHash[0] = calcBlockHash(params, blockPos);
+        cellRow.cells[0] = ((2ull << min(sub.x + 2, s - 1)) - (1ull << sub.x)) << row;
+
+        if (sub.x + 2 >= s)
+        {
+            cellRow.numBlocks = 2;
+            cellRow.blockHash[1] = calcBlockHash(params, blockPos + make_int3(1, 0, 0));
+            cellRow.cells[1] = ((2ull << (sub.x + 2 - s)) - 1) << row;
+        }
+        return cellRow;
+    }
+
+    // first and last cell of the row relative to the current block
+    int lo = sub.x;
+    int hi = sub.x + 2 * reach;
+
+    cellRow.numBlocks = 0;
+    while (true)
+    {
+        cellRow.blockHash[cellRow.numBlocks] = calcBlockHash(params, blockPos);
+        cellRow.cells[cellRow.numBlocks] = ((2ull << min(hi, s - 1)) - (1ull << lo)) << row;
+        cellRow.numBlocks++;
+
+        // the rest of the row continues in the next block
+        if (hi < s)
+            return cellRow;
+        lo = 0;
+        hi -= s;
+        blockPos.x++;
+    }
+}
+
+// how many cells around its own a particle looks for contacts, the
+// cells are a particle diameter wide and the skin adds to that
+inline int contactReach(const SimParams &params)
+{
+    return 1 + (int) ceilf(params.neighborSkin / params.cellSize.x);
+}
+
+
+// The neighbor row of a particle holds three bands one after the other:
+// the particles it may touch (within a diameter plus the skin), the
+// further fluid neighbors within H (plus the skin) and the sdf particles
+// it may touch. Contacts use the first and the last band, the density
+// constraint the first two.
+enum NeighborBand { CONTACT_BAND, FLUID_BAND, SDF_BAND, NUM_BANDS };
+
+// the bands of a neighbor row being searched
+struct NeighborRow
+{
+    std::vector<uint> band[NUM_BANDS];
+
+    void add(NeighborBand b, uint j) { band[b].push_back(j); }
+};
+
+
+// collide a particle against the particles of a range of sorted
+// particles. Contacts are found within the skin, the solver tests the
+// distance.
+inline void collideRange(const SimParams &params,
+                         uint2   range,
+                         uint    index,
+                         float3  pos,
+                         int     phase,
+                         const GridData &grid,
+                         NeighborRow &row)
+{
+    float collideDist = params.particleRadius * 2.001f + params.neighborSkin; // slightly bigger radius
+    float collideDist2 = collideDist * collideDist;
+
+    for (uint j=range.x; j<range.y; j++)
+    {
+        if (j != index)                // check not colliding with self
+        {
+            float3 pos2 = make_float3(grid.sortedPos[j]);
+            int phase2 = grid.sortedPhase[j];
+
+            if (phase > SOLID && phase == phase2)
+                continue;
+
+            // both collide, the row of the lower index holds the pair
+            if (params.pairTraversal && j < index && phase2 >= CLOTH)
+                continue;
+
+            // collide two spheres
+            float3 diff = pos - pos2;
+
+            float mag2 = dot(diff, diff);
+
+            if (mag2 < collideDist2)
+                row.add(CONTACT_BAND, j);
+        }
+    }
+}
+
+// same against a range of the static sdf particles
+inline void collideRangeSdf(const SimParams &params,
+                            uint2   range,
+                            float3  pos,
+                            const GridData &sdf,
+                            NeighborRow &row)
+{
+    float collideDist = params.particleRadius * 2.001f + params.neighborSkin;
+    float collideDist2 = collideDist * collideDist;
+
+    for (uint j = range.x; j < range.y; j++)
+    {
+        float3 posSdf = make_float3(sdf.sortedPos[j]);
+
+        float3 diff = pos - posSdf;
+        float mag2 = dot(diff, diff);
+
+        if (mag2 < collideDist2)
+            row.add(SDF_BAND, j);
+    }
+}
+
+
+// visit the cells around a particle (27 without a skin) row by row
+inline void findContacts(const SimParams &params,
+                         uint    index,
+                         const GridData &grid,
+                         const GridData &sdf,
+                         uint    numParticlesSdf,
+                         NeighborRow &row)
+{
+    int phase = grid.sortedPhase[index];
+    float3 pos = make_float3(grid.sortedPos[index]);
+    int3 gridPos = calcGridPos(params, pos);
+    int reach = contactReach(params);
+
+    for (int z=-reach; z<=reach; z++)
+    {
+        for (int y=-reach; y<=reach; y++)
+        {
+            CellRow cellRow = calcCellRow(params, gridPos + make_int3(0, y, z), reach);
+
+            for (uint i = 0; i < cellRow.numBlocks; i++)
+            {
+                uint2 range = cellRange(grid, cellRow.blockHash[i], cellRow.cells[i]);
+                collideRange(params, range, index, pos, phase, grid, row);
+
+                if (numParticlesSdf > 0)
+                {
+                    range = cellRange(sdf, cellRow.blockHash[i], cellRow.cells[i]);
+                    collideRangeSdf(params, range, pos, sdf, row);
+                }
+            }
+        }
+    }
+}
+
+
+// sort the particles of one block closer than sqrt(radius2) into the
+// contact and fluid bands
+inline void collideCellRadius(const SimParams &params,
+                              uint    blockHash,
+                              uint    index,
+                              float3  pos,
+                              float   radius2,
+                              const GridData &grid,
+                              NeighborRow &row)
+{
+    float collideDist = params.particleRadius * 2.001f + params.neighborSkin;
+    float collideDist2 = collideDist * collideDist;
+
+    // all particles of this block
+    uint2 range = cellRange(grid, blockHash, blockCellMask(params));
+
+    for (uint j=range.x; j<range.y; j++)
+    {
+        if (j != index)                // check not colliding with self
+        {
+            // both are fluids, the row of the lower index holds the pair
+            if (params.pairTraversal && j < index && grid.sortedPhase[j] == FLUID)
+                continue;
+
+            float3 pos2 = make_float3(grid.sortedPos[j]);
+
+            float3 relPos = pos - pos2;
+            float dist2 = dot(relPos, relPos);
+            if (dist2 < collideDist2)
+                row.add(CONTACT_BAND, j);
+            else if (dist2 < radius2)
+                row.add(FLUID_BAND, j);
+        }
+    }
+}
+
+
+// first and last block (clamped to the world) overlapping the box of
+// half width radius around pos
+inline void calcBlockRange(const SimParams &params, float3 pos, float radius, int3 &first, int3 &last)
+{
+    int3 maxBlock = make_int3(params.blockGridSize) - 1;
+    first = clamp(calcBlockPos(params, calcGridPos(params, pos - radius)), make_int3(0), maxBlock);
+    last = clamp(calcBlockPos(params, calcGridPos(params, pos + radius)), make_int3(0), maxBlock);
+}
+
+// all fluid neighbours within H (plus the skin)
+inline void findFluidNeighbors(const SimParams &params,
+                               uint    index,
+                               const GridData &grid,
+                               NeighborRow &row)
+{
+    float3 pos = make_float3(grid.sortedPos[index]);
+    float radius = H + params.neighborSkin;
+
+    // 27 blocks suffice when blockSize * cellSize >= H and there is no skin
+    int3 first, last;
+    calcBlockRange(params, pos, radius, first, last);
+
+    for (int z=first.z; z<=last.z; z++)
+    {
+        for (int y=first.y; y<=last.y; y++)
+        {
+            for (int x=first.x; x<=last.x; x++)
+            {
+                uint blockHash = calcBlockHash(params, make_int3(x, y, z));
+                collideCellRadius(params, blockHash, index, pos, radius * radius, grid, row);
+            }
+        }
+    }
+}
+
+// The one neighbor search of a particle: fluids walk the blocks within
+// H, colliding particles the cells within a diameter and the sdf grid
+inline void findNeighborRow(const SimParams &params,
+                            uint    index,
+                            const GridData &grid,
+                            const GridData &sdf,
+                            uint    numParticlesSdf,
+                            NeighborRow &row)
+{
+    for (int b = 0; b < NUM_BANDS; b++)
+        row.band[b].clear();
+
+    int phase = grid.sortedPhase[index];
+    if (phase == FLUID)
+        findFluidNeighbors(params, index, grid, row);
+    else if (phase >= CLOTH)
+        findContacts(params, index, grid, sdf, numParticlesSdf, row);
+}
+
+
+// contact of two particles at a squared distance of mag2, the test
+// that picks the actual contacts from the neighbor rows
+inline bool inContact(const SimParams &params, float mag2)
+{
+    float collideDist = params.particleRadius * 2.001f;
+    return mag2 < collideDist * collideDist;
+}
+
+// adds the contacts of a particle with the sdf particles of its row,
+// out of numNeighborsTotal contacts in all, to delta
+inline void collideSdf(const SimParams &params,
+                       float3  pos,
+                       float3  prevPos,
+                       int     phase,
+                       float   w,
+                       float   sW,
+                       const uint   *nbrsSdf,
+                       uint    countSdf,
+                       float   numNeighborsTotal,
+                       const GridData &sdf,
+                       float3 &delta)
+{
+    float collideDist = params.particleRadius * 2.001f;
+
+    for (uint i = 0; i < countSdf; i++)
+    {
+        float3 posSdf = make_float3(sdf.sortedPos[nbrsSdf[i]]);
+
+        float3 diff = pos - posSdf;
+        float mag2 = dot(diff, diff);
+        if (!inContact(params, mag2))
+            continue;
+
+        float dist = sqrtf(mag2);
+        float mag = dist - collideDist;
+
+        float colW = phase >= SOLID ? sW : w;
+
+        float scale = mag / colW;
+        float3 dp = diff * (scale / dist);
+        float3 dp1 = -colW * dp / numNeighborsTotal;
+        float3 dp2 = make_float3(0.f);
+        delta += dp1;
+
+        ////////////////////// friction //////////////////
+        if (phase < SOLID) continue;
+
+        float3 nf = normalize(diff);
+        float3 dpRel = (pos + dp1 - prevPos) - (prevPos + dp2 - posSdf);
+        float3 dpt = dpRel - dot(dpRel, nf) * nf;
+        float ldpt = length(dpt);
+
+        if (ldpt < EPS) continue;
+
+        if (ldpt < S_FRICTION * dist) delta -= dpt;
+        else delta -= dpt * fminf(K_FRICTION * dist / ldpt, 1.f);
+    }
+}
+
+// resolves the contacts of a particle found by findNeighborRow
+inline void collideParticle(const SimParams &params,
+                            uint    index,
+                            float4 *newPos,               // output: new pos
+                            const float4 *prevPositions,
+                            const uint   *gridParticleIndex,    // input: sorted particle indices
+                            const GridData &grid,
+                            const GridData &sdf,
+                            const uint   *neighbors,
+                            const uint   *neighborStart,
+                            const uint3  *neighborBands)
+{
+    int phase = grid.sortedPhase[index];
+    if (phase < CLOTH) return;
+
+    // read particle data from sorted arrays
+    float3 pos = make_float3(grid.sortedPos[index]);
+
+    float3 delta = make_float3(0.f);
+
+    uint3 bands = neighborBands[index];
+    const uint *nbrs = neighbors + neighborStart[index];
+    const uint *nbrsSdf = nbrs + bands.x + bands.y;
+    uint count = bands.x;
+    uint countSdf = bands.z;
+
+    float collideDist = params.particleRadius * 2.001f;
+
+    float w = grid.sortedW[index];
+    float sW = (w != 0.f ? (1.f / ((1.f / w) * expf(-pos.y))) : w);
+
+    uint originalIndex = gridParticleIndex[index];
+    float3 prevPos = make_float3(prevPositions[originalIndex]);
+
+    // with a skin not every neighbor is a contact
+    uint numNeighborsTotal = count + countSdf;
+    if (params.neighborSkin > 0.f)
+    {
+        numNeighborsTotal = 0;
+        for (uint i = 0; i < count; i++)
+        {
+            float3 diff = pos - make_float3(grid.sortedPos[nbrs[i]]);
+            numNeighborsTotal += inContact(params, dot(diff, diff));
+        }
+        for (uint i = 0; i < countSdf; i++)
+        {
+            float3 diff = pos - make_float3(sdf.sortedPos[nbrsSdf[i]]);
+            numNeighborsTotal += inContact(params, dot(diff, diff));
+        }
+    }
+
+    for (uint i = 0; i < count; i++)
+    {
+        float3 pos2 = make_float3(grid.sortedPos[nbrs[i]]);
+
+        float3 diff = pos - pos2;
+        float mag2 = dot(diff, diff);
+        if (!inContact(params, mag2))
+            continue;
+
+        float w2 = grid.sortedW[nbrs[i]];
+        int phase2 = grid.sortedPhase[nbrs[i]];
+
+        float dist = sqrtf(mag2);
+        float mag = dist - collideDist;
+
+        float colW = w;
+        float colW2 = w2;
+
+        if (phase >= SOLID && phase2 >= SOLID)
+        {
+            colW = sW;
+            colW2 = (w2 != 0.f ? (1.f / ((1.f / w2) * expf(-pos.y))) : w2);
+        }
+
+        float scale = mag / (colW + colW2);
+        float3 dp = diff * (scale / dist);
+        float3 dp1 = -colW * dp / numNeighborsTotal;
+        float3 dp2 = colW2 * dp / numNeighborsTotal;
+
+        delta += dp1;
+
+        ////////////////////// friction //////////////////
+        if (phase < SOLID || phase2 < SOLID)
+            continue;
+
+        uint neighborIndex = gridParticleIndex[nbrs[i]];
+        float3 prevPos2 = make_float3(prevPositions[neighborIndex]);
+
+        float3 nf = normalize(diff);
+        float3 dpRel = (pos + dp1 - prevPos) - (prevPos + dp2 - prevPos2);
+        float3 dpt = dpRel - dot(dpRel, nf) * nf;
+        float ldpt = length(dpt);
+
+        if (ldpt < EPS)
+            continue;
+
+        if (ldpt < (S_FRICTION) * dist)
+            delta -= dpt * colW / (colW + colW2);
+        else
+            delta -= dpt * fminf((K_FRICTION) * dist / ldpt, 1.f);
+    }
+
+    collideSdf(params, pos, prevPos, phase, w, sW, nbrsSdf, countSdf, numNeighborsTotal, sdf, delta);
+
+    // write new position back to original unsorted location
+    newPos[originalIndex] = make_float4(pos + delta, 1.0f);
+}
+
+
+// Pair traversal: the contact row of a colliding particle holds the
+// other colliding particles only if their index is higher, each such
+// pair acts on both. The sweeps below add into counts and sums of both
+// particles and rely on the caller to keep concurrent writes apart.
+
+// counts the contacts of a particle and of the partners in its row
+inline void countContactPairs(const SimParams &params,
+                              uint    index,
+                              const GridData &grid,
+                              const GridData &sdf,
+                              const uint   *neighbors,
+                              const uint   *neighborStart,
+                              const uint3  *neighborBands,
+                              float  *counts)
+{
+    int phase = grid.sortedPhase[index];
+    if (phase < CLOTH) return;
+
+    float3 pos = make_float3(grid.sortedPos[index]);
+
+    uint3 bands = neighborBands[index];
+    const uint *nbrs = neighbors + neighborStart[index];
+    const uint *nbrsSdf = nbrs + bands.x + bands.y;
+
+    float count = 0.f;
+    for (uint i = 0; i < bands.x; i++)
+    {
+        uint j = nbrs[i];
+        float3 diff = pos - make_float3(grid.sortedPos[j]);
+        if (!inContact(params, dot(diff, diff)))
+            continue;
+
+        count += 1.f;
+        if (grid.sortedPhase[j] >= CLOTH)
+            counts[j] += 1.f;
+    }
+    for (uint i = 0; i < bands.z; i++)
+    {
+        float3 diff = pos - make_float3(sdf.sortedPos[nbrsSdf[i]]);
+        count += inContact(params, dot(diff, diff));
+    }
+    counts[index] += count;
+}
+
+// friction on one side of a contact: dpt is the tangential motion
+// relative to the partner, share the part a static contact cancels
+inline float3 frictionDelta(float3 dpt, float dist, float share)
+{
+    float ldpt = length(dpt);
+
+    if (ldpt < EPS)
+        return make_float3(0.f);
+
+    if (ldpt < (S_FRICTION) * dist)
+        return dpt * share;
+    return dpt * fminf((K_FRICTION) * dist / ldpt, 1.f);
+}
+
+// resolves the particle contacts in the row of a particle for both
+// sides, with counts from countContactPairs. The height scaling of the
+// masses of two solids cancels out in every term, so the contacts use
+// the plain inverse masses.
+inline void collidePairs(const SimParams &params,
+                         uint    index,
+                         const float4 *prevPositions,
+                         const uint   *gridParticleIndex,    // input: sorted particle indices
+                         const GridData &grid,
+                         const uint   *neighbors,
+                         const uint   *neighborStart,
+                         const uint3  *neighborBands,
+                         const float  *counts,
+                         float4 *sums)
+{
+    int phase = grid.sortedPhase[index];
+    if (phase < CLOTH) return;
+
+    float3 pos = make_float3(grid.sortedPos[index]);
+    float3 prevPos = make_float3(prevPositions[gridParticleIndex[index]]);
+
+    float collideDist = params.particleRadius * 2.001f;
+
+    float w = grid.sortedW[index];
+    float numContacts = counts[index];
+
+    const uint *nbrs = neighbors + neighborStart[index];
+    uint count = neighborBands[index].x;
+
+    float3 delta = make_float3(0.f);
+    for (uint i = 0; i < count; i++)
+    {
+        uint j = nbrs[i];
+        float3 pos2 = make_float3(grid.sortedPos[j]);
+
+        float3 diff = pos - pos2;
+        float mag2 = dot(diff, diff);
+        if (!inContact(params, mag2))
+            continue;
+
+        float w2 = grid.sortedW[j];
+        int phase2 = grid.sortedPhase[j];
+
+        float dist = sqrtf(mag2);
+        float3 dp = diff * ((dist - collideDist) / ((w + w2) * dist));
+
+        float3 dp1 = -w * dp / numContacts;
+        float3 dp2 = w2 * dp / numContacts;
+        delta += dp1;
+
+        // the same contact seen from j
+        float3 dp1j, dp2j;
+        bool mutual = phase2 >= CLOTH;
+        if (mutual)
+        {
+            float numContacts2 = counts[j];
+            dp1j = w2 * dp / numContacts2;
+            dp2j = -w * dp / numContacts2;
+            sums[j] += make_float4(dp1j, 0.f);
+        }
+
+        ////////////////////// friction //////////////////
+        if (phase < SOLID || phase2 < SOLID)
+            continue;
+
+        float3 prevPos2 = make_float3(prevPositions[gridParticleIndex[j]]);
+        float3 nf = diff / dist;
+
+        float3 dpRel = (pos + dp1 - prevPos) - (prevPos + dp2 - prevPos2);
+        delta -= frictionDelta(dpRel - dot(dpRel, nf) * nf, dist, w / (w + w2));
+
+        float3 dpRel2 = (pos2 + dp1j - prevPos2) - (prevPos2 + dp2j - prevPos);
+        sums[j] -= make_float4(frictionDelta(dpRel2 - dot(dpRel2, nf) * nf, dist, w2 / (w + w2)), 0.f);
+    }
+
+    sums[index] += make_float4(delta, 0.f);
+}
+
+// moves a colliding particle by the sums of collidePairs and its sdf
+// contacts
+inline void applyContactPairs(const SimParams &params,
+                              uint    index,
+                              float4 *newPos,               // output: new pos
+                              const float4 *prevPositions,
+                              const uint   *gridParticleIndex,    // input: sorted particle indices
+                              const GridData &grid,
+                              const GridData &sdf,
+                              const uint   *neighbors,
+                              const uint   *neighborStart,
+                              const uint3  *neighborBands,
+                              const float  *counts,
+                              const float4 *sums)
+{
+    int phase = grid.sortedPhase[index];
+    if (phase < CLOTH) return;
+
+    float3 pos = make_float3(grid.sortedPos[index]);
+    uint originalIndex = gridParticleIndex[index];
+    float3 prevPos = make_float3(prevPositions[originalIndex]);
+
+    float w = grid.sortedW[index];
+    float sW = (w != 0.f ? (1.f / ((1.f / w) * expf(-pos.y))) : w);
+
+    uint3 bands = neighborBands[index];
+    const uint *nbrsSdf = neighbors + neighborStart[index] + bands.x + bands.y;
+
+    float3 delta = make_float3(sums[index]);
+    collideSdf(params, pos, prevPos, phase, w, sW, nbrsSdf, bands.z, counts[index], sdf, delta);
+
+    newPos[originalIndex] = make_float4(pos + delta, 1.0f);
+}
+
+
+// x^E_P for the artificial pressure, multiplications for the usual E_P
+// of 4 instead of a powf per pair
+inline float pressurePow(float x)
+{
+    if (E_P == 4.f)
+    {
+        float x2 = x * x;
+        return x2 * x2;
+    }
+    return powf(x, E_P);
+}
+
+inline lanef pressurePow(lanef x)
+{
+    if (E_P == 4.f)
+    {
+        lanef x2 = x * x;
+        return x2 * x2;
+    }
+    for (int l = 0; l < CLUSTER_SIZE; l++)
+        x[l] = powf(x[l], E_P);
+    return x;
+}
+
+// computes the lambda of a fluid particle from the first two bands of
+// its neighbor row
+inline void findLambda(uint    index,
+                       float  *lambda,
+                       const uint   *gridParticleIndex,    // input: sorted particle indices
+                       const GridData &grid,
+                       const uint   *neighbors,
+                       const uint   *neighborStart,
+                       const uint3  *neighborBands,
+                       const float  *ros)
+{
+    int phase = grid.sortedPhase[index];
+    if (phase != FLUID) return;
+
+    // read particle data from sorted arrays
+    float3 pos = make_float3(grid.sortedPos[index]);
+
+    const uint *nbrs = neighbors + neighborStart[index];
+    uint count = neighborBands[index].x + neighborBands[index].y;
+
+    float w = grid.sortedW[index];
+    float ro = 0.f;
+    float denom = 0.f;
+    float3 grad = make_float3(0.f);
+    float rest = ros[gridParticleIndex[index]];
+
+    for (uint i = 0; i < count; i++)
+    {
+        float3 pos2 = make_float3(grid.sortedPos[nbrs[i]]);
+        float3 r = pos - pos2;
+        float rlen2 = dot(r, r);
+        if (rlen2 >= H2)
+            continue;   // in the skin only
+
+        float rlen = sqrtf(rlen2);
+        float hMinus2 = H2 - rlen2;
+        float hMinus = H - rlen;
+
+        // do fluid solid scaling hurr
+        ro += (POLY6_COEFF * hMinus2*hMinus2*hMinus2 ) / w;
+
+        float3 spikeyGrad;
+        if (rlen < 0.0001f)
+            spikeyGrad = make_float3(0.f); // randomize a little
+        else
+            spikeyGrad = (r / rlen) * -SPIKEY_COEFF * hMinus*hMinus;
+        spikeyGrad /= rest;
+
+        grad += -spikeyGrad;
+        denom += dot(spikeyGrad, spikeyGrad);
+    }
+    ro += (POLY6_COEFF * H6 ) / w;
+    denom += dot(grad, grad);
+
+    lambda[index] = - ((ro / rest) - 1) / (denom + FLUID_RELAXATION);
+}
+
+
+inline void solveFluidParticle(uint    index,
+                               const float  *lambda,
+                               const uint   *gridParticleIndex,    // input: sorted particle indices
+                               const GridData &grid,
+                               float4 *particles,
+                               const uint   *neighbors,
+                               const uint   *neighborStart,
+                               const uint3  *neighborBands,
+                               const float  *ros)
+{
+    int phase = grid.sortedPhase[index];
+    if (phase != FLUID) return;
+
+    float4 pos = grid.sortedPos[index];
+
+    float term2 = H2 - (DQ_P * DQ_P * H2);
+    float denom = (POLY6_COEFF * term2*term2*term2 );
+
+    float4 delta = make_float4(0.f);
+    const uint *nbrs = neighbors + neighborStart[index];
+    uint numNeighbors = neighborBands[index].x + neighborBands[index].y;
+    uint count = 0;
+    for (uint i = 0; i < numNeighbors; i++)
+    {
+        float4 pos2 = grid.sortedPos[nbrs[i]];
+        float4 r = pos - pos2;
+        float rlen2 = dot(r, r);
+        if (rlen2 >= H2)
+            continue;   // in the skin only
+
+        count++;
+        float rlen = sqrtf(rlen2);
+        float hMinus2 = H2 - rlen2;
+        float hMinus = H - rlen;
+
+        float4 spikeyGrad;
+        if (rlen < 0.0001f)
+            spikeyGrad = make_float4(0,EPS,0,0) * -SPIKEY_COEFF * hMinus*hMinus;
+        else
+            spikeyGrad = (r / rlen) * -SPIKEY_COEFF * hMinus*hMinus;
+
+        float numer = (POLY6_COEFF * hMinus2*hMinus2*hMinus2 ) ;
+        float lambdaCorr = -K_P * pressurePow(numer / denom);
+
+        delta += (lambda[index] + lambda[nbrs[i]] + lambdaCorr) * spikeyGrad;
+    }
+
+    uint origIndex = gridParticleIndex[index];
+    particles[origIndex] += delta / (ros[origIndex] + count);
+}
+
+// SIMD fluid kernels: the same sums as findLambda and
+// solveFluidParticle, over CLUSTER_SIZE neighbors at a time. The
+// positions of the neighbors are gathered from the sorted positions
+// stored by coordinate (posX, posY, posZ), lanes past the end of the
+// row lie out of reach.
+inline void findLambdaLanes(uint    index,
+                            float  *lambda,
+                            const uint   *gridParticleIndex,    // input: sorted particle indices
+                            const GridData &grid,
+                            const float  *posX,
+                            const float  *posY,
+                            const float  *posZ,
+                            const uint   *neighbors,
+                            const uint   *neighborStart,
+                            const uint3  *neighborBands,
+                            const float  *ros)
+{
+    int phase = grid.sortedPhase[index];
+    if (phase != FLUID) return;
+
+    const uint *nbrs = neighbors + neighborStart[index];
+    uint count = neighborBands[index].x + neighborBands[index].y;
+
+    float x = posX[index], y = posY[index], z = posZ[index];
+    lanef ro = {}, gradX = {}, gradY = {}, gradZ = {}, denom = {};
+    lanef zero = {};
+
+    for (uint i = 0; i < count; i += CLUSTER_SIZE)
+    {
+        uint n = count - i;
+        lanef rx = x - gatherLanes(posX, nbrs + i, n, EMPTY_LANE_POS);
+        lanef ry = y - gatherLanes(posY, nbrs + i, n, EMPTY_LANE_POS);
+        lanef rz = z - gatherLanes(posZ, nbrs + i, n, EMPTY_LANE_POS);
+        lanef r2 = rx * rx + ry * ry + rz * rz;
+        lanei in = r2 < H2;     // not in the skin only
+
+        lanef rlen = laneSqrt(r2);
+        lanef hMinus2 = H2 - r2;
+        lanef hMinus = H - rlen;
+
+        ro += in ? POLY6_COEFF * hMinus2 * hMinus2 * hMinus2 : zero;
+
+        lanef coeff = -SPIKEY_COEFF * hMinus * hMinus / rlen;
+        in &= rlen >= 0.0001f;
+        lanef sx = in ? rx * coeff : zero, sy = in ? ry * coeff : zero, sz = in ? rz * coeff : zero;
+
+        gradX -= sx;
+        gradY -= sy;
+        gradZ -= sz;
+        denom += sx * sx + sy * sy + sz * sz;
+    }
+
+    float w = grid.sortedW[index];
+    float rest = ros[gridParticleIndex[index]];
+
+    float3 grad = make_float3(laneSum(gradX), laneSum(gradY), laneSum(gradZ)) / rest;
+    float density = (laneSum(ro) + POLY6_COEFF * H6) / w;
+    float sum = laneSum(denom) / (rest * rest) + dot(grad, grad);
+
+    lambda[index] = - ((density / rest) - 1) / (sum + FLUID_RELAXATION);
+}
+
+inline void solveFluidLanes(uint    index,
+                            const float  *lambda,
+                            const uint   *gridParticleIndex,    // input: sorted particle indices
+                            const GridData &grid,
+                            const float  *posX,
+                            const float  *posY,
+                            const float  *posZ,
+                            float4 *particles,
+                            const uint   *neighbors,
+                            const uint   *neighborStart,
+                            const uint3  *neighborBands,
+                            const float  *ros)
+{
+    int phase = grid.sortedPhase[index];
+    if (phase != FLUID) return;
+
+    float term2 = H2 - (DQ_P * DQ_P * H2);
+    float denom = (POLY6_COEFF * term2*term2*term2 );
+
+    const uint *nbrs = neighbors + neighborStart[index];
+    uint numNeighbors = neighborBands[index].x + neighborBands[index].y;
+
+    float x = posX[index], y = posY[index], z = posZ[index];
+    lanef deltaX = {}, deltaY = {}, deltaZ = {}, count = {};
+    lanef zero = {}, one = zero + 1.f;
+
+    for (uint i = 0; i < numNeighbors; i += CLUSTER_SIZE)
+    {
+        uint n = numNeighbors - i;
+        lanef rx = x - gatherLanes(posX, nbrs + i, n, EMPTY_LANE_POS);
+        lanef ry = y - gatherLanes(posY, nbrs + i, n, EMPTY_LANE_POS);
+        lanef rz = z - gatherLanes(posZ, nbrs + i, n, EMPTY_LANE_POS);
+        lanef r2 = rx * rx + ry * ry + rz * rz;
+        lanei in = r2 < H2;     // not in the skin only
+
+        lanef rlen = laneSqrt(r2);
+        lanef hMinus2 = H2 - r2;
+        lanef hMinus = H - rlen;
+
+        // coinciding particles are pushed apart along y
+        lanef grad = -SPIKEY_COEFF * hMinus * hMinus;
+        lanei apart = rlen >= 0.0001f;
+        lanef scaled = grad / rlen;
+        lanef gx = apart ? rx * scaled : zero;
+        lanef gy = apart ? ry * scaled : EPS * grad;
+        lanef gz = apart ? rz * scaled : zero;
+
+        lanef q = POLY6_COEFF * hMinus2 * hMinus2 * hMinus2 / denom;
+        lanef lambdaCorr = -K_P * pressurePow(q);
+
+        lanef scale = lambda[index] + gatherLanes(lambda, nbrs + i, n, 0.f) + lambdaCorr;
+        deltaX += in ? scale * gx : zero;
+        deltaY += in ? scale * gy : zero;
+        deltaZ += in ? scale * gz : zero;
+        count += in ? one : zero;
+    }
+
+    uint origIndex = gridParticleIndex[index];
+    float3 delta = make_float3(laneSum(deltaX), laneSum(deltaY), laneSum(deltaZ));
+    particles[origIndex] += make_float4(delta / (ros[origIndex] + laneSum(count)), 0.f);
+}
+
+// Pair traversal: a fluid particle holds the other fluid particles in
+// its row only if their index is higher, the density terms of such a
+// pair go to both. sums collects (-gradient, density) and denoms the
+// squared gradients.
+inline void findLambdaPairs(uint    index,
+                            const uint   *gridParticleIndex,    // input: sorted particle indices
+                            const GridData &grid,
+                            const uint   *neighbors,
+                            const uint   *neighborStart,
+                            const uint3  *neighborBands,
+                            const float  *ros,
+                            float4 *sums,
+                            float  *denoms)
+{
+    int phase = grid.sortedPhase[index];
+    if (phase != FLUID) return;
+
+    float3 pos = make_float3(grid.sortedPos[index]);
+
+    const uint *nbrs = neighbors + neighborStart[index];
+    uint count = neighborBands[index].x + neighborBands[index].y;
+
+    float w = grid.sortedW[index];
+    float rest = ros[gridParticleIndex[index]];
+
+    float4 sum = make_float4(0.f);
+    float denom = 0.f;
+    for (uint i = 0; i < count; i++)
+    {
+        uint j = nbrs[i];
+        float3 r = pos - make_float3(grid.sortedPos[j]);
+        float rlen2 = dot(r, r);
+        if (rlen2 >= H2)
+            continue;   // in the skin only
+
+        float rlen = sqrtf(rlen2);
+        float hMinus2 = H2 - rlen2;
+        float hMinus = H - rlen;
+        float poly = POLY6_COEFF * hMinus2*hMinus2*hMinus2;
+
+        float3 spikeyGrad;
+        if (rlen < 0.0001f)
+            spikeyGrad = make_float3(0.f);
+        else
+            spikeyGrad = (r / rlen) * -SPIKEY_COEFF * hMinus*hMinus;
+
+        float3 grad = spikeyGrad / rest;
+        sum += make_float4(-grad, poly / w);
+        denom += dot(grad, grad);
+
+        // from j the gradient points the other way
+        if (grid.sortedPhase[j] == FLUID)
+        {
+            float3 grad2 = -spikeyGrad / ros[gridParticleIndex[j]];
+            sums[j] += make_float4(-grad2, poly / grid.sortedW[j]);
+            denoms[j] += dot(grad2, grad2);
+        }
+    }
+
+    sums[index] += sum;
+    denoms[index] += denom;
+}
+
+// the lambda of a fluid particle from the sums of findLambdaPairs
+inline void lambdaFromPairs(uint    index,
+                            float  *lambda,
+                            const uint   *gridParticleIndex,    // input: sorted particle indices
+                            const GridData &grid,
+                            const float  *ros,
+                            const float4 *sums,
+                            const float  *denoms)
+{
+    if (grid.sortedPhase[index] != FLUID) return;
+
+    float w = grid.sortedW[index];
+    float rest = ros[gridParticleIndex[index]];
+
+    float3 grad = make_float3(sums[index]);
+    float ro = sums[index].w + (POLY6_COEFF * H6 ) / w;
+    float denom = denoms[index] + dot(grad, grad);
+
+    lambda[index] = - ((ro / rest) - 1) / (denom + FLUID_RELAXATION);
+}
+
+// position corrections of the fluid pairs in the row of a particle,
+// sums collects the correction and the number of neighbors in w
+inline void solveFluidPairs(uint    index,
+                            const float  *lambda,
+                            const GridData &grid,
+                            const uint   *neighbors,
+                            const uint   *neighborStart,
+                            const uint3  *neighborBands,
+                            float4 *sums)
+{
+    int phase = grid.sortedPhase[index];
+    if (phase != FLUID) return;
+
+    float4 pos = grid.sortedPos[index];
+
+    float term2 = H2 - (DQ_P * DQ_P * H2);
+    float denom = (POLY6_COEFF * term2*term2*term2 );
+
+    const uint *nbrs = neighbors + neighborStart[index];
+    uint numNeighbors = neighborBands[index].x + neighborBands[index].y;
+
+    float4 delta = make_float4(0.f);
+    for (uint i = 0; i < numNeighbors; i++)
+    {
+        uint j = nbrs[i];
+        float4 r = pos - grid.sortedPos[j];
+        float rlen2 = dot(r, r);
+        if (rlen2 >= H2)
+            continue;   // in the skin only
+
+        float rlen = sqrtf(rlen2);
+        float hMinus2 = H2 - rlen2;
+        float hMinus = H - rlen;
+
+        float4 spikeyGrad;
+        if (rlen < 0.0001f)
+            spikeyGrad = make_float4(0,EPS,0,0) * -SPIKEY_COEFF * hMinus*hMinus;
+        else
+            spikeyGrad = (r / rlen) * -SPIKEY_COEFF * hMinus*hMinus;
+
+        float numer = (POLY6_COEFF * hMinus2*hMinus2*hMinus2 ) ;
+        float lambdaCorr = -K_P * pressurePow(numer / denom);
+        float scale = lambda[index] + lambda[j] + lambdaCorr;
+
+        delta += make_float4(make_float3(scale * spikeyGrad), 1.f);
+
+        // from j the gradient points the other way, unless they coincide
+        if (grid.sortedPhase[j] == FLUID)
+        {
+            float4 spikeyGrad2 = rlen < 0.0001f ? spikeyGrad : -spikeyGrad;
+            sums[j] += make_float4(make_float3(scale * spikeyGrad2), 1.f);
+        }
+    }
+
+    sums[index] += delta;
+}
+
+// Cluster pairs: the neighbor row of a cluster holds the clusters whose
+// bounding box comes within reach of its own, in the bands of the
+// particle rows. The kernels below take a cluster of the row at a time
+// and compute all pairs of their lanes at once, vectorized over the
+// lanes of the own cluster; the distance tests only mask lanes.
+
+// squared distance between two boxes, 0 if they overlap
+inline float boxDistance2(float3 lo, float3 hi, float3 lo2, float3 hi2)
+{
+    float3 gap = fmaxf(make_float3(0.f), fmaxf(lo2 - hi, lo - hi2));
+    return dot(gap, gap);
+}
+
+// the clusters with particles in the blocks first.x .. last.x of the
+// block row (y, z). The blocks of a row have consecutive keys, so their
+// particles and clusters are consecutive as well. In Z-order only the
+// clusters of a single block are (first.x == last.x).
+inline uint2 clusterRange(const SimParams &params,
+                          const GridData &grid,
+                          const uint *clusterOf,
+                          int3    first,
+                          int3    last,
+                          int     y,
+                          int     z)
+{
+    unsigned long long allCells = blockCellMask(params);
+
+    uint2 range = make_uint2(0, 0);
+    for (int x = first.x; x <= last.x && range.y == 0; x++)
+        range = cellRange(grid, calcBlockHash(params, make_int3(x, y, z)), allCells);
+    if (range.y == 0)
+        return make_uint2(0, 0);
+
+    for (int x = last.x; x > first.x; x--)
+    {
+        uint2 lastRange = cellRange(grid, calcBlockHash(params, make_int3(x, y, z)), allCells);
+        if (lastRange.y != 0)
+        {
+            range.y = lastRange.y;
+            break;
+        }
+    }
+
+    return make_uint2(clusterOf[range.x], clusterOf[range.y - 1] + 1);
+}
+
+// adds the clusters of a grid whose box lies within reach of the box
+// lo, hi to the row, to nearBand if within contactReach and to farBand
+// otherwise
+inline void findClustersInReach(const SimParams &params,
+                                float3  lo,
+                                float3  hi,
+                                float   reach,
+                                float   contactReach,
+                                const GridData &grid,
+                                const uint   *clusterOf,
+                                const float3 *clusterLo,
+                                const float3 *clusterHi,
+                                NeighborBand nearBand,
+                                NeighborBand farBand,
+                                NeighborRow &row)
+{
+    int3 maxBlock = make_int3(params.blockGridSize) - 1;
+    int3 first = clamp(calcBlockPos(params, calcGridPos(params, lo - reach)), make_int3(0), maxBlock);
+    int3 last = clamp(calcBlockPos(params, calcGridPos(params, hi + reach)), make_int3(0), maxBlock);
+
+    // rows come in key order, the first cluster of a row may be the last
+    // one of the previous row. In Z-order the blocks of a row are not
+    // consecutive and are visited one by one.
+    bool morton = params.cellOrder == CELL_ORDER_MORTON;
+    int step = morton ? 1 : last.x - first.x + 1;
+    uint next = 0;
+    for (int z=first.z; z<=last.z; z++)
+    {
+        for (int y=first.y; y<=last.y; y++)
+        {
+            for (int x=first.x; x<=last.x; x+=step)
+            {
+                uint2 range = clusterRange(params, grid, clusterOf, make_int3(x), make_int3(x + step - 1), y, z);
+                for (uint j = max(range.x, next); j < range.y; j++)
+                {
+                    float dist2 = boxDistance2(lo, hi, clusterLo[j], clusterHi[j]);
+                    if (dist2 < contactReach * contactReach)
+                        row.add(nearBand, j);
+                    else if (dist2 < reach * reach)
+                        row.add(farBand, j);
+                }
+                if (!morton)
+                    next = max(next, range.y);
+            }
+        }
+    }
+}
+
+// The neighbor row of a cluster: the clusters within a diameter (plus
+// the skin) for the colliding lanes, the further ones within H (plus
+// the skin) if it has fluid lanes and the sdf clusters within a
+// diameter
+inline void findClusterRow(const SimParams &params,
+                           uint    cluster,
+                           const uint   *clusterStart,
+                           const GridData &grid,
+                           const uint   *clusterOf,
+                           const float3 *clusterLo,
+                           const float3 *clusterHi,
+                           const GridData &sdf,
+                           uint    numParticlesSdf,
+                           const uint   *clusterOfSdf,
+                           const float3 *clusterLoSdf,
+                           const float3 *clusterHiSdf,
+                           NeighborRow &row)
+{
+    for (int b = 0; b < NUM_BANDS; b++)
+        row.band[b].clear();
+
+    bool fluid = false;
+    bool collider = false;
+    for (uint i = clusterStart[cluster]; i < clusterStart[cluster + 1]; i++)
+    {
+        fluid |= grid.sortedPhase[i] == FLUID;
+        collider |= grid.sortedPhase[i] >= CLOTH;
+    }
+    if (!fluid && !collider)
+        return;
+
+    float3 lo = clusterLo[cluster];
+    float3 hi = clusterHi[cluster];
+    float contactReach = params.particleRadius * 2.001f + params.neighborSkin;
+    float reach = fluid ? H + params.neighborSkin : contactReach;
+
+    findClustersInReach(params, lo, hi, reach, contactReach, grid, clusterOf, clusterLo, clusterHi, CONTACT_BAND,
+                        FLUID_BAND, row);
+
+    if (collider && numParticlesSdf > 0)
+        findClustersInReach(params, lo, hi, contactReach, contactReach, sdf, clusterOfSdf, clusterLoSdf, clusterHiSdf,
+                            SDF_BAND, SDF_BAND, row);
+}
+
+
+// lanes of cluster a that b may not push: the lane itself in a tile of
+// a cluster with itself, and the lanes of the same rigid body
+inline lanei contactExcluded(lanei phase, int phase2, bool self, int m)
+{
+    lanei excluded = (phase > SOLID) & (phase == phase2);
+    if (self)
+        excluded |= laneIndex() == m;
+    return excluded;
+}
+
+// counts the contacts of the colliding lanes of a with the lanes of b
+inline void countContactTile(const SimParams &params,
+                             const Cluster &a,
+                             const Cluster &b,
+                             bool    self,
+                             lanef  &count)
+{
+    float collideDist = params.particleRadius * 2.001f;
+    lanef ax = loadLanes(a.pos.x), ay = loadLanes(a.pos.y), az = loadLanes(a.pos.z);
+    lanei phase = loadLanes(a.phase);
+    lanei active = phase >= CLOTH;
+    lanef zero = {}, one = zero + 1.f;
+
+    for (int m = 0; m < CLUSTER_SIZE; m++)
+    {
+        lanef rx = ax - b.pos.x[m], ry = ay - b.pos.y[m], rz = az - b.pos.z[m];
+        lanef r2 = rx * rx + ry * ry + rz * rz;
+        lanei in = active & ~contactExcluded(phase, b.phase[m], self, m) & (r2 < collideDist * collideDist);
+        count += in ? one : zero;
+    }
+}
+
+// the contacts of the colliding lanes of a with the lanes of b, out of
+// count contacts per lane, added to delta. As in collidePairs the height
+// scaling of the masses of two solids cancels out, the sdf lanes are
+// static solids of zero inverse mass.
+inline void contactTile(const SimParams &params,
+                        const Cluster &a,
+                        const ClusterLanes &prevA,
+                        const Cluster &b,
+                        const ClusterLanes &prevB,
+                        bool    self,
+                        lanef   count,
+                        lanef  &deltaX,
+                        lanef  &deltaY,
+                        lanef  &deltaZ)
+{
+    float collideDist = params.particleRadius * 2.001f;
+    lanef ax = loadLanes(a.pos.x), ay = loadLanes(a.pos.y), az = loadLanes(a.pos.z);
+    lanef px = loadLanes(prevA.x), py = loadLanes(prevA.y), pz = loadLanes(prevA.z);
+    lanef w = loadLanes(a.w);
+    lanei phase = loadLanes(a.phase);
+    lanei active = phase >= CLOTH;
+    lanei solid = phase >= SOLID;
+    lanef zero = {}, one = zero + 1.f;
+
+    for (int m = 0; m < CLUSTER_SIZE; m++)
+    {
+        lanef rx = ax - b.pos.x[m], ry = ay - b.pos.y[m], rz = az - b.pos.z[m];
+        lanef r2 = rx * rx + ry * ry + rz * rz;
+        lanei in = active & ~contactExcluded(phase, b.phase[m], self, m) & (r2 < collideDist * collideDist);
+        if (!laneAny(in))
+            continue;
+
+        float w2 = b.w[m];
+        lanef dist = laneSqrt(r2);
+        lanef wSum = w + w2;
+        lanef scale = (dist - collideDist) / (wSum * dist);
+
+        lanef dp1x = -w * rx * scale / count, dp1y = -w * ry * scale / count, dp1z = -w * rz * scale / count;
+        deltaX += in ? dp1x : zero;
+        deltaY += in ? dp1y : zero;
+        deltaZ += in ? dp1z : zero;
+
+        ////////////////////// friction //////////////////
+        if (b.phase[m] < SOLID)
+            continue;
+        in &= solid;
+
+        lanef dp2x = w2 * rx * scale / count, dp2y = w2 * ry * scale / count, dp2z = w2 * rz * scale / count;
+        lanef nx = rx / dist, ny = ry / dist, nz = rz / dist;
+
+        lanef relX = (ax + dp1x - px) - (px + dp2x - prevB.x[m]);
+        lanef relY = (ay + dp1y - py) - (py + dp2y - prevB.y[m]);
+        lanef relZ = (az + dp1z - pz) - (pz + dp2z - prevB.z[m]);
+        lanef normal = relX * nx + relY * ny + relZ * nz;
+        lanef dptX = relX - normal * nx, dptY = relY - normal * ny, dptZ = relZ - normal * nz;
+        lanef ldpt = laneSqrt(dptX * dptX + dptY * dptY + dptZ * dptZ);
+
+        lanef kinetic = K_FRICTION * dist / ldpt;
+        kinetic = kinetic < one ? kinetic : one;
+        lanef share = ldpt < S_FRICTION * dist ? w / wSum : kinetic;
+
+        in &= ldpt >= EPS;
+        deltaX -= in ? dptX * share : zero;
+        deltaY -= in ? dptY * share : zero;
+        deltaZ -= in ? dptZ * share : zero;
+    }
+}
+
+// resolves the contacts of the colliding particles of a cluster with the
+// clusters of its row
+inline void collideCluster(const SimParams &params,
+                           uint    cluster,
+                           float4 *newPos,               // output: new pos
+                           const uint   *gridParticleIndex,    // input: sorted particle indices
+                           const uint   *clusterStart,
+                           const Cluster *clusters,
+                           const ClusterLanes *prevPositions,
+                           const Cluster *clustersSdf,
+                           const uint   *neighbors,
+                           const uint   *neighborStart,
+                           const uint3  *neighborBands)
+{
+    const Cluster &a = clusters[cluster];
+    if (!laneAny(loadLanes(a.phase) >= CLOTH))
+        return;
+
+    uint3 bands = neighborBands[cluster];
+    const uint *nbrs = neighbors + neighborStart[cluster];
+    const uint *nbrsSdf = nbrs + bands.x + bands.y;
+
+    // the number of contacts of every lane first, each contact is
+    // divided by it
+    lanef count = {};
+    for (uint i = 0; i < bands.x; i++)
+        countContactTile(params, a, clusters[nbrs[i]], nbrs[i] == cluster, count);
+    for (uint i = 0; i < bands.z; i++)
+        countContactTile(params, a, clustersSdf[nbrsSdf[i]], false, count);
+
+    lanef deltaX = {}, deltaY = {}, deltaZ = {};
+    for (uint i = 0; i < bands.x; i++)
+        contactTile(params, a, prevPositions[cluster], clusters[nbrs[i]], prevPositions[nbrs[i]],
+                    nbrs[i] == cluster, count, deltaX, deltaY, deltaZ);
+    for (uint i = 0; i < bands.z; i++)
+        contactTile(params, a, prevPositions[cluster], clustersSdf[nbrsSdf[i]], clustersSdf[nbrsSdf[i]].pos,
+                    false, count, deltaX, deltaY, deltaZ);
+
+    // write new positions back to original unsorted location
+    uint first = clusterStart[cluster];
+    for (uint l = 0; l < clusterStart[cluster + 1] - first; l++)
+    {
+        if (a.phase[l] < CLOTH)
+            continue;
+
+        float3 pos = make_float3(a.pos.x[l], a.pos.y[l], a.pos.z[l]);
+        newPos[gridParticleIndex[first + l]] = make_float4(pos + make_float3(deltaX[l], deltaY[l], deltaZ[l]), 1.0f);
+    }
+}
+
+
+// the density sums of the lanes of a over the lanes of b: the poly6
+// terms, the spiky gradients and their squares (without the mass and
+// the rest density, which are the same for every term of a lane)
+inline void lambdaTile(const Cluster &a,
+                       const Cluster &b,
+                       bool    self,
+                       lanef  &ro,
+                       lanef  &gradX,
+                       lanef  &gradY,
+                       lanef  &gradZ,
+                       lanef  &denom)
+{
+    lanef ax = loadLanes(a.pos.x), ay = loadLanes(a.pos.y), az = loadLanes(a.pos.z);
+    lanef zero = {};
+
+    for (int m = 0; m < CLUSTER_SIZE; m++)
+    {
+        lanef rx = ax - b.pos.x[m], ry = ay - b.pos.y[m], rz = az - b.pos.z[m];
+        lanef r2 = rx * rx + ry * ry + rz * rz;
+        lanei in = r2 < H2;
+        if (self)
+            in &= laneIndex() != m;
+        if (!laneAny(in))
+            continue;
+
+        lanef rlen = laneSqrt(r2);
+        lanef hMinus2 = H2 - r2;
+        lanef hMinus = H - rlen;
+
+        ro += in ? POLY6_COEFF * hMinus2 * hMinus2 * hMinus2 : zero;
+
+        lanef coeff = -SPIKEY_COEFF * hMinus * hMinus / rlen;
+        in &= rlen >= 0.0001f;
+        lanef sx = in ? rx * coeff : zero, sy = in ? ry * coeff : zero, sz = in ? rz * coeff : zero;
+
+        gradX -= sx;
+        gradY -= sy;
+        gradZ -= sz;
+        denom += sx * sx + sy * sy + sz * sz;
+    }
+}
+
+// computes the lambdas of the fluid particles of a cluster from the
+// first two bands of its row
+inline void findLambdaCluster(uint    cluster,
+                              float  *lambda,
+                              const uint   *gridParticleIndex,    // input: sorted particle indices
+                              const uint   *clusterStart,
+                              const Cluster *clusters,
+                              const uint   *neighbors,
+                              const uint   *neighborStart,
+                              const uint3  *neighborBands,
+                              const float  *ros)
+{
+    const Cluster &a = clusters[cluster];
+    uint first = clusterStart[cluster];
+    uint size = clusterStart[cluster + 1] - first;
+
+    if (!laneAny(loadLanes(a.phase) == FLUID))
+        return;
+
+    const uint *nbrs = neighbors + neighborStart[cluster];
+    uint count = neighborBands[cluster].x + neighborBands[cluster].y;
+
+    lanef ro = {}, gradX = {}, gradY = {}, gradZ = {}, denom = {};
+    for (uint i = 0; i < count; i++)
+        lambdaTile(a, clusters[nbrs[i]], nbrs[i] == cluster, ro, gradX, gradY, gradZ, denom);
+
+    for (uint l = 0; l < size; l++)
+    {
+        if (a.phase[l] != FLUID)
+            continue;
+
+        float w = a.w[l];
+        float rest = ros[gridParticleIndex[first + l]];
+
+        float3 grad = make_float3(gradX[l], gradY[l], gradZ[l]) / rest;
+        float density = (ro[l] + POLY6_COEFF * H6) / w;
+        float sum = denom[l] / (rest * rest) + dot(grad, grad);
+
+        lambda[first + l] = - ((density / rest) - 1) / (sum + FLUID_RELAXATION);
+    }
+}
+
+// the position corrections of the lanes of a from the lanes of b, and
+// the number of neighbors of each lane
+inline void solveFluidTile(const Cluster &a,
+                           lanef   lambda,
+                           const Cluster &b,
+                           const float *lambda2,
+                           bool    self,
+                           lanef  &deltaX,
+                           lanef  &deltaY,
+                           lanef  &deltaZ,
+                           lanef  &count)
+{
+    float term2 = H2 - (DQ_P * DQ_P * H2);
+    float denom = (POLY6_COEFF * term2*term2*term2 );
+
+    lanef ax = loadLanes(a.pos.x), ay = loadLanes(a.pos.y), az = loadLanes(a.pos.z);
+    lanef zero = {}, one = zero + 1.f;
+
+    for (int m = 0; m < CLUSTER_SIZE; m++)
+    {
+        lanef rx = ax - b.pos.x[m], ry = ay - b.pos.y[m], rz = az - b.pos.z[m];
+        lanef r2 = rx * rx + ry * ry + rz * rz;
+        lanei in = r2 < H2;
+        if (self)
+            in &= laneIndex() != m;
+        if (!laneAny(in))
+            continue;
+
+        lanef rlen = laneSqrt(r2);
+        lanef hMinus2 = H2 - r2;
+        lanef hMinus = H - rlen;
+
+        // coinciding particles are pushed apart along y
+        lanef grad = -SPIKEY_COEFF * hMinus * hMinus;
+        lanei apart = rlen >= 0.0001f;
+        lanef scaled = grad / rlen;
+        lanef gx = apart ? rx * scaled : zero;
+        lanef gy = apart ? ry * scaled : EPS * grad;
+        lanef gz = apart ? rz * scaled : zero;
+
+        // the artificial pressure
+        lanef q = POLY6_COEFF * hMinus2 * hMinus2 * hMinus2 / denom;
+        lanef lambdaCorr = -K_P * pressurePow(q);
+
+        lanef scale = lambda + lambda2[m] + lambdaCorr;
+        deltaX += in ? scale * gx : zero;
+        deltaY += in ? scale * gy : zero;
+        deltaZ += in ? scale * gz : zero;
+        count += in ? one : zero;
+    }
+}
+
+// moves the fluid particles of a cluster by the density constraints,
+// lambdas holds the lambda of every lane
+inline void solveFluidCluster(uint    cluster,
+                              const float  *lambdas,
+                              const uint   *gridParticleIndex,    // input: sorted particle indices
+                              const uint   *clusterStart,
+                              const Cluster *clusters,
+                              float4 *particles,
+                              const uint   *neighbors,
+                              const uint   *neighborStart,
+                              const uint3  *neighborBands,
+                              const float  *ros)
+{
+    const Cluster &a = clusters[cluster];
+    uint first = clusterStart[cluster];
+    uint size = clusterStart[cluster + 1] - first;
+
+    if (!laneAny(loadLanes(a.phase) == FLUID))
+        return;
+
+    const uint *nbrs = neighbors + neighborStart[cluster];
+    uint numNeighbors = neighborBands[cluster].x + neighborBands[cluster].y;
+
+    lanef lambda = loadLanes(lambdas + cluster * CLUSTER_SIZE);
+    lanef deltaX = {}, deltaY = {}, deltaZ = {}, count = {};
+    for (uint i = 0; i < numNeighbors; i++)
+    {
+        uint j = nbrs[i];
+        solveFluidTile(a, lambda, clusters[j], lambdas + j * CLUSTER_SIZE, j == cluster, deltaX, deltaY, deltaZ,
+                       count);
+    }
+
+    for (uint l = 0; l < size; l++)
+    {
+        if (a.phase[l] != FLUID)
+            continue;
+
+        uint origIndex = gridParticleIndex[first + l];
+        float3 delta = make_float3(deltaX[l], deltaY[l], deltaZ[l]);
+        particles[origIndex] += make_float4(delta / (ros[origIndex] + count[l]), 0.f);
+    }
+}
+
+#endif // CPU_INTEGRATION_KERNEL_H
@@ -0,0 +1,51 @@
+/*
+ * OpenGL buffer "interop" for the CPU backend. A mapped buffer is
+ * a host copy of the VBO which is read back on map and uploaded
+ * again on unmap.
+ */
+
+#include <GL/glew.h>
+#include <vector>
+
+struct cudaGraphicsResource
+{
+    GLuint vbo;
+    std::vector<char> data;
+};
+
+extern "C"
+{
+
+    void registerGLBufferObject(unsigned int vbo, struct cudaGraphicsResource **cuda_vbo_resource)
+    {
+        *cuda_vbo_resource = new cudaGraphicsResource;
+        (*cuda_vbo_resource)->vbo = vbo;
+    }
+
+    void unregisterGLBufferObject(struct cudaGraphicsResource *cuda_vbo_resource)
+    {
+        delete cuda_vbo_resource;
+    }
+
+    void *mapGLBufferObject(struct cudaGraphicsResource **cuda_vbo_resource)
+    {
+        cudaGraphicsResource *resource = *cuda_vbo_resource;
+
+        GLint size = 0;
+        glBindBuffer(GL_ARRAY_BUFFER, resource->vbo);
+        glGetBufferParameteriv(GL_ARRAY_BUFFER, GL_BUFFER_SIZE, &size);
+        resource->data.resize(size);
+        glGetBufferSubData(GL_ARRAY_BUFFER, 0, size, resource->data.data());
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+        return resource->data.data();
+    }
+
+    void unmapGLBufferObject(struct cudaGraphicsResource *cuda_vbo_resource)
+    {
+        glBindBuffer(GL_ARRAY_BUFFER, cuda_vbo_resource->vbo);
+        glBufferSubData(GL_ARRAY_BUFFER, 0, cuda_vbo_resource->data.size(), cuda_vbo_resource->data.data());
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+    }
+
+}
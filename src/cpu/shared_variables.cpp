@@ -0,0 +1,51 @@
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+#include "context.h"
+#include "shared_variables.cuh"
+
+
+extern "C"
+{
+
+    void copyToXstar(float *pos, uint numParticles)
+    {
+        // copy X to X*
+        memcpy(currentContext().Xstar.data(), pos, numParticles * 4 * sizeof(float));
+    }
+
+    int *getPhaseRawPtr()
+    {
+        return currentContext().phase.data();
+    }
+
+    float *getXstarRawPtr()
+    {
+        return currentContext().Xstar.data();
+    }
+
+    float *getWRawPtr()
+    {
+        return currentContext().W.data();
+    }
+
+    float *getRosRawPtr()
+    {
+        return currentContext().ros.data();
+    }
+
+    void printXstar()
+    {
+        const std::vector<float> &Xstar = currentContext().Xstar;
+
+        printf("Xstar: size: %u\n", (uint)Xstar.size());
+        for (uint i = 0; i < Xstar.size() / 4; i++)
+        {
+            uint index = i * 4;
+            printf("i: %u: %.2f, %.2f, %.2f\n", i, Xstar[index + 0], Xstar[index + 1], Xstar[index + 2]);
+        }
+        printf("\n");
+    }
+
+}
@@ -0,0 +1,307 @@
+/*
+ * Host implementation of the constraint solver functions
+ * declared in wrappers.cuh.
+ */
+
+#include <string.h>
+#include <algorithm>
+#include <mutex>
+#include <vector>
+
+#include "context.h"
+#include "solver_kernel.h"
+#include "threadpool.h"
+#include "shared_variables.cuh"
+
+// groups the distance constraints by colour (a counting sort)
+static void sortByColour(SimContext &c)
+{
+    uint numConstraints = c.dists.size();
+    const uint numColours = DISTANCE_COLOURS + 1;
+
+    c.distColourStart.assign(numColours + 1, 0);
+    for (uint i = 0; i < numConstraints; i++)
+        c.distColourStart[c.distColour[i] + 1]++;
+    for (uint k = 0; k < numColours; k++)
+        c.distColourStart[k + 1] += c.distColourStart[k];
+
+    std::vector<uint> next(c.distColourStart.begin(), c.distColourStart.end() - 1);
+    c.distColourOrder.resize(numConstraints);
+    for (uint i = 0; i < numConstraints; i++)
+        c.distColourOrder[next[c.distColour[i]]++] = i;
+}
+
+// the distance constraint rows of the particles (a counting sort of
+// the constraint ends by particle, stable so every row is in
+// constraint order)
+static void buildDistanceRows(SimContext &c, uint numParticles)
+{
+    uint numEnds = c.distsI.size();
+    const uint *ends = c.distsI.data();
+
+    c.distRowStart.assign(numParticles + 1, 0);
+    for (uint e = 0; e < numEnds; e++)
+        c.distRowStart[ends[e] + 1]++;
+    for (uint i = 0; i < numParticles; i++)
+        c.distRowStart[i + 1] += c.distRowStart[i];
+
+    std::vector<uint> next(c.distRowStart.begin(), c.distRowStart.end() - 1);
+    c.distRows.resize(numEnds);
+    for (uint e = 0; e < numEnds; e++)
+        c.distRows[next[ends[e]]++] = e;
+}
+
+// the compliance of a constraint for the step, over dt^2 (XPBD)
+static inline float stepCompliance(const SimParams &params, float compliance)
+{
+    return compliance > 0.f ? compliance / (params.deltaTime * params.deltaTime) : 0.f;
+}
+
+static void solveDistanceColours(SimContext &c, float4 *pos4)
+{
+    if (c.distColourOrder.size() != c.dists.size())
+        sortByColour(c);
+
+    const uint2 *indices = (const uint2 *) c.distsI.data();
+    const float *dDists = c.dists.data();
+    const float *compliance = c.distCompliance.data();
+    float *lambda = c.distLambda.data();
+    const uint *order = c.distColourOrder.data();
+    const SimParams params = c.params;
+
+    // the constraints of a colour share no particle and run in
+    // parallel, the overflow colour after them one by one
+    for (uint k = 0; k < DISTANCE_COLOURS; k++)
+    {
+        uint first = c.distColourStart[k];
+        uint last = c.distColourStart[k + 1];
+        if (first == last)
+            continue;
+
+        parallelFor(last - first, [=](uint i)
+        {
+            uint j = order[first + i];
+            solveDistance(pos4, indices[j], dDists[j], stepCompliance(params, compliance[j]), lambda[j]);
+        });
+    }
+
+    for (uint i = c.distColourStart[DISTANCE_COLOURS]; i < c.distColourStart[DISTANCE_COLOURS + 1]; i++)
+    {
+        uint j = order[i];
+        solveDistance(pos4, indices[j], dDists[j], stepCompliance(params, compliance[j]), lambda[j]);
+    }
+}
+
+// the Lagrange multipliers start every step at zero
+static void resetDistanceConstraints()
+{
+    SimContext &c = currentContext();
+    std::fill(c.distLambda.begin(), c.distLambda.end(), 0.f);
+}
+
+static void resetPointConstraints()
+{
+    SimContext &c = currentContext();
+    std::fill(c.pointLambda.begin(), c.pointLambda.end(), make_float3(0.f));
+}
+
+extern "C"
+{
+
+    void updateOccurences(uint *index, uint num)
+    {
+        std::vector<uint> &occurences = currentContext().occurences;
+        for (uint i = 0; i < num; i++)
+            occurences[index[i]]++;
+    }
+
+    void addPointConstraint(uint *index, float *point, float *compliance, uint numConstraints)
+    {
+        SimContext &c = currentContext();
+
+        c.points.insert(c.points.end(), point, point + 3 * numConstraints);
+        c.pointsI.insert(c.pointsI.end(), index, index + numConstraints);
+        c.pointCompliance.insert(c.pointCompliance.end(), compliance, compliance + numConstraints);
+        c.pointLambda.resize(c.pointsI.size());
+
+        updateOccurences(index, numConstraints);
+    }
+
+    void addDistanceConstraint(uint *index, float *distance, float *compliance, uint numConstraints)
+    {
+        SimContext &c = currentContext();
+
+        c.dists.insert(c.dists.end(), distance, distance + numConstraints);
+        c.distsI.insert(c.distsI.end(), index, index + 2 * numConstraints);
+        c.distCompliance.insert(c.distCompliance.end(), compliance, compliance + numConstraints);
+        c.distLambda.resize(c.dists.size());
+
+        c.deltas.resize(c.dists.size());
+
+        updateOccurences(index, 2 * numConstraints);
+
+        // colour the new constraints greedily, in the order they come
+        unsigned long long *masks = c.distColourMask.data();
+        for (uint i = 0; i < numConstraints; i++)
+            c.distColour.push_back(takeColour(masks[index[2 * i]], masks[index[2 * i + 1]]));
+    }
+
+    void setDistanceCompliance(float compliance)
+    {
+        SimContext &c = currentContext();
+        std::fill(c.distCompliance.begin(), c.distCompliance.end(), compliance);
+    }
+
+    void solvePointConstraints(float *particles)
+    {
+        SimContext &c = currentContext();
+        uint numConstraints = c.pointsI.size();
+
+        if (numConstraints == 0)
+            return;
+
+        float4 *pos4 = (float4 *) particles;
+        const uint *indices = c.pointsI.data();
+        const float3 *dPoints = (const float3 *) c.points.data();
+        const float *compliance = c.pointCompliance.data();
+        float3 *lambda = c.pointLambda.data();
+        const SimParams params = c.params;
+
+        parallelFor(numConstraints, [=](uint i)
+        {
+            pointConstraint(pos4, indices[i], dPoints[i], stepCompliance(params, compliance[i]), lambda[i]);
+        });
+    }
+
+    void solveDistanceConstraints(float *particles)
+    {
+        SimContext &c = currentContext();
+        uint numConstraints = c.dists.size();
+
+        if (numConstraints == 0)
+            return;
+
+        float4 *pos4 = (float4 *) particles;
+
+        if (c.params.distanceSolver == DISTANCE_GAUSS_SEIDEL)
+        {
+            solveDistanceColours(c, pos4);
+            return;
+        }
+
+        uint numParticles = c.occurences.size();
+        if (c.distRows.size() != 2 * numConstraints || c.distRowStart.size() != numParticles + 1)
+            buildDistanceRows(c, numParticles);
+
+        const uint2 *indices = (const uint2 *) c.distsI.data();
+        const float *dDists = c.dists.data();
+        const float *compliance = c.distCompliance.data();
+        float *lambda = c.distLambda.data();
+        float4 *dDeltas = c.deltas.data();
+        const SimParams params = c.params;
+
+        // the correction of the first particle, the second one gets its negative
+        parallelFor(numConstraints, [=](uint i)
+        {
+            float dLambda;
+            dDeltas[i] = computeDistanceDelta(pos4, indices[i], dDists[i], stepCompliance(params, compliance[i]),
+                                              lambda[i], dLambda);
+            lambda[i] += dLambda;
+        });
+
+        // every particle sums its corrections in constraint order (the
+        // sort/reduce_by_key of the CUDA path) and averages them over all
+        // constraints affecting it
+        const uint *rowStart = c.distRowStart.data();
+        const uint *rows = c.distRows.data();
+        const uint *dOcc = c.occurences.data();
+        parallelFor(numParticles, [=](uint i)
+        {
+            uint first = rowStart[i];
+            uint last = rowStart[i + 1];
+            if (first == last)
+                return;
+
+            float4 sum = make_float4(0.f);
+            for (uint k = first; k < last; k++)
+            {
+                if (rows[k] & 1)
+                    sum -= dDeltas[rows[k] >> 1];
+                else
+                    sum += dDeltas[rows[k] >> 1];
+            }
+            pos4[i] += sum / dOcc[i];
+        });
+    }
+
+    float distanceConstraintError(float *particles)
+    {
+        SimContext &c = currentContext();
+
+        const float4 *pos4 = (const float4 *) particles;
+        const uint2 *indices = (const uint2 *) c.distsI.data();
+        const float *dDists = c.dists.data();
+
+        uint numConstraints = c.dists.size();
+        if (numConstraints == 0)
+            return 0.f;
+
+        double sum = 0.0;
+        std::mutex sumMutex;
+
+        ThreadPool::instance().parallelFor(0, numConstraints, [&](uint begin, uint end)
+        {
+            double chunkSum = 0.0;
+            for (uint i = begin; i < end; i++)
+                chunkSum += distanceError(pos4, indices[i], dDists[i]);
+
+            std::lock_guard<std::mutex> lock(sumMutex);
+            sum += chunkSum;
+        });
+
+        return sum / numConstraints;
+    }
+
+
+    /*
+     * The constraint kinds. A new kind keeps its data in arrays by
+     * constraint in the context, adds an add*Constraint function, remaps
+     * its particle indices in permuteParticles and registers its solve
+     * function here, in the order the solver applies it, and the one
+     * that clears its Lagrange multipliers at the start of a step.
+     */
+    struct ConstraintType
+    {
+        const char *name;
+        void (*solve)(float *particles);
+        void (*reset)();
+    };
+
+    static const ConstraintType constraintTypes[] =
+    {
+        { "solveDistanceConstraints", solveDistanceConstraints, resetDistanceConstraints },
+        { "solvePointConstraints", solvePointConstraints, resetPointConstraints },
+    };
+
+    uint numConstraintTypes()
+    {
+        return sizeof(constraintTypes) / sizeof(constraintTypes[0]);
+    }
+
+    const char *constraintTypeName(uint type)
+    {
+        return constraintTypes[type].name;
+    }
+
+    void solveConstraints(uint type, float *particles)
+    {
+        constraintTypes[type].solve(particles);
+    }
+
+    void resetConstraints()
+    {
+        for (uint type = 0; type < numConstraintTypes(); type++)
+            constraintTypes[type].reset();
+    }
+
+}
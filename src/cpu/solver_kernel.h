@@ -0,0 +1,83 @@
+#ifndef CPU_SOLVER_KERNEL_H
+#define CPU_SOLVER_KERNEL_H
+
+#include "helper_math.h"
+#include "shared_variables.cuh"
+
+// Pins a particle to a fixed point. With a compliance (the inverse
+// stiffness over dt^2, XPBD) it is pulled towards it by a spring
+// instead, lambda accumulates the multipliers of the step.
+inline void pointConstraint(float4 *particles, uint index, const float3 &point, float compliance, float3 &lambda)
+{
+    float4 pos = particles[index];
+    if (compliance == 0.f)
+    {
+        particles[index] = make_float4(point, pos.w);
+        return;
+    }
+
+    float3 dLambda = (point - make_float3(pos) - compliance * lambda) / (1.f + compliance);
+    lambda += dLambda;
+    particles[index] = make_float4(make_float3(pos) + dLambda, pos.w);
+}
+
+// Computes the correction of the first end of a distance constraint,
+// the second one moves by its negative, and the change of its Lagrange
+// multiplier (XPBD). compliance is the inverse stiffness over dt^2, 0
+// makes the constraint rigid. Both ends move by the same amount, the
+// inverse masses are not taken into account.
+inline float4 computeDistanceDelta(const float4 *particles, uint2 index, float restDistance, float compliance,
+                                   float lambda, float &dLambda)
+{
+    float4 p1 = particles[index.x];
+    float4 p2 = particles[index.y];
+
+    float4 relPos = p1 - p2;
+    relPos.w = 0.f; // inverse masses not needed
+
+    float dist = length(relPos);
+    if (dist > 0.0001f)
+    {
+        float4 grad = relPos / dist;
+        dLambda = ((restDistance - dist) - compliance * lambda) / (2.f + compliance);
+        return grad * dLambda;
+    }
+
+    dLambda = 0.f;
+    return make_float4(0);
+}
+
+// moves both ends of a distance constraint by their corrections in
+// place, for the Gauss-Seidel sweeps over one colour at a time
+inline void solveDistance(float4 *particles, uint2 index, float restDistance, float compliance, float &lambda)
+{
+    float dLambda;
+    float4 delta = computeDistanceDelta(particles, index, restDistance, compliance, lambda, dLambda);
+    lambda += dLambda;
+
+    particles[index.x] += delta;
+    particles[index.y] -= delta;
+}
+
+// how far a distance constraint is off, relative to its rest distance
+inline float distanceError(const float4 *particles, uint2 index, float restDistance)
+{
+    float3 relPos = make_float3(particles[index.x] - particles[index.y]);
+    return fabsf(length(relPos) - restDistance) / fmaxf(restDistance, 0.0001f);
+}
+
+// The lowest colour none of the constraints of either particle has, it
+// is taken for both. DISTANCE_COLOURS if all are taken.
+inline uint takeColour(unsigned long long &mask1, unsigned long long &mask2)
+{
+    unsigned long long taken = mask1 | mask2;
+    if (taken == ~0ull)
+        return DISTANCE_COLOURS;
+
+    uint colour = __builtin_ctzll(~taken);
+    mask1 |= 1ull << colour;
+    mask2 |= 1ull << colour;
+    return colour;
+}
+
+#endif // CPU_SOLVER_KERNEL_H
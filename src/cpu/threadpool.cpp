@@ -0,0 +1,118 @@
+#include <stdlib.h>
+#include <algorithm>
+
+#include "threadpool.h"
+
+/**
+ * @brief ThreadPool::instance
+ *
+ *      The pool shared by all CPU backend stages. The thread count
+ *      defaults to the hardware concurrency and can be overridden
+ *      with the THESIS_THREADS environment variable.
+ */
+ThreadPool &ThreadPool::instance()
+{
+    static ThreadPool pool([]() -> uint
+    {
+        const char *env = getenv("THESIS_THREADS");
+        if (env && atoi(env) > 0)
+            return static_cast<uint>(atoi(env));
+        return std::max(1u, std::thread::hardware_concurrency());
+    }());
+    return pool;
+}
+
+
+ThreadPool::ThreadPool(uint numThreads)
+    : m_body(NULL),
+      m_next(0),
+      m_end(0),
+      m_grain(1),
+      m_busy(0),
+      m_generation(0),
+      m_stop(false)
+{
+    for (uint i = 1; i < numThreads; i++)
+        m_workers.push_back(std::thread(&ThreadPool::workerLoop, this));
+}
+
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+    }
+    m_wake.notify_all();
+
+    for (std::thread &worker : m_workers)
+        worker.join();
+}
+
+
+void ThreadPool::parallelFor(uint begin, uint end, const Body &body, uint minGrain)
+{
+    if (end <= begin)
+        return;
+
+    uint count = end - begin;
+    uint grain = std::max(minGrain, count / (4 * numThreads()) + 1);
+
+    std::unique_lock<std::mutex> submit(m_submitMutex, std::try_to_lock);
+    if (m_workers.empty() || count <= grain || !submit.owns_lock())
+    {
+        body(begin, end);
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_body = &body;
+        m_next = begin;
+        m_end = end;
+        m_grain = grain;
+        m_busy = static_cast<uint>(m_workers.size());
+        m_generation++;
+    }
+    m_wake.notify_all();
+
+    runChunks();
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_done.wait(lock, [this] { return m_busy == 0; });
+    m_body = NULL;
+}
+
+
+void ThreadPool::workerLoop()
+{
+    uint seen = 0;
+    for (;;)
+    {
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_wake.wait(lock, [this, seen] { return m_stop || m_generation != seen; });
+            if (m_stop)
+                return;
+            seen = m_generation;
+        }
+
+        runChunks();
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (--m_busy == 0)
+            m_done.notify_one();
+    }
+}
+
+
+void ThreadPool::runChunks()
+{
+    for (;;)
+    {
+        uint start = m_next.fetch_add(m_grain);
+        if (start >= m_end)
+            return;
+        (*m_body)(start, std::min(start + m_grain, m_end));
+    }
+}
@@ -0,0 +1,66 @@
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+typedef unsigned int uint;
+
+/*
+ * Fixed set of worker threads used by the CPU backend in place of
+ * CUDA kernel launches. A parallelFor splits an index range into
+ * chunks which the workers and the calling thread pull from a shared
+ * counter. Calls made while the pool is busy (from another simulation
+ * thread or from inside a running loop) execute on the caller.
+ */
+class ThreadPool
+{
+public:
+    typedef std::function<void(uint, uint)> Body;
+
+    static ThreadPool &instance();
+
+    explicit ThreadPool(uint numThreads);
+    ~ThreadPool();
+
+    // number of threads taking part in a loop, including the caller
+    uint numThreads() const { return static_cast<uint>(m_workers.size()) + 1; }
+
+    void parallelFor(uint begin, uint end, const Body &body, uint minGrain = 256);
+
+private:
+    void workerLoop();
+    void runChunks();
+
+    std::vector<std::thread> m_workers;
+
+    std::mutex m_submitMutex;   // held for the duration of one loop
+    std::mutex m_mutex;
+    std::condition_variable m_wake;
+    std::condition_variable m_done;
+
+    const Body *m_body;
+    std::atomic<uint> m_next;
+    uint m_end;
+    uint m_grain;
+    uint m_busy;
+    uint m_generation;
+    bool m_stop;
+};
+
+// calls f(i) for every i in [0, n)
+template <typename F>
+inline void parallelFor(uint n, F f, uint minGrain = 256)
+{
+    ThreadPool::instance().parallelFor(0, n, [&f](uint begin, uint end)
+    {
+        for (uint i = begin; i < end; i++)
+            f(i);
+    }, minGrain);
+}
+
+#endif // THREADPOOL_H
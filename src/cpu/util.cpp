@@ -0,0 +1,60 @@
+/*
+ * Host implementation of util.cuh. "Device" memory is ordinary
+ * host memory, aligned for vector loads.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+
+#include "threadpool.h"
+
+typedef unsigned int uint;
+
+extern "C"
+{
+
+    void allocateArray(void **devPtr, int size)
+    {
+        if (posix_memalign(devPtr, 64, std::max(size, 1)) != 0)
+        {
+            fprintf(stderr, "allocateArray: failed to allocate %d bytes\n", size);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    void freeArray(void *devPtr)
+    {
+        free(devPtr);
+    }
+
+    void cudaInit()
+    {
+        // start the worker threads up front
+        ThreadPool::instance();
+    }
+
+    void copyArrayToDevice(void *device, const void *host, int offset, int size)
+    {
+        memcpy((char *) device + offset, host, size);
+    }
+
+    void copyArrayFromDevice(void *host, const void *device, int size)
+    {
+        memcpy(host, device, size);
+    }
+
+    //Round a / b to nearest higher integer value
+    uint iDivUp(uint a, uint b)
+    {
+        return (a % b != 0) ? (a / b + 1) : (a / b);
+    }
+
+    // compute grid and thread block size for a given number of elements
+    void computeGridSize(uint n, uint blockSize, uint &numBlocks, uint &numThreads)
+    {
+        numThreads = std::min(blockSize, n);
+        numBlocks = iDivUp(n, numThreads);
+    }
+}
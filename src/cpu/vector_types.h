@@ -0,0 +1,70 @@
+/*
+ * Host stand-in for the CUDA toolkit's vector_types.h.
+ *
+ * The shared headers (kernel.cuh, helper_math.h, sdf.h, ...) use the
+ * CUDA vector types. When the CPU backend is built without the CUDA
+ * toolkit this header provides layout compatible definitions and the
+ * make_* constructors from vector_functions.h.
+ */
+
+#ifndef CPU_VECTOR_TYPES_H
+#define CPU_VECTOR_TYPES_H
+
+struct alignas(8) int2 { int x, y; };
+struct int3 { int x, y, z; };
+struct alignas(16) int4 { int x, y, z, w; };
+
+struct alignas(8) uint2 { unsigned int x, y; };
+struct uint3 { unsigned int x, y, z; };
+struct alignas(16) uint4 { unsigned int x, y, z, w; };
+
+struct alignas(8) float2 { float x, y; };
+struct float3 { float x, y, z; };
+struct alignas(16) float4 { float x, y, z, w; };
+
+inline int2 make_int2(int x, int y)
+{
+    int2 t; t.x = x; t.y = y; return t;
+}
+
+inline int3 make_int3(int x, int y, int z)
+{
+    int3 t; t.x = x; t.y = y; t.z = z; return t;
+}
+
+inline int4 make_int4(int x, int y, int z, int w)
+{
+    int4 t; t.x = x; t.y = y; t.z = z; t.w = w; return t;
+}
+
+inline uint2 make_uint2(unsigned int x, unsigned int y)
+{
+    uint2 t; t.x = x; t.y = y; return t;
+}
+
+inline uint3 make_uint3(unsigned int x, unsigned int y, unsigned int z)
+{
+    uint3 t; t.x = x; t.y = y; t.z = z; return t;
+}
+
+inline uint4 make_uint4(unsigned int x, unsigned int y, unsigned int z, unsigned int w)
+{
+    uint4 t; t.x = x; t.y = y; t.z = z; t.w = w; return t;
+}
+
+inline float2 make_float2(float x, float y)
+{
+    float2 t; t.x = x; t.y = y; return t;
+}
+
+inline float3 make_float3(float x, float y, float z)
+{
+    float3 t; t.x = x; t.y = y; t.z = z; return t;
+}
+
+inline float4 make_float4(float x, float y, float z, float w)
+{
+    float4 t; t.x = x; t.y = y; t.z = z; t.w = w; return t;
+}
+
+#endif // CPU_VECTOR_TYPES_H
@@ -0,0 +1,33 @@
+/*
+ * Solver constants shared by the CUDA and CPU backends.
+ */
+
+#ifndef CONSTANTS_CUH
+#define CONSTANTS_CUH
+
+#define EPS 0.001f
+
+////////////// fluid constants /////////////
+#define MAX_FLUID_NEIGHBORS 500
+#define MAX_SDF_NEIGHBORS 100
+
+#define H 2.f       // kernel radius
+#define H2 4.f      // H^2
+#define H6 64.f     // H^6
+#define H9 512.f    // H^9
+#define POLY6_COEFF 0.00305992474f // 315 / (64 * pi * H9)
+#define SPIKEY_COEFF 0.22381163872f // 45 / (pi * H6)
+
+#define FLUID_RELAXATION .01f // epsilon used when calculating lambda
+#define K_P .1f              // scales artificial pressure
+#define E_P 4.f              // exponent to art. pressure
+#define DQ_P .2f             // between .1 and .3 (for art pressure)
+
+
+/////////////////// friction ///////////////
+#define S_FRICTION .005f
+#define K_FRICTION .0002f
+//#define S_FRICTION .15f
+//#define K_FRICTION .003f
+
+#endif // CONSTANTS_CUH
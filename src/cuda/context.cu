@@ -0,0 +1,130 @@
+#include <assert.h>
+#include <algorithm>
+
+#include <thrust/copy.h>
+#include <thrust/gather.h>
+#include <thrust/sequence.h>
+
+#include "helper_cuda.h"
+#include "constants.cuh"
+#include "context.cuh"
+#include "util.cuh"
+
+static thread_local SimContext *current = NULL;
+
+// resizes v to n elements, at least doubling the capacity whenever it
+// has to reallocate so appending particles is amortised O(1)
+template <typename T>
+static void grow(thrust::device_vector<T> &v, size_t n)
+{
+    if (n > v.capacity())
+        v.reserve(std::max(n, 2 * v.capacity()));
+    v.resize(n);
+}
+
+// appends num elements of host data to v
+template <typename T>
+static void append(thrust::device_vector<T> &v, const T *data, size_t num)
+{
+    size_t size = v.size();
+    grow(v, size + num);
+    copyArrayToDevice(thrust::raw_pointer_cast(v.data()) + size, data, 0, num * sizeof(T));
+}
+
+SimContext &currentContext()
+{
+    assert(current && "no simulation context bound to this thread");
+    return *current;
+}
+
+extern "C"
+{
+
+    SimContext *createContext()
+    {
+        SimContext *context = new SimContext();
+
+        allocateArray((void **)&context->rands, 6 * sizeof(float));
+        checkCudaErrors(curandCreateGenerator(&context->gen, CURAND_RNG_PSEUDO_DEFAULT));
+        checkCudaErrors(curandSetPseudoRandomGeneratorSeed(context->gen, 1234ULL));
+
+        return context;
+    }
+
+    void destroyContext(SimContext *context)
+    {
+        if (current == context)
+            current = NULL;
+
+        checkCudaErrors(curandDestroyGenerator(context->gen));
+        freeArray(context->rands);
+
+        // the device vectors free their memory
+        delete context;
+    }
+
+    void bindContext(SimContext *context)
+    {
+        current = context;
+
+        // constant memory is shared by all contexts
+        if (context)
+            uploadParameters(&context->params);
+    }
+
+    void reserveParticles(uint numParticles)
+    {
+        SimContext &c = currentContext();
+
+        c.V.reserve(4 * numParticles);
+        c.ros.reserve(numParticles);
+        c.W.reserve(numParticles);
+        c.phase.reserve(numParticles);
+
+        c.lambda.reserve(numParticles);
+        c.numNeighbors.reserve(numParticles);
+        c.neighbors.reserve(numParticles * MAX_FLUID_NEIGHBORS);
+        c.textureVec.reserve(4 * numParticles);
+        c.Xstar.reserve(4 * numParticles);
+        c.occurences.reserve(numParticles);
+        c.distColourMask.reserve(numParticles);
+        c.particleSlot.reserve(numParticles);
+    }
+
+    void appendParticles(const float *vel, const float *ro, const float *w, const int *phase, uint numParticles)
+    {
+        SimContext &c = currentContext();
+
+        append(c.V, vel, 4 * numParticles);
+        append(c.ros, ro, numParticles);
+        append(c.W, w, numParticles);
+        append(c.phase, phase, numParticles);
+
+        uint total = c.W.size();
+
+        // resize but don't need to fill
+        grow(c.lambda, total);
+        grow(c.numNeighbors, total);
+        grow(c.neighbors, total * MAX_FLUID_NEIGHBORS);
+        grow(c.textureVec, 4 * total);
+        grow(c.Xstar, 4 * total);
+
+        // new particles are not part of any constraint yet (resize zero fills)
+        grow(c.occurences, total);
+        grow(c.distColourMask, total);
+
+        // and are stored after all others, so their slots are their handles
+        uint first = c.particleSlot.size();
+        grow(c.particleSlot, total);
+        thrust::sequence(c.particleSlot.begin() + first, c.particleSlot.end(), first);
+    }
+
+    void findParticleSlots(uint *index, uint num)
+    {
+        thrust::device_vector<uint> handles(index, index + num);
+        thrust::device_vector<uint> slots(num);
+        thrust::gather(handles.begin(), handles.end(), currentContext().particleSlot.begin(), slots.begin());
+        thrust::copy(slots.begin(), slots.end(), index);
+    }
+
+}
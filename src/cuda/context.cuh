@@ -0,0 +1,105 @@
+#ifndef CONTEXT_CUH
+#define CONTEXT_CUH
+
+#include <curand.h>
+#include <thrust/device_vector.h>
+#include <vector>
+
+#include "kernel.cuh"
+
+/*
+ * All per-simulation device state. Every ParticleSystem owns one and
+ * binds it before calling into the backend, so several simulations can
+ * exist side by side. The simulation parameters live in constant memory
+ * which all contexts of a device share, they are uploaded again on every
+ * bind. Stepping two contexts from different host threads at the same
+ * time is therefore not supported on this backend.
+ */
+struct SimContext
+{
+    SimParams params;
+
+    /*
+     *   INTEGRATION
+     */
+    curandGenerator_t gen;
+    float *rands;
+
+    thrust::device_vector<float> V; // particle velocities
+    thrust::device_vector<float> lambda;
+    thrust::device_vector<float> denom;
+
+    thrust::device_vector<float> ros;
+
+    // rows of MAX_FLUID_NEIGHBORS with the contact band from the front
+    // and the fluid band from the back, numNeighbors holds both sizes
+    thrust::device_vector<uint> neighbors;
+    thrust::device_vector<uint2> numNeighbors;
+    thrust::device_vector<uint> neighborsSdf;
+    thrust::device_vector<uint> numNeighborsSdf;
+
+    // sorted positions the neighbor lists were built from, and the
+    // squared distances moved since (scratch space)
+    thrust::device_vector<float4> neighborPos;
+    thrust::device_vector<float> moved2;
+
+    thrust::device_vector<float> textureVec;
+
+    thrust::device_vector<uint> cellRank;   // scratch space for numbering the occupied cells
+    thrust::device_vector<float4> permuted; // scratch space for permuting the particle arrays in place
+
+    /*
+     *   SOLVER
+     */
+    thrust::device_vector<uint> distsI;
+    thrust::device_vector<float> dists;
+    thrust::device_vector<float> distCompliance;    // inverse stiffness, 0 for rigid constraints (XPBD)
+    thrust::device_vector<float> distLambda;        // Lagrange multipliers accumulated during a step
+
+    thrust::device_vector<uint> pointsI;
+    thrust::device_vector<float> points;
+    thrust::device_vector<float> pointCompliance;
+    thrust::device_vector<float3> pointLambda;
+
+    thrust::device_vector<float4> deltas;       // correction of the first particle of every constraint
+
+    // the distance constraints of every particle in compressed rows:
+    // those of particle i are distRows[distRowStart[i] .. distRowStart[i + 1]),
+    // as 2 * constraint + 1 if it is the second particle of the constraint.
+    // Built on the host, again when constraints or particles were added
+    // or permuted.
+    thrust::device_vector<uint> distRows;
+    thrust::device_vector<uint> distRowStart;
+
+    thrust::device_vector<uint> occurences;     // number of constraints affecting a particle
+
+    // graph colouring of the distance constraints for the Gauss-Seidel
+    // solver, coloured on the host: the colour of every constraint, the
+    // colours taken by the constraints of every particle (a bit each)
+    // and the constraints by colour, those of colour k are
+    // distColourOrder[distColourStart[k] .. distColourStart[k + 1])
+    std::vector<uint> distColour;
+    thrust::device_vector<unsigned long long> distColourMask;
+    thrust::device_vector<uint> distColourOrder;
+    std::vector<uint> distColourStart;
+
+    /*
+     *   SHARED
+     */
+    thrust::device_vector<float> Xstar;	// guess vectors
+    thrust::device_vector<float> W;     // vector of inverse masses
+    thrust::device_vector<int> phase;
+
+    // storage slot of every particle handle (its index in order of
+    // creation), the identity until permuteParticles() reorders them
+    thrust::device_vector<uint> particleSlot;
+    thrust::device_vector<uint> inverseOrder;   // scratch space, old slot -> new slot
+};
+
+// the context bound to the calling thread with bindContext()
+SimContext &currentContext();
+
+// copies parameters to constant memory (integration.cu)
+void uploadParameters(const SimParams *hostParams);
+
+#endif // CONTEXT_CUH
@@ -8,32 +8,50 @@
 #include <thrust/device_ptr.h>
 #include <thrust/device_vector.h>
 #include <thrust/for_each.h>
+#include <thrust/gather.h>
+#include <thrust/iterator/counting_iterator.h>
+#include <thrust/functional.h>
 #include <thrust/iterator/zip_iterator.h>
+#include <thrust/reduce.h>
+#include <thrust/scan.h>
+#include <thrust/scatter.h>
+#include <thrust/sequence.h>
 #include <thrust/transform.h>
 
 #include "helper_cuda.h"
+#include "context.cuh"
 #include "integration_kernel.cuh"
 #include "util.cuh"
 #include "shared_variables.cuh"
 
 //#define PRINT
 
-curandGenerator_t gen(0);
-
-thrust::device_vector<float> V; // particle velocities
-thrust::device_vector<float> lambda;
-thrust::device_vector<float> denom;
-
-thrust::device_vector<float> ros;
+// gathers the first n elements of data into the order given by
+// sortedIndex, using scratch (float4s, so suitably aligned) in between
+template <typename T>
+static void permuteArray(T *data, thrust::device_ptr<uint> sortedIndex, uint n,
+                         thrust::device_vector<float4> &scratch)
+{
+    scratch.resize((n * sizeof(T) + sizeof(float4) - 1) / sizeof(float4));
+    T *permuted = (T *) thrust::raw_pointer_cast(scratch.data());
 
-thrust::device_vector<uint> neighbors;
-thrust::device_vector<uint> numNeighbors;
-thrust::device_vector<uint> neighborsSdf;
-thrust::device_vector<uint> numNeighborsSdf;
+    thrust::gather(sortedIndex, sortedIndex + n, thrust::device_ptr<T>(data), thrust::device_ptr<T>(permuted));
+    checkCudaErrors(cudaMemcpy(data, permuted, n * sizeof(T), cudaMemcpyDeviceToDevice));
+}
 
-thrust::device_vector<float> textureVec;
+// replaces every index by its new slot
+static void remapIndices(thrust::device_vector<uint> &indices, const thrust::device_vector<uint> &newSlot)
+{
+    thrust::device_vector<uint> remapped(indices.size());
+    thrust::gather(indices.begin(), indices.end(), newSlot.begin(), remapped.begin());
+    indices.swap(remapped);
+}
 
-float *rands;
+void uploadParameters(const SimParams *hostParams)
+{
+    // copy parameters to constant memory
+    checkCudaErrors(cudaMemcpyToSymbol(params, hostParams, 1 * sizeof(SimParams)));
+}
 
 extern "C"
 {
@@ -42,67 +60,10 @@ extern "C"
      *****************************************************************************/
 
 
-    void initIntegration()
-    {
-        allocateArray((void **)&rands, 6 * sizeof(float));
-        checkCudaErrors(curandCreateGenerator(&gen, CURAND_RNG_PSEUDO_DEFAULT));
-        checkCudaErrors(curandSetPseudoRandomGeneratorSeed(gen, 1234ULL));
-    }
-
-    void appendIntegrationParticle(float *v, float *ro, uint numParticles)
-    {
-        int sizeV = V.size();
-        int sizeRo = ros.size();
-
-        // resize the vectors
-        V.resize(sizeV + 4 * numParticles);
-        ros.resize(sizeRo + numParticles);
-
-        // get raw pointers to the data
-        float *dV = thrust::raw_pointer_cast(V.data());
-        float *dRos = thrust::raw_pointer_cast(ros.data());
-
-        // copy the new data over to the gpu
-        copyArrayToDevice(dV + sizeV, v, 0, 4 * numParticles * sizeof(float));
-        copyArrayToDevice(dRos + sizeRo, ro, 0, numParticles * sizeof(float));
-
-        // resize but don't need to fill
-        lambda.resize(ros.size());
-        numNeighbors.resize(ros.size());
-        neighbors.resize(V.size() * MAX_FLUID_NEIGHBORS);
-        textureVec.resize(V.size());
-    }
-
-    void freeIntegrationVectors()
-    {
-         V.clear();
-         lambda.clear();
-         denom.clear();
-         ros.clear();
-         neighbors.clear();
-         numNeighbors.clear();
-         textureVec.clear();
-         neighborsSdf.clear();
-         numNeighborsSdf.clear();
-
-         V.shrink_to_fit();
-         lambda.shrink_to_fit();
-         denom.shrink_to_fit();
-         ros.shrink_to_fit();
-         neighbors.shrink_to_fit();
-         numNeighbors.shrink_to_fit();
-         textureVec.shrink_to_fit();
-         neighborsSdf.shrink_to_fit();
-         numNeighborsSdf.shrink_to_fit();
-
-         checkCudaErrors(curandDestroyGenerator(gen));
-         freeArray(rands);
-    }
-
     void setParameters(SimParams *hostParams)
     {
-        // copy parameters to constant memory
-        checkCudaErrors(cudaMemcpyToSymbol(params, hostParams, 1 * sizeof(SimParams)));
+        currentContext().params = *hostParams;
+        uploadParameters(hostParams);
     }
 
 
@@ -125,10 +86,16 @@ extern "C"
      *                              UPDATE POSITIONS
      *****************************************************************************/
 
-    void integrateSystem(float *pos, float deltaTime, uint numParticles)
+    // the passes are not fused on the device, each one is a launch
+    void integrateSystem(float *pos, float deltaTime, uint numParticles, float prevDeltaTime, uint numPending,
+                         uint *gridParticleHash, uint *gridParticleIndex)
     {
         thrust::device_ptr<float4> d_pos4((float4 *)pos);
-        thrust::device_ptr<float4> d_vel4((float4 *)thrust::raw_pointer_cast(V.data()));
+        thrust::device_ptr<float4> d_vel4((float4 *)thrust::raw_pointer_cast(currentContext().V.data()));
+
+        // velocities at the end of the last step
+        if (numPending > 0)
+            calcVelocity(pos, prevDeltaTime, numPending);
 
         // copy current positions for reference later
         copyToXstar(pos, numParticles);
@@ -138,6 +105,9 @@ extern "C"
             thrust::make_zip_iterator(thrust::make_tuple(d_pos4, d_vel4)),
             thrust::make_zip_iterator(thrust::make_tuple(d_pos4+numParticles, d_vel4+numParticles)),
             integrate_functor(deltaTime));
+
+        if (gridParticleHash != NULL)
+            calcHash(gridParticleHash, gridParticleIndex, pos, numParticles);
     }
 
 
@@ -187,7 +157,10 @@ extern "C"
     }
 
 
-    void reorderDataAndFindCellStart(uint  *cellStart,
+    void reorderDataAndFindCellStart(uint  *blockKeys,
+                                     unsigned long long *blockCells,
+                                     uint  *blockFirstCell,
+                                     uint  *cellStart,
                                      uint  *cellEnd,
                                      float *sortedPos,
                                      float *sortedW,
@@ -196,45 +169,66 @@ extern "C"
                                      uint  *gridParticleIndex,
                                      float *oldPos,
                                      uint   numParticles,
-                                     uint   numCells)
+                                     uint   tableSize)
     {
         uint numThreads, numBlocks;
         computeGridSize(numParticles, 256, numBlocks, numThreads);
 
-        // set all cells to empty
-        checkCudaErrors(cudaMemset(cellStart, 0xffffffff, numCells*sizeof(uint)));
+        // set all table slots to empty
+        checkCudaErrors(cudaMemset(blockKeys, 0xffffffff, tableSize*sizeof(uint)));
+        checkCudaErrors(cudaMemset(blockCells, 0, tableSize*sizeof(unsigned long long)));
+
+        BlockTable table = { blockKeys, blockCells, blockFirstCell, tableSize - 1 };
+
+        SimContext &c = currentContext();
+        c.cellRank.resize(numParticles);
+        uint *dCellRank = thrust::raw_pointer_cast(c.cellRank.data());
 
         float *dW = getWRawPtr();
         int *dPhase = getPhaseRawPtr();
 
-        float *pos;
-        checkCudaErrors(cudaMalloc((void**)&pos, numParticles*4*sizeof(float)));
-        checkCudaErrors(cudaMemcpy(pos, oldPos, numParticles*4*sizeof(float), cudaMemcpyDeviceToDevice));
-
-        if (sortedW != NULL)
-        {
-            checkCudaErrors(cudaBindTexture(0, oldPosTex, pos, numParticles * sizeof(float4)));
-            checkCudaErrors(cudaBindTexture(0, invMassTex, dW, numParticles * sizeof(float)));
-            checkCudaErrors(cudaBindTexture(0, oldPhaseTex, dPhase, numParticles * sizeof(int)));
-        }
-        else
+        // without sortedPos the data is in order already, only the grid is built
+        float *pos = NULL;
+        if (sortedPos != NULL)
         {
-            checkCudaErrors(cudaBindTexture(0, posSdfTex, pos, numParticles * sizeof(float4)));
+            checkCudaErrors(cudaMalloc((void**)&pos, numParticles*4*sizeof(float)));
+            checkCudaErrors(cudaMemcpy(pos, oldPos, numParticles*4*sizeof(float), cudaMemcpyDeviceToDevice));
+
+            if (sortedW != NULL)
+            {
+                checkCudaErrors(cudaBindTexture(0, oldPosTex, pos, numParticles * sizeof(float4)));
+                checkCudaErrors(cudaBindTexture(0, invMassTex, dW, numParticles * sizeof(float)));
+                checkCudaErrors(cudaBindTexture(0, oldPhaseTex, dPhase, numParticles * sizeof(int)));
+            }
+            else
+            {
+                checkCudaErrors(cudaBindTexture(0, posSdfTex, pos, numParticles * sizeof(float4)));
+            }
         }
 
         uint smemSize = sizeof(uint)*(numThreads+1);
-        reorderDataAndFindCellStartD<<< numBlocks, numThreads, smemSize>>>(cellStart,
-                                                                           cellEnd,
-                                                                           (float4 *) sortedPos,
-                                                                           sortedW,
-                                                                           sortedPhase,
-                                                                           gridParticleHash,
-                                                                           gridParticleIndex,
-                                                                           (float4 *) oldPos,
-                                                                           dW,
-                                                                           dPhase,
-                                                                           numParticles);
-        getLastCudaError("Kernel execution failed: reorderDataAndFindCellStartD");
+        reorderDataD<<< numBlocks, numThreads, smemSize>>>((float4 *) sortedPos,
+                                                           sortedW,
+                                                           sortedPhase,
+                                                           dCellRank,
+                                                           gridParticleHash,
+                                                           gridParticleIndex,
+                                                           (float4 *) oldPos,
+                                                           dW,
+                                                           dPhase,
+                                                           numParticles);
+        getLastCudaError("Kernel execution failed: reorderDataD");
+
+        // number the occupied cells in key order
+        thrust::inclusive_scan(c.cellRank.begin(), c.cellRank.end(), c.cellRank.begin());
+
+        findCellStartD<<< numBlocks, numThreads >>>(table,
+                                                    cellStart,
+                                                    cellEnd,
+                                                    dCellRank,
+                                                    gridParticleHash,
+                                                    numParticles);
+        getLastCudaError("Kernel execution failed: findCellStartD");
         
 #ifdef PRINT
         /*printf("Sorted:\n");
@@ -259,27 +253,87 @@ extern "C"
         printf("\n");
 #endif
         
-        if (sortedW != NULL)
-        {
-            checkCudaErrors(cudaUnbindTexture(oldPosTex));
-            checkCudaErrors(cudaUnbindTexture(invMassTex));
-            checkCudaErrors(cudaUnbindTexture(oldPhaseTex));
-        }
-        else
+        if (sortedPos != NULL)
         {
-            checkCudaErrors(cudaUnbindTexture(posSdfTex));
+            if (sortedW != NULL)
+            {
+                checkCudaErrors(cudaUnbindTexture(oldPosTex));
+                checkCudaErrors(cudaUnbindTexture(invMassTex));
+                checkCudaErrors(cudaUnbindTexture(oldPhaseTex));
+            }
+            else
+            {
+                checkCudaErrors(cudaUnbindTexture(posSdfTex));
+            }
+
+            checkCudaErrors(cudaFree(pos));
         }
-
-        checkCudaErrors(cudaFree(pos));
     }
 
-    void sortParticles(uint *dGridParticleHash, uint *dGridParticleIndex, uint numParticles)
+    // thrust radix sorts the keys anyway, sortBits and coherent only
+    // matter to the CPU backend
+    void sortParticles(uint *dGridParticleHash, uint *dGridParticleIndex, uint numParticles,
+                       uint sortBits, bool coherent)
     {
         thrust::sort_by_key(thrust::device_ptr<uint>(dGridParticleHash),
                             thrust::device_ptr<uint>(dGridParticleHash + numParticles),
                             thrust::device_ptr<uint>(dGridParticleIndex));
     }
 
+    float reorderPositions(float *sortedPos, uint *gridParticleIndex, float *oldPos, uint numParticles)
+    {
+        SimContext &c = currentContext();
+        c.moved2.resize(numParticles);
+
+        uint numThreads, numBlocks;
+        computeGridSize(numParticles, 256, numBlocks, numThreads);
+
+        reorderPositionsD<<< numBlocks, numThreads >>>((float4 *) sortedPos,
+                                                       thrust::raw_pointer_cast(c.moved2.data()),
+                                                       gridParticleIndex,
+                                                       (float4 *) oldPos,
+                                                       thrust::raw_pointer_cast(c.neighborPos.data()),
+                                                       numParticles);
+        getLastCudaError("Kernel execution failed: reorderPositionsD");
+
+        float maxMoved2 = thrust::reduce(c.moved2.begin(), c.moved2.end(), 0.f, thrust::maximum<float>());
+        return sqrtf(maxMoved2);
+    }
+
+    void permuteParticles(float *pos, float *sortedPos, uint *gridParticleIndex, uint numParticles)
+    {
+        SimContext &c = currentContext();
+        thrust::device_ptr<uint> dSortedIndex(gridParticleIndex);
+
+        // positions go through sortedPos, which keeps the copy
+        thrust::device_ptr<float4> dPos((float4 *) pos);
+        thrust::device_ptr<float4> dSortedPos((float4 *) sortedPos);
+        thrust::gather(dSortedIndex, dSortedIndex + numParticles, dPos, dSortedPos);
+        checkCudaErrors(cudaMemcpy(pos, sortedPos, numParticles*sizeof(float4), cudaMemcpyDeviceToDevice));
+
+        permuteArray((float4 *) thrust::raw_pointer_cast(c.V.data()), dSortedIndex, numParticles, c.permuted);
+        permuteArray((float4 *) thrust::raw_pointer_cast(c.Xstar.data()), dSortedIndex, numParticles, c.permuted);
+        permuteArray(thrust::raw_pointer_cast(c.W.data()), dSortedIndex, numParticles, c.permuted);
+        permuteArray(thrust::raw_pointer_cast(c.phase.data()), dSortedIndex, numParticles, c.permuted);
+        permuteArray(thrust::raw_pointer_cast(c.ros.data()), dSortedIndex, numParticles, c.permuted);
+        permuteArray(thrust::raw_pointer_cast(c.occurences.data()), dSortedIndex, numParticles, c.permuted);
+        permuteArray(thrust::raw_pointer_cast(c.distColourMask.data()), dSortedIndex, numParticles, c.permuted);
+
+        // everything that refers to particles by slot follows them
+        c.inverseOrder.resize(numParticles);
+        thrust::scatter(thrust::counting_iterator<uint>(0), thrust::counting_iterator<uint>(numParticles),
+                        dSortedIndex, c.inverseOrder.begin());
+
+        remapIndices(c.distsI, c.inverseOrder);
+        remapIndices(c.pointsI, c.inverseOrder);
+        remapIndices(c.particleSlot, c.inverseOrder);
+
+        // the constraint rows of the particles are built again from there
+        c.distRowStart.clear();
+
+        thrust::sequence(dSortedIndex, dSortedIndex + numParticles);
+    }
+
 
 
 
@@ -316,7 +370,8 @@ extern "C"
      *                              PROCESS COLLISIONS
      *****************************************************************************/
 
-    void sortByType(float *dPos, uint numParticles)
+    // the kernels still launch over all particles and skip by phase
+    void sortByType(int *sortedPhase, uint numParticles)
     {
 
     }
@@ -327,8 +382,11 @@ extern "C"
         thrust::device_ptr<float4> d_Xstar((float4*)getXstarRawPtr());
         thrust::device_ptr<int> d_phase(getPhaseRawPtr());
 
+        SimContext &c = currentContext();
+        float *rands = c.rands;
+
         // create random vars for boundary collisions
-        checkCudaErrors(curandGenerateUniform(gen, rands, 6));
+        checkCudaErrors(curandGenerateUniform(c.gen, rands, 6));
 
         // check for boundary collisions and move particles
 //        thrust::for_each
@@ -340,39 +398,103 @@ extern "C"
             collide_world_functor(rands, minBounds, maxBounds));
     }
 
+    void findNeighbors(float *sortedPos,
+                       float *sortedW,
+                       int   *sortedPhase,
+                       float *sortedPosSdf,
+                       uint  *blockKeys,
+                       unsigned long long *blockCells,
+                       uint  *blockFirstCell,
+                       uint  *cellStart,
+                       uint  *cellEnd,
+                       uint  *blockKeysSdf,
+                       unsigned long long *blockCellsSdf,
+                       uint  *blockFirstCellSdf,
+                       uint  *cellStartSdf,
+                       uint  *cellEndSdf,
+                       uint   numParticles,
+                       uint   numParticlesSdf,
+                       uint   tableSize,
+                       uint   tableSizeSdf)
+    {
+        checkCudaErrors(cudaBindTexture(0, oldPosTex, sortedPos, numParticles*sizeof(float4)));
+        checkCudaErrors(cudaBindTexture(0, oldPhaseTex, sortedPhase, numParticles*sizeof(int)));
+        checkCudaErrors(cudaBindTexture(0, posSdfTex, sortedPosSdf, numParticlesSdf * sizeof(float4)));
+
+        // there are at most as many occupied cells as particles
+        checkCudaErrors(cudaBindTexture(0, cellStartTex, cellStart, numParticles*sizeof(uint)));
+        checkCudaErrors(cudaBindTexture(0, cellEndTex, cellEnd, numParticles*sizeof(uint)));
+        checkCudaErrors(cudaBindTexture(0, cellStartSdfTex, cellStartSdf, numParticlesSdf * sizeof(uint)));
+        checkCudaErrors(cudaBindTexture(0, cellEndSdfTex, cellEndSdf, numParticlesSdf * sizeof(uint)));
+
+        BlockTable table = { blockKeys, blockCells, blockFirstCell, tableSize - 1 };
+        BlockTable tableSdf = { blockKeysSdf, blockCellsSdf, blockFirstCellSdf, tableSizeSdf - 1 };
+
+        SimContext &c = currentContext();
+
+        // store neighbors
+        uint *dNeighbors = thrust::raw_pointer_cast(c.neighbors.data());
+        uint2 *dNumNeighbors = thrust::raw_pointer_cast(c.numNeighbors.data());
+
+        c.numNeighborsSdf.resize(numParticles);
+        c.neighborsSdf.resize(numParticles * MAX_SDF_NEIGHBORS);
+        uint *dNeighborsSdf = thrust::raw_pointer_cast(c.neighborsSdf.data());
+        uint *dNumNeighborsSdf = thrust::raw_pointer_cast(c.numNeighborsSdf.data());
+
+        // thread per particle
+        uint numThreads, numBlocks;
+        computeGridSize(numParticles, 64, numBlocks, numThreads);
+
+        // execute the kernel
+        findNeighborsD<<< numBlocks, numThreads >>>(numParticles,
+                                                    numParticlesSdf,
+                                                    table,
+                                                    tableSdf,
+                                                    dNeighbors,
+                                                    dNumNeighbors,
+                                                    dNeighborsSdf,
+                                                    dNumNeighborsSdf);
+
+        // check if kernel invocation generated an error
+        getLastCudaError("Kernel execution failed");
+
+        // the lists hold until a particle moved half the skin away
+        c.neighborPos.resize(numParticles);
+        checkCudaErrors(cudaMemcpy(thrust::raw_pointer_cast(c.neighborPos.data()), sortedPos,
+                                   numParticles*sizeof(float4), cudaMemcpyDeviceToDevice));
+
+        checkCudaErrors(cudaUnbindTexture(oldPosTex));
+        checkCudaErrors(cudaUnbindTexture(oldPhaseTex));
+        checkCudaErrors(cudaUnbindTexture(posSdfTex));
+
+        checkCudaErrors(cudaUnbindTexture(cellStartTex));
+        checkCudaErrors(cudaUnbindTexture(cellEndTex));
+        checkCudaErrors(cudaUnbindTexture(cellStartSdfTex));
+        checkCudaErrors(cudaUnbindTexture(cellEndSdfTex));
+    }
+
     void collide(float *particles,
                  float *sortedPos,
                  float *sortedW,
                  int   *sortedPhase,
                  float *sortedPosSdf,
                  uint  *gridParticleIndex,
-                 uint  *cellStart,
-                 uint  *cellEnd,
-                 uint  *cellStartSdf,
-                 uint  *cellEndSdf,
                  uint   numParticles,
-                 uint   numParticlesSdf,
-                 uint   numCells)
+                 uint   numParticlesSdf)
     {
         checkCudaErrors(cudaBindTexture(0, oldPosTex, sortedPos, numParticles*sizeof(float4)));
         checkCudaErrors(cudaBindTexture(0, invMassTex, sortedW, numParticles*sizeof(float)));
         checkCudaErrors(cudaBindTexture(0, oldPhaseTex, sortedPhase, numParticles*sizeof(int)));
         checkCudaErrors(cudaBindTexture(0, posSdfTex, sortedPosSdf, numParticlesSdf * sizeof(float4)));
 
-        checkCudaErrors(cudaBindTexture(0, cellStartTex, cellStart, numCells*sizeof(uint)));
-        checkCudaErrors(cudaBindTexture(0, cellEndTex, cellEnd, numCells*sizeof(uint)));
-        checkCudaErrors(cudaBindTexture(0, cellStartSdfTex, cellStartSdf, numCells * sizeof(uint)));
-        checkCudaErrors(cudaBindTexture(0, cellEndSdfTex, cellEndSdf, numCells * sizeof(uint)));
-        
-        // store neighbors
-        uint *dNeighbors = thrust::raw_pointer_cast(neighbors.data());
-        uint *dNumNeighbors = thrust::raw_pointer_cast(numNeighbors.data());
-        float *dXstar = getXstarRawPtr();
+        SimContext &c = currentContext();
 
-        numNeighborsSdf.resize(numParticles);
-        neighborsSdf.resize(numParticles * MAX_SDF_NEIGHBORS);
-        uint *dNeighborsSdf = thrust::raw_pointer_cast(neighborsSdf.data());
-        uint *dNumNeighborsSdf = thrust::raw_pointer_cast(numNeighborsSdf.data());
+        // the neighbor rows of the last search
+        uint *dNeighbors = thrust::raw_pointer_cast(c.neighbors.data());
+        uint2 *dNumNeighbors = thrust::raw_pointer_cast(c.numNeighbors.data());
+        uint *dNeighborsSdf = thrust::raw_pointer_cast(c.neighborsSdf.data());
+        uint *dNumNeighborsSdf = thrust::raw_pointer_cast(c.numNeighborsSdf.data());
+        float *dXstar = getXstarRawPtr();
 
         // thread per particle
         uint numThreads, numBlocks;
@@ -383,7 +505,6 @@ extern "C"
                                               (float4 *)dXstar,
                                               gridParticleIndex,
                                               numParticles,
-                                              numParticlesSdf,
                                               dNeighbors,
                                               dNumNeighbors,
                                               dNeighborsSdf,
@@ -396,37 +517,11 @@ extern "C"
         checkCudaErrors(cudaUnbindTexture(invMassTex));
         checkCudaErrors(cudaUnbindTexture(oldPhaseTex));
         checkCudaErrors(cudaUnbindTexture(posSdfTex));
-
-        checkCudaErrors(cudaUnbindTexture(cellStartTex));
-        checkCudaErrors(cudaUnbindTexture(cellEndTex));
-        checkCudaErrors(cudaUnbindTexture(cellStartSdfTex));
-        checkCudaErrors(cudaUnbindTexture(cellEndSdfTex));
     }
 
 
 
 
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
     /*****************************************************************************
      *                              UPDATE VELOCITIES
      *****************************************************************************/
@@ -436,7 +531,7 @@ extern "C"
         float *dXstar = getXstarRawPtr();
         thrust::device_ptr<float4> d_Xstar((float4*)dXstar);
         thrust::device_ptr<float4> d_pos((float4*)dpos);
-        thrust::device_ptr<float4> d_vel((float4*)thrust::raw_pointer_cast(V.data()));
+        thrust::device_ptr<float4> d_vel((float4*)thrust::raw_pointer_cast(currentContext().V.data()));
 
 
         thrust::transform(d_pos, d_pos + numParticles, d_Xstar, d_vel, subtract_functor(deltaTime));
@@ -472,35 +567,30 @@ extern "C"
                      float *sortedW,
                      int   *sortedPhase,
                      uint  *gridParticleIndex,
-                     uint  *cellStart,
-                     uint  *cellEnd,
                      float *particles,
-                     uint   numParticles,
-                     uint   numCells)
+                     uint   numParticles)
     {
         checkCudaErrors(cudaBindTexture(0, oldPosTex, sortedPos, numParticles*sizeof(float4)));
         checkCudaErrors(cudaBindTexture(0, invMassTex, sortedW, numParticles*sizeof(float)));
         checkCudaErrors(cudaBindTexture(0, oldPhaseTex, sortedPhase, numParticles*sizeof(float4)));
-        checkCudaErrors(cudaBindTexture(0, cellStartTex, cellStart, numCells*sizeof(uint)));
-        checkCudaErrors(cudaBindTexture(0, cellEndTex, cellEnd, numCells*sizeof(uint)));
 
         // thread per particle
         uint numThreads, numBlocks;
         computeGridSize(numParticles, 256, numBlocks, numThreads);
 
-        float *dLambda = thrust::raw_pointer_cast(lambda.data());
-//        float *dDenom = thrust::raw_pointer_cast(denom.data());
-        uint *dNeighbors = thrust::raw_pointer_cast(neighbors.data());
-        uint *dNumNeighbors = thrust::raw_pointer_cast(numNeighbors.data());
-        float *dRos = thrust::raw_pointer_cast(ros.data());
+        SimContext &c = currentContext();
+
+        float *dLambda = thrust::raw_pointer_cast(c.lambda.data());
+//        float *dDenom = thrust::raw_pointer_cast(c.denom.data());
+        uint *dNeighbors = thrust::raw_pointer_cast(c.neighbors.data());
+        uint2 *dNumNeighbors = thrust::raw_pointer_cast(c.numNeighbors.data());
+        float *dRos = thrust::raw_pointer_cast(c.ros.data());
 
 //        printf("ros: %u, numParts: %u\n", (uint)ros.size(), numParticles);
 
         // execute the kernel
         findLambdasD<<< numBlocks, numThreads >>>(dLambda,
                                                   gridParticleIndex,
-                                                  cellStart,
-                                                  cellEnd,
                                                   numParticles,
                                                   dNeighbors,
                                                   dNumNeighbors,
@@ -521,7 +611,5 @@ extern "C"
         checkCudaErrors(cudaUnbindTexture(oldPosTex));
         checkCudaErrors(cudaUnbindTexture(invMassTex));
         checkCudaErrors(cudaUnbindTexture(oldPhaseTex));
-        checkCudaErrors(cudaUnbindTexture(cellStartTex));
-        checkCudaErrors(cudaUnbindTexture(cellEndTex));
     }
 }
@@ -9,38 +9,9 @@
 #include "helper_math.h"
 #include "math_constants.h"
 #include "kernel.cuh"
+#include "constants.cuh"
 #include "shared_variables.cuh"
 
-//#define X_BOUNDARY 7.f
-//#define X_BOUNDARY 50.f
-//#define Z_BOUNDARY 50.f
-
-//#define
-
-#define EPS 0.001f
-
-////////////// fluid constants /////////////
-#define MAX_FLUID_NEIGHBORS 500
-
-#define H 2.f       // kernel radius
-#define H2 4.f      // H^2
-#define H6 64.f     // H^6
-#define H9 512.f    // H^9
-#define POLY6_COEFF 0.00305992474f // 315 / (64 * pi * H9)
-#define SPIKEY_COEFF 0.22381163872f // 45 / (pi * H6)
-
-#define FLUID_RELAXATION .01f // epsilon used when calculating lambda
-#define K_P .1f              // scales artificial pressure
-#define E_P 4.f              // exponent to art. pressure
-#define DQ_P .2f             // between .1 and .3 (for art pressure)
-
-
-/////////////////// friction ///////////////
-#define S_FRICTION .005f
-#define K_FRICTION .0002f
-//#define S_FRICTION .15f
-//#define K_FRICTION .003f
-
 // textures for particle position and velocity
 texture<float4, 1, cudaReadModeElementType> oldPosTex;
 texture<float, 1, cudaReadModeElementType> invMassTex;
@@ -57,12 +28,23 @@ texture<float4, 1, cudaReadModeElementType> posSdfTex;
 texture<uint, 1, cudaReadModeElementType> cellStartSdfTex;
 texture<uint, 1, cudaReadModeElementType> cellEndSdfTex;
 
-#define MAX_SDF_NEIGHBORS 100
-
 
 // simulation parameters in constant memory
 __constant__ SimParams params;
 
+#define EMPTY_CELL 0xffffffff
+
+// hash table of the occupied blocks of one grid: the key of each slot
+// (EMPTY_CELL when unused), a bit for each occupied cell of the block
+// and the index of its first one in the dense cellStart/cellEnd arrays
+struct BlockTable
+{
+    uint *keys;
+    unsigned long long *cells;
+    uint *firstCell;
+    uint mask;
+};
+
 struct collide_world_functor
 {
     float *rands;
@@ -202,13 +184,197 @@ __device__ int3 calcGridPos(float3 p)
     return gridPos;
 }
 
-// calculate address in grid from position (clamping to edges)
+// block containing a grid cell (rounding towards negative infinity)
+__device__ int3 calcBlockPos(int3 gridPos)
+{
+    int s = params.blockSize;
+    return make_int3((gridPos.x >= 0 ? gridPos.x : gridPos.x - s + 1) / s,
+                     (gridPos.y >= 0 ? gridPos.y : gridPos.y - s + 1) / s,
+                     (gridPos.z >= 0 ? gridPos.z : gridPos.z - s + 1) / s);
+}
+
+// spreads the lower 10 bits of v to every third bit
+__device__ uint spreadBits(uint v)
+{
+    v &= 0x3ff;
+    v = (v | (v << 16)) & 0x030000ff;
+    v = (v | (v << 8)) & 0x0300f00f;
+    v = (v | (v << 4)) & 0x030c30c3;
+    v = (v | (v << 2)) & 0x09249249;
+    return v;
+}
+
+// position of a block along the Z-order curve
+__device__ uint mortonKey(int3 blockPos)
+{
+    return (spreadBits(blockPos.z) << 2) | (spreadBits(blockPos.y) << 1) | spreadBits(blockPos.x);
+}
+
+// calculate the key of a block from its true coordinates. Blocks
+// outside the world are clamped to the border blocks, which keeps
+// neighboring blocks neighbors, so nothing aliases inside the world.
+__device__ uint calcBlockHash(int3 blockPos)
+{
+    blockPos.x = min(max(blockPos.x, 0), (int)params.blockGridSize.x - 1);
+    blockPos.y = min(max(blockPos.y, 0), (int)params.blockGridSize.y - 1);
+    blockPos.z = min(max(blockPos.z, 0), (int)params.blockGridSize.z - 1);
+    if (params.cellOrder == CELL_ORDER_MORTON)
+        return mortonKey(blockPos);
+    return (blockPos.z * params.blockGridSize.y + blockPos.y) * params.blockGridSize.x + blockPos.x;
+}
+
+// calculate the key of a cell, the cells of a block are consecutive so
+// sorting by cell also sorts by block
 __device__ uint calcGridHash(int3 gridPos)
 {
-    gridPos.x = gridPos.x & (params.gridSize.x-1);  // wrap grid, assumes size is power of 2
-    gridPos.y = gridPos.y & (params.gridSize.y-1);
-    gridPos.z = gridPos.z & (params.gridSize.z-1);
-    return __umul24(__umul24(gridPos.z, params.gridSize.y), params.gridSize.x) + __umul24(gridPos.y, params.gridSize.x) + gridPos.x;
+    int s = params.blockSize;
+    int3 blockPos = calcBlockPos(gridPos);
+    int3 sub = make_int3(gridPos.x - blockPos.x * s, gridPos.y - blockPos.y * s, gridPos.z - blockPos.z * s);
+    return calcBlockHash(blockPos) * (s * s * s) + (sub.z * s + sub.y) * s + sub.x;
+}
+
+// all cells of a block
+__device__ unsigned long long blockCellMask()
+{
+    uint cellsPerBlock = params.blockSize * params.blockSize * params.blockSize;
+    return cellsPerBlock == 64 ? ~0ull : (1ull << cellsPerBlock) - 1;
+}
+
+// slot of a block key in a hash table with mask + 1 slots
+__device__ uint hashBlockKey(uint key, uint mask)
+{
+    uint h = key * 2654435761u;
+    return (h ^ (h >> 16)) & mask;
+}
+
+// adds a key with linear probing, returns the slot of the key
+__device__ uint insertBlock(uint *blockKeys, uint mask, uint key)
+{
+    uint slot = hashBlockKey(key, mask);
+    while (true)
+    {
+        uint prev = atomicCAS(&blockKeys[slot], EMPTY_CELL, key);
+        if (prev == EMPTY_CELL || prev == key)
+            return slot;
+        slot = (slot + 1) & mask;
+    }
+}
+
+// slot of a key or EMPTY_CELL if no particle lies in that block
+__device__ uint findBlock(const uint *blockKeys, uint mask, uint key)
+{
+    uint slot = hashBlockKey(key, mask);
+    while (true)
+    {
+        uint k = blockKeys[slot];
+        if (k == key)
+            return slot;
+        if (k == EMPTY_CELL)
+            return EMPTY_CELL;
+        slot = (slot + 1) & mask;
+    }
+}
+
+// first and last occupied cell among a run of consecutive cells of one
+// block, as indices into cellStart/cellEnd. Cells are sorted by key, so
+// the particles of the run lie between the two. False if all are empty.
+__device__ bool findCellRun(const BlockTable &table, uint blockHash, unsigned long long cells, uint2 &run)
+{
+    uint slot = findBlock(table.keys, table.mask, blockHash);
+    if (slot == EMPTY_CELL)
+        return false;
+
+    unsigned long long occupied = table.cells[slot];
+    unsigned long long hit = occupied & cells;
+    if (hit == 0)
+        return false;
+
+    // occupied cells before the run, and in it
+    run.x = table.firstCell[slot] + __popcll(occupied & ((hit & (~hit + 1)) - 1));
+    run.y = run.x + __popcll(hit) - 1;
+    return true;
+}
+
+// the cells gridPos.x - reach .. gridPos.x + reach of a row, as runs
+// of consecutive cells in the blocks the row passes through
+#define MAX_ROW_BLOCKS 5    // a row of 2 * 2 + 1 cells in blocks of one cell
+
+struct CellRow
+{
+    uint numBlocks;
+    uint blockHash[MAX_ROW_BLOCKS];
+    unsigned long long cells[MAX_ROW_BLOCKS];
+};
+
+__device__ CellRow calcCellRow(int3 gridPos, int reach)
+{
+    int s = params.blockSize;
+    int3 first = make_int3(gridPos.x - reach, gridPos.y, gridPos.z);
+    int3 blockPos = calcBlockPos(first);
+    int3 sub = first - blockPos * s;
+    uint row = (sub.z * s + sub.y) * s;
+
+    CellRow cellRow;
+
+    // without a skin: three cells in at most two blocks (unless the
+    // blocks are a single cell)
+    if (reach == 1 && s >= 2)
+    {
+        cellRow.numBlocks = 1;
+        cellRow.blockHash[0] = calcBlockHash(blockPos);
+        cellRow.cells[0] = ((2ull << min(sub.x + 2, s - 1)) - (1ull << sub.x)) << row;
+
+        if (sub.x + 2 >= s)
+        {
+            cellRow.numBlocks = 2;
+            cellRow.blockHash[1] = calcBlockHash(blockPos + make_int3(1, 0, 0));
+            cellRow.cells[1] = ((2ull << (sub.x + 2 - s)) - 1) << row;
+        }
+        return cellRow;
+    }
+
+    // first and last cell of the row relative to the current block
+    int lo = sub.x;
+    int hi = sub.x + 2 * reach;
+
+    cellRow.numBlocks = 0;
+    while (true)
+    {
+        cellRow.blockHash[cellRow.numBlocks] = calcBlockHash(blockPos);
+        cellRow.cells[cellRow.numBlocks] = ((2ull << min(hi, s - 1)) - (1ull << lo)) << row;
+        cellRow.numBlocks++;
+
+        // the rest of the row continues in the next block
+        if (hi < s)
+            return cellRow;
+        lo = 0;
+        hi -= s;
+        blockPos.x++;
+    }
+}
+
+// how many cells around its own a particle looks for contacts, the
+// cells are a particle diameter wide and the skin adds to that
+__device__ int contactReach()
+{
+    return 1 + (int) ceilf(params.neighborSkin / params.cellSize.x);
+}
+
+// first and last block (clamped to the world) overlapping the box of
+// half width radius around pos
+__device__ void calcBlockRange(float3 pos, float radius, int3 &first, int3 &last)
+{
+    int3 maxBlock = make_int3(params.blockGridSize) - 1;
+    first = clamp(calcBlockPos(calcGridPos(pos - radius)), make_int3(0), maxBlock);
+    last = clamp(calcBlockPos(calcGridPos(pos + radius)), make_int3(0), maxBlock);
+}
+
+// contact of two particles at a squared distance of mag2, the test
+// that picks the actual contacts from the neighbor lists
+__device__ bool inContact(float mag2)
+{
+    float collideDist = params.particleRadius * 2.001f;
+    return mag2 < collideDist * collideDist;
 }
 
 // calculate grid hash value for each particle
@@ -233,20 +399,19 @@ void calcHashD(uint   *gridParticleHash,  // output
     gridParticleIndex[index] = index;
 }
 
-// rearrange particle data into sorted order, and find the start of each cell
-// in the sorted hash array
+// rearrange particle data into sorted order and mark the first
+// particle of each cell in the sorted hash array
 __global__
-void reorderDataAndFindCellStartD(uint   *cellStart,        // output: cell start index
-                                  uint   *cellEnd,          // output: cell end index
-                                  float4 *sortedPos,        // output: sorted positions
-                                  float  *sortedW,          // output: sorted inverse masses
-                                  int    *sortedPhase,      // output: sorted phase values
-                                  uint   *gridParticleHash, // input: sorted grid hashes
-                                  uint   *gridParticleIndex,// input: sorted particle indices
-                                  float4 *oldPosXX,           // input: position array
-                                  float  *W,
-                                  int    *phase,
-                                  uint    numParticles)
+void reorderDataD(float4 *sortedPos,        // output: sorted positions
+                  float  *sortedW,          // output: sorted inverse masses
+                  int    *sortedPhase,      // output: sorted phase values
+                  uint   *cellRank,         // output: 1 for the first particle of a cell
+                  uint   *gridParticleHash, // input: sorted grid hashes
+                  uint   *gridParticleIndex,// input: sorted particle indices
+                  float4 *oldPosXX,           // input: position array
+                  float  *W,
+                  int    *phase,
+                  uint    numParticles)
 {
     extern __shared__ uint sharedHash[];    // blockSize + 1 elements
     uint index = __umul24(blockIdx.x,blockDim.x) + threadIdx.x;
@@ -275,29 +440,18 @@ void reorderDataAndFindCellStartD(uint   *cellStart,        // output: cell star
     if (index < numParticles)
     {
         // If this particle has a different cell index to the previous
-        // particle then it must be the first particle in the cell,
-        // so store the index of this particle in the cell.
-        // As it isn't the first particle, it must also be the cell end of
-        // the previous particle's cell
-
-        if (index == 0 || hash != sharedHash[threadIdx.x])
-        {
-            cellStart[hash] = index;
-
-            if (index > 0)
-                cellEnd[sharedHash[threadIdx.x]] = index;
-        }
-
-        if (index == numParticles - 1)
-        {
-            cellEnd[hash] = index + 1;
-        }
+        // particle then it must be the first particle in the cell.
+        // A scan over the marks numbers the occupied cells.
+        cellRank[index] = (index == 0 || hash != sharedHash[threadIdx.x]) ? 1 : 0;
 
         // Now use the sorted index to reorder the pos and vel data
         uint sortedIndex = gridParticleIndex[index];
         // float4 pos = FETCH(oldPos, sortedIndex);       // macro does either global read or texture fetch
-        float4 pos = (sortedW == NULL) ? FETCH(posSdf, sortedIndex) : FETCH(oldPos, sortedIndex);
-        sortedPos[index] = pos;
+        if (sortedPos != NULL)
+        {
+            float4 pos = (sortedW == NULL) ? FETCH(posSdf, sortedIndex) : FETCH(oldPos, sortedIndex);
+            sortedPos[index] = pos;
+        }
         
         if (sortedW != NULL)
         {
@@ -313,104 +467,278 @@ void reorderDataAndFindCellStartD(uint   *cellStart,        // output: cell star
 }
 
 
-// collide a particle against all other particles in a given cell
+// reorders only the positions and measures how far each particle moved
+// from where the neighbor lists were built
+__global__
+void reorderPositionsD(float4 *sortedPos,          // output: sorted positions
+                       float  *moved2,             // output: squared distances moved
+                       uint   *gridParticleIndex,  // input: sorted particle indices
+                       float4 *oldPos,             // input: position array
+                       float4 *neighborPos,        // input: sorted positions of the last search
+                       uint    numParticles)
+{
+    uint index = __umul24(blockIdx.x,blockDim.x) + threadIdx.x;
+
+    if (index >= numParticles) return;
+
+    float4 pos = oldPos[gridParticleIndex[index]];
+    sortedPos[index] = pos;
+
+    float3 moved = make_float3(pos - neighborPos[index]);
+    moved2[index] = dot(moved, moved);
+}
+
+
+// stores the start and end of every occupied cell at its number and
+// adds the cell to its block in the table
+__global__
+void findCellStartD(BlockTable table,
+                    uint   *cellStart,        // output: cell start index
+                    uint   *cellEnd,          // output: cell end index
+                    uint   *cellRank,         // input: scanned cell marks
+                    uint   *gridParticleHash, // input: sorted grid hashes
+                    uint    numParticles)
+{
+    uint index = __umul24(blockIdx.x,blockDim.x) + threadIdx.x;
+
+    if (index >= numParticles) return;
+
+    uint hash = gridParticleHash[index];
+    uint cell = cellRank[index] - 1;
+
+    if (index == 0 || hash != gridParticleHash[index - 1])
+    {
+        cellStart[cell] = index;
+
+        uint cellsPerBlock = params.blockSize * params.blockSize * params.blockSize;
+        uint block = hash / cellsPerBlock;
+        uint slot = insertBlock(table.keys, table.mask, block);
+        atomicOr(&table.cells[slot], 1ull << (hash % cellsPerBlock));
+
+        if (index == 0 || block != gridParticleHash[index - 1] / cellsPerBlock)
+            table.firstCell[slot] = cell;
+    }
+
+    if (index == numParticles - 1 || hash != gridParticleHash[index + 1])
+        cellEnd[cell] = index + 1;
+}
+
+
+// The neighbor row of a particle holds MAX_FLUID_NEIGHBORS entries:
+// the particles it may touch (within a diameter plus the skin) from the
+// front, the further fluid neighbors within H (plus the skin) from the
+// back. numNeighbors keeps the size of both bands, the sdf particles it
+// may touch go to a row of their own. Contacts use the first band and
+// the sdf row, the density constraint both bands.
+__device__
+uint neighborSlot(uint index, uint2 count, uint i)
+{
+    uint row = index * MAX_FLUID_NEIGHBORS;
+    return i < count.x ? row + i : row + MAX_FLUID_NEIGHBORS - 1 - (i - count.x);
+}
+
+// collide a particle against the particles of a range of sorted
+// particles. Contacts are found within the skin, collideD tests the distance.
+__device__
+void collideRange(uint2   range,
+                  uint    index,
+                  float3  pos,
+                  int     phase,
+                  uint   *neighbors,
+                  uint2  &count)
+{
+    float collideDist = params.particleRadius * 2.001f + params.neighborSkin; // slightly bigger radius
+    float collideDist2 = collideDist * collideDist;
+
+    for (uint j=range.x; j<range.y; j++)
+    {
+        if (j != index)                // check not colliding with self
+        {
+            float3 pos2 = make_float3(FETCH(oldPos, j));
+            int phase2 = FETCH(oldPhase, j);
+
+            if (phase > SOLID && phase == phase2)
+                continue;
+
+            // collide two spheres
+            float3 diff = pos - pos2;
+
+            float mag2 = dot(diff, diff);
+
+            if (mag2 < collideDist2 && count.x + count.y < MAX_FLUID_NEIGHBORS)
+            {
+                // neighbor stuff
+                neighbors[index * MAX_FLUID_NEIGHBORS + count.x] = j;
+                count.x += 1;
+            }
+        }
+    }
+}
+
+// same against a range of the static sdf particles
+__device__
+void collideRangeSdf(uint2   range,
+                     uint    index,
+                     float3  pos,
+                     uint   *neighborsSdf,
+                     uint   &countSdf)
+{
+    float collideDist = params.particleRadius * 2.001f + params.neighborSkin;
+    float collideDist2 = collideDist * collideDist;
+
+    for (uint j = range.x; j < range.y; j++)
+    {
+        float3 posSdf = make_float3(FETCH(posSdf, j));
+
+        float3 diff = pos - posSdf;
+        float mag2 = dot(diff, diff);
+
+        if (mag2 < collideDist2 && countSdf < MAX_SDF_NEIGHBORS)
+        {
+            neighborsSdf[index * MAX_SDF_NEIGHBORS + countSdf] = j;
+            countSdf += 1;
+        }
+    }
+}
+
+
+// sort the particles of one block closer than sqrt(radius2) into the
+// contact and fluid bands
 __device__
-void collideCell(int3    gridPos,
-                 uint    index,
-                 float3  pos,
-                 int     phase,
-                 uint    numParticlesSdf,
-                 uint   *neighbors,
-                 uint   *numNeighbors,
-                 uint   *neighborsSdf,
-                 uint   *numNeighborsSdf)
-{
-    uint gridHash = calcGridHash(gridPos);
-
-    // get start of bucket for this cell
-    uint startIndex = FETCH(cellStart, gridHash);
-
-    float collideDist = params.particleRadius * 2.001f; // slightly bigger radius
+void collideCellRadius(uint    blockHash,
+                       uint    index,
+                       float3  pos,
+                       float   radius2,
+                       const BlockTable &table,
+                       uint   *neighbors,
+                       uint2  &count)
+{
+    float collideDist = params.particleRadius * 2.001f + params.neighborSkin;
     float collideDist2 = collideDist * collideDist;
 
-//    float3 delta = make_float3(0.0f);
+    // find the occupied cells of this block
+    uint2 run;
 
-    if (startIndex != 0xffffffff)          // cell is not empty
+    if (findCellRun(table, blockHash, blockCellMask(), run))          // block is not empty
     {
-        // iterate over particles in this cell
-        uint endIndex = FETCH(cellEnd, gridHash);
+        // iterate over particles in this block
+        uint startIndex = FETCH(cellStart, run.x);
+        uint endIndex = FETCH(cellEnd, run.y);
 
         for (uint j=startIndex; j<endIndex; j++)
         {
             if (j != index)                // check not colliding with self
             {
                 float3 pos2 = make_float3(FETCH(oldPos, j));
-                int phase2 = FETCH(oldPhase, j);
-
-                if (phase > SOLID && phase == phase2)
-                    continue;
 
-                // collide two spheres
-                float3 diff = pos - pos2;
-
-                float mag2 = dot(diff, diff);
-
-                if (mag2 < collideDist2 && numNeighbors[index] < MAX_FLUID_NEIGHBORS)
+                float3 relPos = pos - pos2;
+                float dist2 = dot(relPos, relPos);
+                if (dist2 < radius2 && count.x + count.y < MAX_FLUID_NEIGHBORS)
                 {
-                    // neighbor stuff
-                    neighbors[index * MAX_FLUID_NEIGHBORS + numNeighbors[index]] = j;
-                    numNeighbors[index] += 1;
+                    // contacts from the front of the row, the rest from the back
+                    if (dist2 < collideDist2)
+                    {
+                        neighbors[index * MAX_FLUID_NEIGHBORS + count.x] = j;
+                        count.x += 1;
+                    }
+                    else
+                    {
+                        neighbors[index * MAX_FLUID_NEIGHBORS + MAX_FLUID_NEIGHBORS - 1 - count.y] = j;
+                        count.y += 1;
+                    }
                 }
             }
         }
     }
+}
 
-    if (numParticlesSdf > 0)
-    {
-        uint startIndexSdf = FETCH(cellStartSdf, gridHash);
-        if (startIndexSdf != 0xffffffff)
-        {
-            uint endIndexSdf = FETCH(cellEndSdf, gridHash);
 
-            for (uint j = startIndexSdf; j < endIndexSdf; j++)
-            {
-                float3 posSdf = make_float3(FETCH(posSdf, j));
+// the one neighbor search of a particle: fluids walk the blocks within
+// H, colliding particles the cells within a diameter and the sdf grid
+__global__
+void findNeighborsD(uint    numParticles,
+                    uint    numParticlesSdf,
+                    BlockTable table,
+                    BlockTable tableSdf,
+                    uint   *neighbors,
+                    uint2  *numNeighbors,
+                    uint   *neighborsSdf,
+                    uint   *numNeighborsSdf)
+{
+    uint index = __mul24(blockIdx.x,blockDim.x) + threadIdx.x;
 
-                float3 diff = pos - posSdf;
-                float mag2 = dot(diff, diff);
+    if (index >= numParticles) return;
+
+    int phase = FETCH(oldPhase, index);
+    float3 pos = make_float3(FETCH(oldPos, index));
 
-                if (mag2 < collideDist2 && numNeighborsSdf[index] < MAX_SDF_NEIGHBORS)
+    uint2 count = make_uint2(0, 0);
+    uint countSdf = 0;
+
+    if (phase == FLUID)
+    {
+        // 27 blocks suffice when blockSize * cellSize >= H and there is no skin
+        float radius = H + params.neighborSkin;
+        int3 first, last;
+        calcBlockRange(pos, radius, first, last);
+
+        for (int z=first.z; z<=last.z; z++)
+        {
+            for (int y=first.y; y<=last.y; y++)
+            {
+                for (int x=first.x; x<=last.x; x++)
                 {
-                    neighborsSdf[index * MAX_SDF_NEIGHBORS + numNeighborsSdf[index]] = j;
-                    numNeighborsSdf[index] += 1;
+                    uint blockHash = calcBlockHash(make_int3(x, y, z));
+                    collideCellRadius(blockHash, index, pos, radius * radius, table, neighbors, count);
                 }
             }
         }
-        /*for (uint j = 0; j < numParticlesSdf; j++)
+    }
+    else if (phase >= CLOTH)
+    {
+        // get address in grid
+        int3 gridPos = calcGridPos(pos);
+        int reach = contactReach();
+
+        // examine neighbouring cells
+        uint2 run;
+        for (int z=-reach; z<=reach; z++)
         {
-            float3 posSdf = make_float3(FETCH(posSdf, j));
-    
-            float3 diff = pos - posSdf;
-            float mag2 = dot(diff, diff);
-    
-            if (mag2 < collideDist2 && numNeighborsSdf[index] < MAX_SDF_NEIGHBORS)
+            for (int y=-reach; y<=reach; y++)
             {
-                neighborsSdf[index * MAX_SDF_NEIGHBORS + numNeighborsSdf[index]] = j;
-                numNeighborsSdf[index]++;
+                CellRow row = calcCellRow(gridPos + make_int3(0, y, z), reach);
+
+                for (uint i = 0; i < row.numBlocks; i++)
+                {
+                    if (findCellRun(table, row.blockHash[i], row.cells[i], run))
+                    {
+                        uint2 range = make_uint2(FETCH(cellStart, run.x), FETCH(cellEnd, run.y));
+                        collideRange(range, index, pos, phase, neighbors, count);
+                    }
+
+                    if (numParticlesSdf > 0 && findCellRun(tableSdf, row.blockHash[i], row.cells[i], run))
+                    {
+                        uint2 range = make_uint2(FETCH(cellStartSdf, run.x), FETCH(cellEndSdf, run.y));
+                        collideRangeSdf(range, index, pos, neighborsSdf, countSdf);
+                    }
+                }
             }
-        }*/
+        }
     }
+
+    numNeighbors[index] = count;
+    numNeighborsSdf[index] = countSdf;
 }
 
 
+// resolves the contacts of a particle found by findNeighborsD
 __global__
 void collideD(float4 *newPos,               // output: new pos
               float4 *prevPositions,
               uint   *gridParticleIndex,    // input: sorted particle indices
               uint    numParticles,
-              uint    numParticlesSdf,
               uint   *neighbors,
-              uint   *numNeighbors,
+              uint2  *numNeighbors,
               uint   *neighborsSdf,
               uint   *numNeighborsSdf)
 {
@@ -424,25 +752,10 @@ void collideD(float4 *newPos,               // output: new pos
     // read particle data from sorted arrays
     float3 pos = make_float3(FETCH(oldPos, index));
 
-    // get address in grid
-    int3 gridPos = calcGridPos(pos);
-
-    // examine neighbouring cells
     float3 delta = make_float3(0.f);
 
-    numNeighbors[index] = 0;
-    if (numParticlesSdf > 0) numNeighborsSdf[index] = 0;
-    for (int z=-1; z<=1; z++)
-    {
-        for (int y=-1; y<=1; y++)
-        {
-            for (int x=-1; x<=1; x++)
-            {
-                int3 neighbourPos = gridPos + make_int3(x, y, z);
-                collideCell(neighbourPos, index, pos, phase, numParticlesSdf, neighbors, numNeighbors, neighborsSdf, numNeighborsSdf);
-            }
-        }
-    }
+    uint count = numNeighbors[index].x;
+    uint countSdf = numNeighborsSdf[index];
 
     float collideDist = params.particleRadius * 2.001f;
 
@@ -453,18 +766,37 @@ void collideD(float4 *newPos,               // output: new pos
 //    float3 currPos = make_float3(newPos[originalIndex]);
     float3 prevPos = make_float3(prevPositions[originalIndex]);
 
-    uint numNeighborsTotal = numParticlesSdf > 0 ? numNeighbors[index] + numNeighborsSdf[index] :
-            numNeighbors[index];
-    //uint numNeighborsTotal = numNeighbors[index];
+    uint numNeighborsTotal = count + countSdf;
 
-    for (uint i = 0; i < numNeighbors[index]; i++)
+    // with a skin not every neighbor is a contact
+    if (params.neighborSkin > 0.f)
+    {
+        numNeighborsTotal = 0;
+        for (uint i = 0; i < count; i++)
+        {
+            float3 diff = pos - make_float3(FETCH(oldPos, neighbors[index * MAX_FLUID_NEIGHBORS + i]));
+            numNeighborsTotal += inContact(dot(diff, diff));
+        }
+        for (uint i = 0; i < countSdf; i++)
+        {
+            float3 diff = pos - make_float3(FETCH(posSdf, neighborsSdf[index * MAX_SDF_NEIGHBORS + i]));
+            numNeighborsTotal += inContact(dot(diff, diff));
+        }
+    }
+
+    for (uint i = 0; i < count; i++)
     {
         float3 pos2 =  make_float3(FETCH(oldPos, neighbors[index * MAX_FLUID_NEIGHBORS + i]));
+
+        float3 diff = pos - pos2;
+        float mag2 = dot(diff, diff);
+        if (!inContact(mag2))
+            continue;
+
         float w2 =  FETCH(invMass, neighbors[index * MAX_FLUID_NEIGHBORS + i]);
         int phase2 =  FETCH(oldPhase, neighbors[index * MAX_FLUID_NEIGHBORS + i]);
 
-        float3 diff = pos - pos2;
-        float dist = length(diff);
+        float dist = sqrt(mag2);
         float mag = dist - collideDist;
 
         float colW = w;
@@ -506,42 +838,43 @@ void collideD(float4 *newPos,               // output: new pos
             delta -= dpt * min((K_FRICTION) * dist / ldpt, 1.f);
     }
 
-    if (numParticlesSdf > 0)
+    for (uint i = 0; i < countSdf; i++)
     {
-        for (uint i = 0; i < numNeighborsSdf[index]; i++)
-        {
-            float3 posSdf = make_float3(FETCH(posSdf, neighborsSdf[index * MAX_SDF_NEIGHBORS + i])); // error here
+        float3 posSdf = make_float3(FETCH(posSdf, neighborsSdf[index * MAX_SDF_NEIGHBORS + i])); // error here
 
-            float3 diff = pos - posSdf;
-            float dist = length(diff);
-            float mag = dist - collideDist;
+        float3 diff = pos - posSdf;
+        float mag2 = dot(diff, diff);
+        if (!inContact(mag2))
+            continue;
 
-            float colW = w;
+        float dist = sqrt(mag2);
+        float mag = dist - collideDist;
 
-            if (phase >= SOLID)
-            {
-                colW = sW;
-            }
+        float colW = w;
 
-            float scale = mag / colW;
-            float3 dp = diff * (scale / dist);
-            float3 dp1 = -colW * dp / numNeighborsTotal;
-            float3 dp2 = make_float3(0.f);
-            delta += dp1;
+        if (phase >= SOLID)
+        {
+            colW = sW;
+        }
 
-            ////////////////////// friction //////////////////
-            if (phase < SOLID) continue;
+        float scale = mag / colW;
+        float3 dp = diff * (scale / dist);
+        float3 dp1 = -colW * dp / numNeighborsTotal;
+        float3 dp2 = make_float3(0.f);
+        delta += dp1;
 
-            float3 nf = normalize(diff);
-            float3 dpRel = (pos + dp1 - prevPos) - (prevPos + dp2 - posSdf);
-            float3 dpt = dpRel - dot(dpRel, nf) * nf;
-            float ldpt = length(dpt);
+        ////////////////////// friction //////////////////
+        if (phase < SOLID) continue;
 
-            if (ldpt < EPS) continue;
+        float3 nf = normalize(diff);
+        float3 dpRel = (pos + dp1 - prevPos) - (prevPos + dp2 - posSdf);
+        float3 dpt = dpRel - dot(dpRel, nf) * nf;
+        float ldpt = length(dpt);
 
-            if (ldpt < S_FRICTION * dist) delta -= dpt;
-            else delta -= dpt * min(K_FRICTION * dist / ldpt, 1.f);
-        }
+        if (ldpt < EPS) continue;
+
+        if (ldpt < S_FRICTION * dist) delta -= dpt;
+        else delta -= dpt * min(K_FRICTION * dist / ldpt, 1.f);
     }
 
     // write new velocity back to original unsorted location
@@ -564,55 +897,14 @@ struct subtract_functor
 
 
 
-// collide a particle against all other particles in a given cell
-__device__
-void collideCellRadius(int3    gridPos,
-                         uint    index,
-                         float3  pos,
-                         uint   *cellStart,
-                         uint   *cellEnd,
-                         uint   *neighbors,
-                         uint   *numNeighbors)
-{
-    uint gridHash = calcGridHash(gridPos);
-
-    // get start of bucket for this cell
-    uint startIndex = FETCH(cellStart, gridHash);
-
-    if (startIndex != 0xffffffff)          // cell is not empty
-    {
-        // iterate over particles in this cell
-        uint endIndex = FETCH(cellEnd, gridHash);
-
-        for (uint j=startIndex; j<endIndex; j++)
-        {
-            if (j != index)                // check not colliding with self
-            {
-                float3 pos2 = make_float3(FETCH(oldPos, j));
-
-                float3 relPos = pos - pos2;
-                float dist2 = dot(relPos, relPos);
-                if (dist2 < H2 && numNeighbors[index] < MAX_FLUID_NEIGHBORS)
-                {
-                    // neighbor stuff
-                    neighbors[index * MAX_FLUID_NEIGHBORS + numNeighbors[index]] = j;
-                    numNeighbors[index] += 1;
-                }
-            }
-        }
-    }
-
-}
-
-
+// computes the lambda of a fluid particle from both bands of its
+// neighbor row
 __global__
 void findLambdasD(float  *lambda,               // input: sorted positions
                   uint   *gridParticleIndex,    // input: sorted particle indices
-                  uint   *cellStart,
-                  uint   *cellEnd,
                   uint    numParticles,
                   uint   *neighbors,
-                  uint   *numNeighbors,
+                  uint2  *numNeighbors,
                   float  *ros)
 {
     uint index = __mul24(blockIdx.x,blockDim.x) + threadIdx.x;
@@ -625,37 +917,22 @@ void findLambdasD(float  *lambda,               // input: sorted positions
     // read particle data from sorted arrays
     float3 pos = make_float3(FETCH(oldPos, index));
 
-    // get address in grid
-    int3 gridPos = calcGridPos(pos);
-
-    // examine neighbouring cells
-
-    int rad = (int)ceil(H / params.cellSize.x);
-
-    numNeighbors[index] = 0;
-    for (int z=-rad; z<=rad; z++)
-    {
-        for (int y=-rad; y<=rad; y++)
-        {
-            for (int x=-rad; x<=rad; x++)
-            {
-                int3 neighbourPos = gridPos + make_int3(x, y, z);
-                collideCellRadius(neighbourPos, index, pos, cellStart, cellEnd, neighbors, numNeighbors);
-            }
-        }
-    }
+    uint2 bands = numNeighbors[index];
 
     float w = FETCH(invMass, index);
     float ro = 0.f;
     float denom = 0.f;
     float3 grad = make_float3(0.f);
-    for (uint i = 0; i < numNeighbors[index]; i++)
+    for (uint i = 0; i < bands.x + bands.y; i++)
     {
-        uint ni = neighbors[index * MAX_FLUID_NEIGHBORS + i];
+        uint ni = neighbors[neighborSlot(index, bands, i)];
         float3 pos2 =  make_float3(FETCH(oldPos, ni));
 //        float w2 = FETCH(invMass, ni);
         float3 r = pos - pos2;
         float rlen2 = dot(r, r);
+        if (rlen2 >= H2)
+            continue;   // in the skin only
+
         float rlen = sqrt(rlen2);
         float hMinus2 = H2 - rlen2;
         float hMinus = H - rlen;
@@ -686,7 +963,7 @@ void solveFluidsD(float  *lambda,              // input: sorted positions
                   float4 *particles,
                   uint    numParticles,
                   uint   *neighbors,
-                  uint   *numNeighbors,
+                  uint2  *numNeighbors,
                   float  *ros)
 {
     uint index = __mul24(blockIdx.x,blockDim.x) + threadIdx.x;
@@ -698,12 +975,20 @@ void solveFluidsD(float  *lambda,              // input: sorted positions
 
     float4 pos = FETCH(oldPos, index);
 
+    uint2 bands = numNeighbors[index];
+
     float4 delta = make_float4(0.f);
-    for (uint i = 0; i < numNeighbors[index]; i++)
+    uint count = 0;
+    for (uint i = 0; i < bands.x + bands.y; i++)
     {
-        float4 pos2 =  FETCH(oldPos, neighbors[index * MAX_FLUID_NEIGHBORS + i]);
+        uint ni = neighbors[neighborSlot(index, bands, i)];
+        float4 pos2 =  FETCH(oldPos, ni);
         float4 r = pos - pos2;
         float rlen2 = dot(r, r);
+        if (rlen2 >= H2)
+            continue;   // in the skin only
+
+        count++;
         float rlen = sqrt(rlen2);
         float hMinus2 = H2 - rlen2;
         float hMinus = H - rlen;
@@ -720,11 +1005,11 @@ void solveFluidsD(float  *lambda,              // input: sorted positions
         float denom = (POLY6_COEFF * term2*term2*term2 );
         float lambdaCorr = -K_P * pow(numer / denom, E_P);
 
-        delta += (lambda[index] + lambda[neighbors[index * MAX_FLUID_NEIGHBORS + i]] + lambdaCorr) * spikeyGrad;
+        delta += (lambda[index] + lambda[ni] + lambdaCorr) * spikeyGrad;
     }
 
     uint origIndex = gridParticleIndex[index];
-    particles[origIndex] += delta / (ros[gridParticleIndex[index]] + numNeighbors[index]);
+    particles[origIndex] += delta / (ros[gridParticleIndex[index]] + count);
 
 }
 
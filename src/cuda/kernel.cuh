@@ -5,6 +5,24 @@
 
 #include "vector_types.h"
 
+// how the CPU backend sorts the grid hashes: std::stable_sort, an LSD
+// radix sort over the key bits, or from the order of the previous sort
+// if only a few particles changed cells (and the radix sort otherwise).
+// All three give the same order, CUDA always uses a radix sort.
+enum GridSort { GRID_SORT_COMPARISON, GRID_SORT_RADIX, GRID_SORT_INCREMENTAL };
+
+// the order of the blocks in the cell keys: row by row (x fastest), or
+// along a Z-order curve that interleaves the bits of the block
+// coordinates, which keeps blocks that are close in y and z close in
+// the sorted arrays as well. The cells of a block stay row by row.
+enum CellOrder { CELL_ORDER_ROWS, CELL_ORDER_MORTON };
+
+// how the distance constraints are solved: all at once from the same
+// positions, with the corrections of every particle averaged (Jacobi),
+// or one colour of the constraint graph after the other, a colour
+// updating the positions in place for the next (Gauss-Seidel)
+enum DistanceSolver { DISTANCE_JACOBI, DISTANCE_GAUSS_SEIDEL };
+
 // simulation parameters
 struct SimParams
 {
@@ -17,6 +35,42 @@ struct SimParams
     float3 worldOrigin;
     float3 cellSize;
 
+    // cells are stored in cubes of blockSize^3 cells (at most 4^3), one
+    // block is at least the fluid kernel radius H wide unless the cells
+    // are too small for that. A single sort then gives
+    // both the contact grid (cells) and the fluid grid (blocks).
+    // blockGridSize blocks cover the world, only occupied blocks are
+    // stored (in a hash table with a 64 bit mask of their cells).
+    unsigned int blockSize;
+    uint3 blockGridSize;
+    unsigned int numBlocks;
+    unsigned int cellOrder; // CellOrder
+
+    // neighbor lists are built with this much extra distance and kept
+    // until a particle moved more than half of it (Verlet skin)
+    float neighborSkin;
+
+    // visit every pair of particles that act on each other once, from
+    // the lower sorted index, and apply it to both (CPU backend only)
+    unsigned int pairTraversal;
+
+    // search and solve in tiles of clusters of nearby particles, with
+    // SIMD lanes instead of per particle branches (CPU backend only,
+    // takes precedence over pairTraversal)
+    unsigned int clusterPairs;
+
+    unsigned int gridSort;  // GridSort
+
+    // solve the fluid density constraints of a particle with SIMD lanes
+    // over its neighbors, from the sorted positions stored by coordinate
+    // (CPU backend only, without cluster pairs and pair traversal)
+    unsigned int simdFluids;
+
+    unsigned int distanceSolver;    // DistanceSolver
+
+    // of the current step, the compliance of the constraints is over its square (XPBD)
+    float deltaTime;
+
     unsigned int numBodies;
     unsigned int maxParticlesPerCell;
 };
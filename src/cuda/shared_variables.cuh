@@ -8,13 +8,15 @@
 #define SOLID 3
 #define RIGID 4
 
-#include "thrust/device_vector.h"
+// colours of the distance constraint graph with a bit in the colour
+// masks of the particles, constraints beyond them share one more colour
+// that is solved serially
+#define DISTANCE_COLOURS 64
+
+typedef unsigned int uint;
 
 extern "C"
 {
-	void freeSharedVectors();
-
-    void appendPhaseAndMass(int *fase, float *w, uint numParticles);
 
 	void copyToXstar(float *pos, uint numParticles);
 	
@@ -24,6 +26,9 @@ extern "C"
 
     float *getWRawPtr();
 
+    // rest densities of the fluid particles
+    float *getRosRawPtr();
+
     void printXstar();
     
     // void bindOldPos();
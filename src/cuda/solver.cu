@@ -7,11 +7,15 @@
 
 #include <thrust/device_ptr.h>
 #include <thrust/device_vector.h>
+#include <thrust/fill.h>
 #include <thrust/for_each.h>
+#include <thrust/host_vector.h>
+#include <thrust/iterator/counting_iterator.h>
 #include <thrust/iterator/zip_iterator.h>
 #include <thrust/sort.h>
 #include <thrust/reduce.h>
 #include <thrust/transform.h>
+#include <thrust/transform_reduce.h>
 
 #include <stdio.h>
 
@@ -20,6 +24,7 @@
 //#include <cusparse.h>
 
 #include "helper_cuda.h"
+#include "context.cuh"
 #include "solver_kernel.cuh"
 #include "util.cuh"
 #include "shared_variables.cuh"
@@ -29,16 +34,89 @@
 //cusparseHandle_t cusparseHandle;
 //cusparseMatDescr_t matDescr;
 
-thrust::device_vector<uint> distsI;
-thrust::device_vector<float> dists;
+// groups the distance constraints by colour (a counting sort on the host)
+static void sortByColour(SimContext &c)
+{
+    uint numConstraints = c.dists.size();
+    const uint numColours = DISTANCE_COLOURS + 1;
 
-thrust::device_vector<uint> pointsI;
-thrust::device_vector<float> points;
+    c.distColourStart.assign(numColours + 1, 0);
+    for (uint i = 0; i < numConstraints; i++)
+        c.distColourStart[c.distColour[i] + 1]++;
+    for (uint k = 0; k < numColours; k++)
+        c.distColourStart[k + 1] += c.distColourStart[k];
 
-thrust::device_vector<uint> sortedI;
-thrust::device_vector<float> deltas;
+    std::vector<uint> next(c.distColourStart.begin(), c.distColourStart.end() - 1);
+    std::vector<uint> order(numConstraints);
+    for (uint i = 0; i < numConstraints; i++)
+        order[next[c.distColour[i]]++] = i;
 
-thrust::device_vector<uint> occurences;     // number of constraints affecting a particle
+    c.distColourOrder.assign(order.begin(), order.end());
+}
+
+// the distance constraint rows of the particles (a counting sort of
+// the constraint ends by particle on the host, stable so every row is
+// in constraint order)
+static void buildDistanceRows(SimContext &c, uint numParticles)
+{
+    thrust::host_vector<uint> ends = c.distsI;
+    uint numEnds = ends.size();
+
+    std::vector<uint> rowStart(numParticles + 1, 0);
+    for (uint e = 0; e < numEnds; e++)
+        rowStart[ends[e] + 1]++;
+    for (uint i = 0; i < numParticles; i++)
+        rowStart[i + 1] += rowStart[i];
+
+    std::vector<uint> next(rowStart.begin(), rowStart.end() - 1);
+    std::vector<uint> rows(numEnds);
+    for (uint e = 0; e < numEnds; e++)
+        rows[next[ends[e]]++] = e;
+
+    c.distRowStart.assign(rowStart.begin(), rowStart.end());
+    c.distRows.assign(rows.begin(), rows.end());
+}
+
+static void solveDistanceColours(SimContext &c, float4 *particles)
+{
+    if (c.distColourOrder.size() != c.dists.size())
+        sortByColour(c);
+
+    distance_colour_functor solve(particles,
+                                  (const uint2 *) thrust::raw_pointer_cast(c.distsI.data()),
+                                  thrust::raw_pointer_cast(c.dists.data()),
+                                  thrust::raw_pointer_cast(c.distCompliance.data()),
+                                  thrust::raw_pointer_cast(c.distLambda.data()),
+                                  thrust::raw_pointer_cast(c.distColourOrder.data()),
+                                  c.params.deltaTime);
+
+    // one launch per colour, the overflow colour one constraint at a time
+    for (uint k = 0; k < DISTANCE_COLOURS; k++)
+    {
+        uint first = c.distColourStart[k];
+        uint last = c.distColourStart[k + 1];
+        if (first == last)
+            continue;
+
+        thrust::for_each(thrust::counting_iterator<uint>(first), thrust::counting_iterator<uint>(last), solve);
+    }
+
+    for (uint i = c.distColourStart[DISTANCE_COLOURS]; i < c.distColourStart[DISTANCE_COLOURS + 1]; i++)
+        thrust::for_each(thrust::counting_iterator<uint>(i), thrust::counting_iterator<uint>(i + 1), solve);
+}
+
+// the Lagrange multipliers start every step at zero
+static void resetDistanceConstraints()
+{
+    SimContext &c = currentContext();
+    thrust::fill(c.distLambda.begin(), c.distLambda.end(), 0.f);
+}
+
+static void resetPointConstraints()
+{
+    SimContext &c = currentContext();
+    thrust::fill(c.pointLambda.begin(), c.pointLambda.end(), make_float3(0.f));
+}
 
 extern "C"
 {
@@ -61,14 +139,6 @@ extern "C"
 ////        checkCudaErrors(cusparseDestroy(cusparseHandle));
 //    }
 
-    void appendSolverParticle(uint numParticles)
-    {
-        uint sizeO = occurences.size();
-        occurences.resize(sizeO + numParticles);
-        uint *dOcc = thrust::raw_pointer_cast(occurences.data());
-        checkCudaErrors(cudaMemset(dOcc + sizeO, 0, numParticles * sizeof(uint)));
-    }
-
     void updateOccurences(uint *index, uint num)
     {
         thrust::device_vector<uint> dvIndex(index, index + num);
@@ -97,7 +167,7 @@ extern "C"
 //        }
 
 
-        uint *dOcc = thrust::raw_pointer_cast(occurences.data());
+        uint *dOcc = thrust::raw_pointer_cast(currentContext().occurences.data());
 
         thrust::for_each(
             thrust::make_zip_iterator(thrust::make_tuple(d_Sorted, d_Ones)),
@@ -105,8 +175,12 @@ extern "C"
             occurence_functor(dOcc));
     }
 
-    void addPointConstraint(uint *index, float *point, uint numConstraints)
+    void addPointConstraint(uint *index, float *point, float *compliance, uint numConstraints)
     {
+        SimContext &c = currentContext();
+        thrust::device_vector<uint> &pointsI = c.pointsI;
+        thrust::device_vector<float> &points = c.points;
+
         uint sizeP = points.size();
         uint sizeI = pointsI.size();
 
@@ -119,11 +193,18 @@ extern "C"
         copyArrayToDevice(dPoints + sizeP, point, 0, 3 * numConstraints * sizeof(float));
         copyArrayToDevice(dPointsI + sizeI, index, 0, numConstraints * sizeof(uint));
 
+        c.pointCompliance.insert(c.pointCompliance.end(), compliance, compliance + numConstraints);
+        c.pointLambda.resize(pointsI.size());
+
         updateOccurences(index, numConstraints);
     }
 
-    void addDistanceConstraint(uint *index, float *distance, uint numConstraints)
+    void addDistanceConstraint(uint *index, float *distance, float *compliance, uint numConstraints)
     {
+        SimContext &c = currentContext();
+        thrust::device_vector<uint> &distsI = c.distsI;
+        thrust::device_vector<float> &dists = c.dists;
+
         uint sizeD = dists.size();
         uint sizeI = distsI.size();
 
@@ -136,6 +217,9 @@ extern "C"
         copyArrayToDevice(dDists + sizeD, distance, 0, numConstraints * sizeof(float));
         copyArrayToDevice(dDistsI + sizeI, index, 0, 2 * numConstraints * sizeof(uint));
 
+        c.distCompliance.insert(c.distCompliance.end(), compliance, compliance + numConstraints);
+        c.distLambda.resize(dists.size());
+
 //        thrust::device_ptr<uint> dOcc(occurences.data());
 //        printf("before: \n");
 //        for (uint i = 0; i < occurences.size(); i++)
@@ -143,11 +227,16 @@ extern "C"
 //            printf("%u\n", (uint)*(dOcc + i));
 //        }
 
-        sortedI.resize(distsI.size());
-        deltas.resize(8 * dists.size());
+        c.deltas.resize(dists.size());
 
         updateOccurences(index, 2 * numConstraints);
 
+        // colour the new constraints greedily on the host, in the order they come
+        thrust::host_vector<unsigned long long> masks = c.distColourMask;
+        for (uint i = 0; i < numConstraints; i++)
+            c.distColour.push_back(takeColour(masks[index[2 * i]], masks[index[2 * i + 1]]));
+        c.distColourMask = masks;
+
 //        printf("after: \n");
 //        for (uint i = 0; i < occurences.size(); i++)
 //        {
@@ -155,30 +244,18 @@ extern "C"
 //        }
     }
 
-    void freeSolverVectors()
+    void setDistanceCompliance(float compliance)
     {
-        // set size to zero
-        distsI.clear();
-        dists.clear();
-        pointsI.clear();
-        points.clear();
-        sortedI.clear();
-        deltas.clear();
-        occurences.clear();
-
-        // free memory
-        distsI.shrink_to_fit();
-        dists.shrink_to_fit();
-        pointsI.shrink_to_fit();
-        points.shrink_to_fit();
-        sortedI.shrink_to_fit();
-        deltas.shrink_to_fit();
-        occurences.shrink_to_fit();
-
+        SimContext &c = currentContext();
+        thrust::fill(c.distCompliance.begin(), c.distCompliance.end(), compliance);
     }
 
     void solvePointConstraints(float *particles)
     {
+        SimContext &c = currentContext();
+        thrust::device_vector<uint> &pointsI = c.pointsI;
+        thrust::device_vector<float> &points = c.points;
+
         uint numConstraints = pointsI.size();
 
         if (numConstraints == 0)
@@ -186,48 +263,113 @@ extern "C"
 
         thrust::device_ptr<uint> d_indices(pointsI.data());
         thrust::device_ptr<float3> d_points((float3*) thrust::raw_pointer_cast(points.data()));
+        thrust::device_ptr<float> d_compliance(c.pointCompliance.data());
+        thrust::device_ptr<float3> d_lambda(c.pointLambda.data());
 
         thrust::for_each(
-            thrust::make_zip_iterator(thrust::make_tuple(d_indices, d_points)),
-            thrust::make_zip_iterator(thrust::make_tuple(d_indices+numConstraints, d_points+numConstraints)),
-            point_constraint_functor((float4 *)particles));
+            thrust::make_zip_iterator(thrust::make_tuple(d_indices, d_points, d_compliance, d_lambda)),
+            thrust::make_zip_iterator(thrust::make_tuple(d_indices+numConstraints, d_points+numConstraints,
+                                                         d_compliance+numConstraints, d_lambda+numConstraints)),
+            point_constraint_functor((float4 *)particles, c.params.deltaTime));
     }
 
     void solveDistanceConstraints(float *particles)
     {
+        SimContext &c = currentContext();
+        thrust::device_vector<uint> &distsI = c.distsI;
+        thrust::device_vector<float> &dists = c.dists;
+
         uint numConstraints = dists.size();
 
         if (numConstraints == 0)
             return;
 
-        thrust::device_ptr<float4> d_pos4((float4*)particles);
+        if (c.params.distanceSolver == DISTANCE_GAUSS_SEIDEL)
+        {
+            solveDistanceColours(c, (float4 *) particles);
+            return;
+        }
+
+        uint numParticles = c.occurences.size();
+        if (c.distRows.size() != 2 * numConstraints || c.distRowStart.size() != numParticles + 1)
+            buildDistanceRows(c, numParticles);
+
+        float4 *dDeltas = thrust::raw_pointer_cast(c.deltas.data());
+
+        thrust::for_each(thrust::counting_iterator<uint>(0), thrust::counting_iterator<uint>(numConstraints),
+                         delta_computing_functor((const float4 *) particles,
+                                                 (const uint2 *) thrust::raw_pointer_cast(distsI.data()),
+                                                 thrust::raw_pointer_cast(dists.data()),
+                                                 thrust::raw_pointer_cast(c.distCompliance.data()),
+                                                 thrust::raw_pointer_cast(c.distLambda.data()),
+                                                 dDeltas, c.params.deltaTime));
+
+        thrust::for_each(thrust::counting_iterator<uint>(0), thrust::counting_iterator<uint>(numParticles),
+                         distance_constraint_functor((float4 *) particles,
+                                                     thrust::raw_pointer_cast(c.distRowStart.data()),
+                                                     thrust::raw_pointer_cast(c.distRows.data()),
+                                                     dDeltas,
+                                                     thrust::raw_pointer_cast(c.occurences.data())));
+    }
 
-        thrust::device_ptr<uint2> d_indices((uint2*)thrust::raw_pointer_cast(distsI.data()));
-        thrust::device_ptr<float> d_dists(dists.data());
-        thrust::device_ptr<uint> d_sortedI1(sortedI.data());
-        thrust::device_ptr<uint> d_sortedI2 = d_sortedI1 + numConstraints;
-        thrust::device_ptr<float4> d_deltas1((float4*) thrust::raw_pointer_cast(deltas.data()));
-        thrust::device_ptr<float4> d_deltas2 = d_deltas1 + numConstraints;
+    float distanceConstraintError(float *particles)
+    {
+        SimContext &c = currentContext();
+        uint numConstraints = c.dists.size();
 
-        thrust::for_each(
-                    thrust::make_zip_iterator(thrust::make_tuple(d_indices, d_dists, d_sortedI1, d_sortedI2, d_deltas1, d_deltas2)),
-                    thrust::make_zip_iterator(thrust::make_tuple(d_indices+numConstraints, d_dists+numConstraints,
-                                                                 d_sortedI1+numConstraints, d_sortedI2+numConstraints,
-                                                                 d_deltas1+numConstraints, d_deltas2+numConstraints)),
-            delta_computing_functor((float4 *)particles));
+        if (numConstraints == 0)
+            return 0.f;
+
+        distance_error_functor error((const float4 *) particles,
+                                     (const uint2 *) thrust::raw_pointer_cast(c.distsI.data()),
+                                     thrust::raw_pointer_cast(c.dists.data()));
 
-        thrust::sort_by_key(sortedI.begin(), sortedI.end(), d_deltas1);
+        float sum = thrust::transform_reduce(thrust::counting_iterator<uint>(0),
+                                             thrust::counting_iterator<uint>(numConstraints),
+                                             error, 0.f, thrust::plus<float>());
+        return sum / numConstraints;
+    }
 
-        thrust::pair<thrust::device_ptr<uint>,thrust::device_ptr<float4> > new_end;
-        new_end = thrust::reduce_by_key(d_sortedI1, d_sortedI1+numConstraints*2, d_deltas1, d_sortedI1, d_deltas1);
 
-        uint size = new_end.first - d_sortedI1;
-        thrust::device_ptr<uint> d_occ(occurences.data());
+    /*
+     * The constraint kinds. A new kind keeps its data in arrays by
+     * constraint in the context, adds an add*Constraint function, remaps
+     * its particle indices in permuteParticles and registers its solve
+     * function here, in the order the solver applies it, and the one
+     * that clears its Lagrange multipliers at the start of a step.
+     */
+    struct ConstraintType
+    {
+        const char *name;
+        void (*solve)(float *particles);
+        void (*reset)();
+    };
 
-        thrust::for_each(
-            thrust::make_zip_iterator(thrust::make_tuple(d_pos4, d_deltas1, d_occ)),
-            thrust::make_zip_iterator(thrust::make_tuple(d_pos4+size, d_deltas1 + size, d_occ+size)),
-            distance_constraint_functor());
+    static const ConstraintType constraintTypes[] =
+    {
+        { "solveDistanceConstraints", solveDistanceConstraints, resetDistanceConstraints },
+        { "solvePointConstraints", solvePointConstraints, resetPointConstraints },
+    };
+
+    uint numConstraintTypes()
+    {
+        return sizeof(constraintTypes) / sizeof(constraintTypes[0]);
+    }
+
+    const char *constraintTypeName(uint type)
+    {
+        return constraintTypes[type].name;
+    }
+
+    void solveConstraints(uint type, float *particles)
+    {
+        constraintTypes[type].solve(particles);
+    }
+
+    void resetConstraints()
+    {
+        for (uint type = 0; type < numConstraintTypes(); type++)
+            constraintTypes[type].reset();
     }
 
 }
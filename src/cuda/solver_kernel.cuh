@@ -6,68 +6,90 @@
 #include "helper_math.h"
 #include "math_constants.h"
 #include "thrust/tuple.h"
+#include "shared_variables.cuh"
 
+// the compliance of a constraint for the step, over dt^2 (XPBD)
+inline __host__ __device__
+float stepCompliance(float compliance, float deltaTime)
+{
+    return compliance > 0.f ? compliance / (deltaTime * deltaTime) : 0.f;
+}
+
+// Pins a particle to a fixed point, or with a compliance pulls it
+// towards it by a spring, accumulating the multipliers of the step.
 struct point_constraint_functor
 {
     float4 *particles;
+    float deltaTime;
 
     __host__ __device__
-    point_constraint_functor(float4 *particles_) : particles(particles_) {}
+    point_constraint_functor(float4 *particles_, float deltaTime_) : particles(particles_), deltaTime(deltaTime_) {}
 
     template <typename Tuple>
     __device__
     void operator()(Tuple t)
     {
+        /*
+         * 0: index
+         * 1: point
+         * 2: compliance
+         * 3: lambda
+         */
         uint index = thrust::get<0>(t);
         float4 pos = particles[index];
-        particles[index] = make_float4(thrust::get<1>(t), pos.w);
+        float3 point = thrust::get<1>(t);
+        float compliance = stepCompliance(thrust::get<2>(t), deltaTime);
+
+        if (compliance == 0.f)
+        {
+            particles[index] = make_float4(point, pos.w);
+            return;
+        }
+
+        float3 lambda = thrust::get<3>(t);
+        float3 dLambda = (point - make_float3(pos) - compliance * lambda) / (1.f + compliance);
+        thrust::get<3>(t) = lambda + dLambda;
+        particles[index] = make_float4(make_float3(pos) + dLambda, pos.w);
     }
 };
 
+// Jacobi: the correction of the first particle of every distance
+// constraint, the second one moves by its negative
 struct delta_computing_functor
 {
-    float4 *particles;
+    const float4 *particles;
+    const uint2 *indices;
+    const float *dists;
+    const float *compliance;
+    float *lambda;
+    float4 *deltas;
+    float deltaTime;
 
     __host__ __device__
-    delta_computing_functor(float4 *particles_) : particles(particles_) {}
+    delta_computing_functor(const float4 *particles_, const uint2 *indices_, const float *dists_,
+                            const float *compliance_, float *lambda_, float4 *deltas_, float deltaTime_)
+        : particles(particles_), indices(indices_), dists(dists_), compliance(compliance_), lambda(lambda_),
+          deltas(deltas_), deltaTime(deltaTime_) {}
 
-    template <typename Tuple>
     __device__
-    void operator()(Tuple t)
+    void operator()(uint j)
     {
-        /*
-         * 0: index
-         * 1: dists
-         * 2: sortedI1
-         * 3: sortedI2
-         * 4: delta1
-         * 5: delta2
-         */
-        uint2 index = thrust::get<0>(t);
-        float4 p1 = particles[index.x];
-        float4 p2 = particles[index.y];
-
-        thrust::get<2>(t) = index.x;
-        thrust::get<3>(t) = index.y;
+        uint2 index = indices[j];
 
-        float4 relPos = p1 - p2;
+        float4 relPos = particles[index.x] - particles[index.y];
         relPos.w = 0.f; // inverse masses not needed
 
         float dist = length(relPos);
         if (dist > 0.0001f)
         {
             float4 grad = relPos / dist;
-            float mag = (thrust::get<1>(t) - dist) * .5f;
-            float4 delta = grad * mag;
-
-            thrust::get<4>(t) = delta;
-            thrust::get<5>(t) = -delta;
+            float alpha = stepCompliance(compliance[j], deltaTime);
+            float dLambda = ((dists[j] - dist) - alpha * lambda[j]) / (2.f + alpha);
+            lambda[j] += dLambda;
+            deltas[j] = grad * dLambda;
         }
         else
-        {
-            thrust::get<4>(t) = make_float4(0);
-            thrust::get<5>(t) = make_float4(0);
-        }
+            deltas[j] = make_float4(0);
     }
 };
 
@@ -152,16 +174,114 @@ struct gradient_functor
     }
 };
 
+// Jacobi: every particle sums the corrections of its constraint row in
+// constraint order and averages them over all constraints affecting it
 struct distance_constraint_functor
 {
-    template <typename Tuple>
+    float4 *particles;
+    const uint *rowStart;
+    const uint *rows;
+    const float4 *deltas;
+    const uint *occurences;
+
+    __host__ __device__
+    distance_constraint_functor(float4 *particles_, const uint *rowStart_, const uint *rows_, const float4 *deltas_,
+                                const uint *occurences_)
+        : particles(particles_), rowStart(rowStart_), rows(rows_), deltas(deltas_), occurences(occurences_) {}
+
     __device__
-    void operator()(Tuple t)
+    void operator()(uint i)
     {
-        thrust::get<0>(t) += thrust::get<1>(t) / thrust::get<2>(t);
+        uint first = rowStart[i];
+        uint last = rowStart[i + 1];
+        if (first == last)
+            return;
+
+        float4 sum = make_float4(0.f);
+        for (uint k = first; k < last; k++)
+        {
+            if (rows[k] & 1)
+                sum -= deltas[rows[k] >> 1];
+            else
+                sum += deltas[rows[k] >> 1];
+        }
+        particles[i] += sum / occurences[i];
     }
 };
 
+// Gauss-Seidel: moves both ends of the distance constraints of one
+// colour in place, the constraints of a colour share no particle
+struct distance_colour_functor
+{
+    float4 *particles;
+    const uint2 *indices;
+    const float *dists;
+    const float *compliance;
+    float *lambda;
+    const uint *order;
+    float deltaTime;
+
+    __host__ __device__
+    distance_colour_functor(float4 *particles_, const uint2 *indices_, const float *dists_, const float *compliance_,
+                            float *lambda_, const uint *order_, float deltaTime_)
+        : particles(particles_), indices(indices_), dists(dists_), compliance(compliance_), lambda(lambda_),
+          order(order_), deltaTime(deltaTime_) {}
+
+    __device__
+    void operator()(uint i)
+    {
+        uint j = order[i];
+        uint2 index = indices[j];
+
+        float4 relPos = particles[index.x] - particles[index.y];
+        relPos.w = 0.f;
+
+        float dist = length(relPos);
+        if (dist > 0.0001f)
+        {
+            float alpha = stepCompliance(compliance[j], deltaTime);
+            float dLambda = ((dists[j] - dist) - alpha * lambda[j]) / (2.f + alpha);
+            lambda[j] += dLambda;
+            float4 delta = relPos / dist * dLambda;
+            particles[index.x] += delta;
+            particles[index.y] -= delta;
+        }
+    }
+};
+
+// the error of a distance constraint relative to its rest distance
+struct distance_error_functor
+{
+    const float4 *particles;
+    const uint2 *indices;
+    const float *dists;
+
+    __host__ __device__
+    distance_error_functor(const float4 *particles_, const uint2 *indices_, const float *dists_)
+        : particles(particles_), indices(indices_), dists(dists_) {}
+
+    __device__
+    float operator()(uint i) const
+    {
+        float3 relPos = make_float3(particles[indices[i].x] - particles[indices[i].y]);
+        return fabsf(length(relPos) - dists[i]) / fmaxf(dists[i], 0.0001f);
+    }
+};
+
+// The lowest colour none of the constraints of either particle has, it
+// is taken for both. DISTANCE_COLOURS if all are taken.
+inline uint takeColour(unsigned long long &mask1, unsigned long long &mask2)
+{
+    unsigned long long taken = mask1 | mask2;
+    if (taken == ~0ull)
+        return DISTANCE_COLOURS;
+
+    uint colour = __builtin_ctzll(~taken);
+    mask1 |= 1ull << colour;
+    mask2 |= 1ull << colour;
+    return colour;
+}
+
 struct identity_functor
 {
     const uint w;
@@ -286,32 +406,6 @@ void constraintCentricSolveD(float      *A,
     __syncthreads();
 }
 
-struct rigid_body_functor
-{
-    float2 *rVecs;
-    float4 *particles;
-
-    __host__ __device__
-    rigid_body_functor(float2 *_rVecs, float4 *_particles)
-        : rVecs(_rVecs), particles(_particles) {}
-
-    template <typename Tuple>
-    __device__
-    void operator()(Tuple t)
-    {
-        /* Tuple:
-         * 0: angle
-         * 1: center mass
-         * 2: particle index start
-         * 3: rVec index start
-         * 4: size
-         */
-
-
-     }
-};
-
-
 struct occurence_functor
 {
     uint *occ;
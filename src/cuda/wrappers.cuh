@@ -13,28 +13,81 @@ extern "C"
 {
 
     /*
-     *   INTEGRATION
+     *   CONTEXT
      */
-    void initIntegration();
+    // all per-simulation state (velocities, constraints, neighbor lists, ...)
+    struct SimContext;
+
+    SimContext *createContext();
+
+    void destroyContext(SimContext *context);
+
+    // every following call of the calling thread works on this context
+    void bindContext(SimContext *context);
 
-    void appendIntegrationParticle(float *v, float *ro, uint iterations);
+    // makes room for numParticles particles in total without reallocating
+    void reserveParticles(uint numParticles);
 
-    void freeIntegrationVectors();
+    // the single entry point for new particles: velocities (float4),
+    // rest densities, inverse masses and phases, storage grows geometrically
+    void appendParticles(const float *vel, const float *ro, const float *w, const int *phase, uint numParticles);
 
+    // replaces num particle handles (indices in order of creation) by
+    // the slots the particles are stored in now, see permuteParticles
+    void findParticleSlots(uint *index, uint num);
+
+
+    /*
+     *   INTEGRATION
+     */
     void setParameters(SimParams *hostParams);
 
+    // Starts a step in one sweep over the particles: derives the
+    // velocities of the first numPending particles from the last step
+    // (which took prevDeltaTime, see calcVelocity), stores the positions
+    // in Xstar and predicts the new ones. Unless gridParticleHash is NULL
+    // it also computes the grid hashes of the predictions like calcHash.
     void integrateSystem(float *pos,
                          float deltaTime,
-                         uint numParticles);
+                         uint numParticles,
+                         float prevDeltaTime,
+                         uint numPending,
+                         uint *gridParticleHash,
+                         uint *gridParticleIndex);
 
     void calcHash(uint  *gridParticleHash,
                   uint  *gridParticleIndex,
                   float *pos,
                   int    numParticles);
 
-    void sortParticles(uint *dGridParticleHash, uint *dGridParticleIndex, uint numParticles);
-
-    void reorderDataAndFindCellStart(uint  *cellStart,
+    // Sorts the indices by hash, stable, looking at the low sortBits bits
+    // of the hashes only. coherent promises that the particles are those
+    // of the previous coherent sort, which may then start from its order.
+    void sortParticles(uint *dGridParticleHash, uint *dGridParticleIndex, uint numParticles, uint sortBits,
+                       bool coherent);
+
+    // Reorders only the positions, for iterations that keep the grid
+    // and the neighbor lists. Returns the largest distance a particle
+    // moved since the lists were built, they hold for up to half the
+    // neighbor skin (SimParams::neighborSkin).
+    float reorderPositions(float *sortedPos, uint *gridParticleIndex, float *oldPos, uint numParticles);
+
+    // Makes the sorted order the storage order: permutes the positions
+    // and all per-particle arrays of the context in place, rewrites the
+    // constraint indices and the slots of the particle handles and resets
+    // gridParticleIndex to the identity. sortedPos receives a copy of the
+    // permuted positions, like reorderDataAndFindCellStart would write.
+    void permuteParticles(float *pos, float *sortedPos, uint *gridParticleIndex, uint numParticles);
+
+    // The grid is stored sparsely: a hash table of the occupied blocks
+    // with tableSize slots (a power of two, at least twice the number of
+    // particles) and the start and end of every occupied cell, in key
+    // order, in cellStart and cellEnd (one entry per particle at most).
+    // Passing NULL for sortedPos only builds the grid.
+    void reorderDataAndFindCellStart(uint  *blockKeys,
+                                     unsigned long long *blockCells,
+                                     uint  *blockFirstCell,
+                                     uint  *cellStart,
                                      uint  *cellEnd,
                                      float *sortedPos,
                                      float *sortedW,
@@ -43,7 +96,7 @@ extern "C"
                                      uint  *gridParticleIndex,
                                      float *oldPos,
                                      uint   numParticles,
-                                     uint   numCells);
+                                     uint   tableSize);
 
     void collideWorld(float *pos,
                       float *sortedPos,
@@ -51,21 +104,43 @@ extern "C"
                       int3 minBounds,
                       int3 maxBounds);
 
+    // The one neighbor search of an iteration (or of several with a
+    // skin), in the blocks found by reorderDataAndFindCellStart. Every
+    // particle gets a row of candidates split into distance bands: the
+    // particles and the sdf particles within a diameter, which collide
+    // resolves as contacts with friction, and the particles within H,
+    // which solveFluids uses for the density constraint.
+    void findNeighbors(float *sortedPos,
+                       float *sortedW,
+                       int   *sortedPhase,
+                       float *sortedPosSdf,
+                       uint  *blockKeys,
+                       unsigned long long *blockCells,
+                       uint  *blockFirstCell,
+                       uint  *cellStart,
+                       uint  *cellEnd,
+                       uint  *blockKeysSdf,
+                       unsigned long long *blockCellsSdf,
+                       uint  *blockFirstCellSdf,
+                       uint  *cellStartSdf,
+                       uint  *cellEndSdf,
+                       uint   numParticles,
+                       uint   numParticlesSdf,
+                       uint   tableSize,
+                       uint   tableSizeSdf);
+
     void collide(float *particles,
                  float *sortedPos,
                  float *sortedW,
                  int   *sortedPhase,
                  float *sortedPosSdf,
                  uint  *gridParticleIndex,
-                 uint  *cellStart,
-                 uint  *cellEnd,
-                 uint  *cellStartSdf,
-                 uint  *cellEndSdf,
                  uint   numParticles,
-                 uint   numParticlesSdf,
-                 uint   numCells);
+                 uint   numParticlesSdf);
 
-    void sortByType(float *dPos, uint numParticles);
+    // groups the sorted particles by phase, so the collision and fluid
+    // kernels only run over the particles they apply to
+    void sortByType(int *sortedPhase, uint numParticles);
 
 
     void calcVelocity(float *dpos, float deltaTime, uint numParticles);
@@ -77,27 +152,43 @@ extern "C"
 //    void initHandles();
 //    void destroyHandles();
 
-    void appendSolverParticle(uint numParticles);
-
-    void addPointConstraint(uint *index, float *point, uint numConstraints);
-    void addDistanceConstraint(uint *index, float *distance, uint numConstraints);
+    // The compliance of a constraint is its inverse stiffness (XPBD), 0
+    // makes it rigid. The effect of a compliance does not depend on the
+    // time step or the solver iterations.
+    void addPointConstraint(uint *index, float *point, float *compliance, uint numConstraints);
+    // also colours the new constraints for the Gauss-Seidel solver
+    void addDistanceConstraint(uint *index, float *distance, float *compliance, uint numConstraints);
 
-    void freeSolverVectors();
+    // replaces the compliance of all distance constraints
+    void setDistanceCompliance(float compliance);
 
     void solvePointConstraints(float *particles);
 
+    // with SimParams::distanceSolver
     void solveDistanceConstraints(float *particles);
 
+    // The kinds of constraints in the order the solver applies them,
+    // each solves all its constraints at once from arrays by constraint.
+    // The name is that of the solve function, a string literal.
+    uint numConstraintTypes();
+    const char *constraintTypeName(uint type);
+    void solveConstraints(uint type, float *particles);
+
+    // clears the Lagrange multipliers of all constraints, before the
+    // first solver iteration of a step
+    void resetConstraints();
+
+    // the mean error of the distance constraints relative to their rest distances
+    float distanceConstraintError(float *particles);
+
     ////////////////////////////////// FLUIDS ////////////////////////
+    // uses the neighbor rows of the last findNeighbors, like collide
     void solveFluids(float *sortedPos,
                      float *sortedW,
                      int   *sortedPhase,
                      uint  *gridParticleIndex,
-                     uint  *cellStart,
-                     uint  *cellEnd,
                      float *particles,
-                     uint   numParticles,
-                     uint   numCells);
+                     uint   numParticles);
 }
 
 #endif // WRAPPERS_CUH
@@ -0,0 +1,123 @@
+/*
+ * Runs the built-in scenes without a window or GL context and
+ * reports the simulation throughput.
+ *
+ * usage: thesis_headless [-n steps] [-dt seconds] [-parallel] [-trace file] [scene keys]
+ *
+ * Scene keys are the ones used in the viewer, e.g. "179BM".
+ * All non-empty scenes are run when no keys are given.
+ * -parallel runs all scenes at the same time, each on its own thread.
+ * -trace writes the per-stage timings of all runs as a Chrome
+ * trace, it needs a build configured with -DTHESIS_TRACE=ON.
+ */
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "particlesystem.h"
+#include "scenes.h"
+#include "trace.h"
+#include "util.cuh"
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-n steps] [-dt seconds] [-parallel] [-trace file] [scene keys]\n", name);
+}
+
+static void runScene(char key, uint steps, float deltaTime)
+{
+    ParticleSystem *particleSystem = createScene(key);
+
+    auto start = std::chrono::high_resolution_clock::now();
+
+    for (uint i = 0; i < steps; i++)
+        particleSystem->update(deltaTime);
+
+    auto finish = std::chrono::high_resolution_clock::now();
+    std::chrono::duration<double> elapsed = finish - start;
+
+    printf("scene %c: %6u particles, %u steps in %8.3f s, %10.1f steps/s\n",
+           key, particleSystem->getNumParticles(), steps, elapsed.count(),
+           steps / elapsed.count());
+    fflush(stdout);
+
+    delete particleSystem;
+}
+
+int main(int argc, char *argv[])
+{
+    uint steps = 1000;
+    float deltaTime = 1.f / 60.f;
+    std::string keys;
+    const char *tracePath = NULL;
+    bool parallel = false;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "-n") && i + 1 < argc)
+            steps = static_cast<uint>(atoi(argv[++i]));
+        else if (!strcmp(argv[i], "-dt") && i + 1 < argc)
+            deltaTime = static_cast<float>(atof(argv[++i]));
+        else if (!strcmp(argv[i], "-parallel"))
+            parallel = true;
+        else if (!strcmp(argv[i], "-trace") && i + 1 < argc)
+            tracePath = argv[++i];
+        else if (argv[i][0] == '-')
+        {
+            usage(argv[0]);
+            return 1;
+        }
+        else
+            keys += argv[i];
+    }
+
+#ifndef THESIS_TRACE
+    if (tracePath)
+        fprintf(stderr, "warning: built without THESIS_TRACE, the trace will be empty\n");
+#endif
+
+    if (keys.empty())
+        keys = sceneKeys + 1; // skip the empty scene
+
+    for (char &key : keys)
+    {
+        key = toupper(key);
+        if (!strchr(sceneKeys, key))
+        {
+            fprintf(stderr, "unknown scene '%c'\n", key);
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    cudaInit();
+
+    if (parallel)
+    {
+        // every simulation has its own context, so they can run side by side
+        std::vector<std::thread> threads;
+        for (char key : keys)
+            threads.push_back(std::thread(runScene, key, steps, deltaTime));
+        for (std::thread &thread : threads)
+            thread.join();
+    }
+    else
+    {
+        for (char key : keys)
+            runScene(key, steps, deltaTime);
+    }
+
+    if (tracePath && !trace::writeChromeTrace(tracePath))
+    {
+        fprintf(stderr, "could not write %s\n", tracePath);
+        return 1;
+    }
+
+    return 0;
+}
@@ -4,7 +4,7 @@
 
 int main(int argc, char *argv[])
 {
-#ifdef CUDA
+#if defined(CUDA) || defined(CPU)
     QApplication a(argc, argv);
     MainWindow w;
 
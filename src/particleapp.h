@@ -27,8 +27,6 @@ public:
     void resize(int w, int h);
 
 private:
-    void makeInitScene();
-
     ParticleSystem *m_particleSystem;
     Renderer *m_renderer;
 
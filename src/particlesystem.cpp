@@ -4,16 +4,22 @@
  * eventually terminate the simulation.
  */
 
+#ifndef HEADLESS
 #include <GL/glew.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <assert.h>
 #include <math.h>
 
+#ifdef CUDA
 #include <cuda_runtime.h>
 #include <helper_cuda.h>
 #include <thrust/host_vector.h>
+#endif
+#include <algorithm>
 #include <unordered_set>
-#include <chrono>
 
 #include "particlesystem.h"
 #include "wrappers.cuh"
@@ -21,6 +27,47 @@
 #include "util.cuh"
 #include "shared_variables.cuh"
 #include "helper_math.h"
+#include "constants.cuh"
+#include "trace.h"
+
+// slots of a block hash table for n particles: a power of two with
+// a load factor of at most one half (every particle in its own block)
+static uint blockTableSize(uint n)
+{
+    uint size = 2;
+    while (size < 2 * n)
+        size <<= 1;
+    return size;
+}
+
+// Removes the queued constraints that refer to a particle handle of
+// numParticles or more (particles that do not exist) and returns how
+// many. A constraint has ends handles, dataSize values in data and one
+// compliance.
+static uint dropInvalidConstraints(std::vector<uint> &index, std::vector<float> &data, std::vector<float> &compliance,
+                                   uint ends, uint dataSize, uint numParticles)
+{
+    uint numConstraints = compliance.size();
+    uint kept = 0;
+    for (uint i = 0; i < numConstraints; i++)
+    {
+        bool valid = true;
+        for (uint e = 0; e < ends; e++)
+            valid &= index[i * ends + e] < numParticles;
+        if (!valid)
+            continue;
+
+        std::copy(index.begin() + i * ends, index.begin() + (i + 1) * ends, index.begin() + kept * ends);
+        std::copy(data.begin() + i * dataSize, data.begin() + (i + 1) * dataSize, data.begin() + kept * dataSize);
+        compliance[kept] = compliance[i];
+        kept++;
+    }
+
+    index.resize(kept * ends);
+    data.resize(kept * dataSize);
+    compliance.resize(kept);
+    return numConstraints - kept;
+}
 
 /**
  * @brief ParticleSystem::ParticleSystem
@@ -29,44 +76,78 @@
  *     for the particle simulation
  *
  * @param particleRadius
- * @param gridSize
  * @param maxParticles
  * @param minBounds
  * @param maxBounds
  * @param iterations
  */
-ParticleSystem::ParticleSystem(float particleRadius, uint3 gridSize, uint maxParticles, int3 minBounds, int3
-        maxBounds, int iterations, bool precomputation)
+ParticleSystem::ParticleSystem(float particleRadius, uint maxParticles, int3 minBounds, int3 maxBounds,
+        int iterations, bool precomputation)
     : m_initialized(false),
       m_particleRadius(particleRadius),
       m_maxParticles(maxParticles),
       m_numParticles(0),
 //      m_dPos(0),
+      m_dPos(0),
       m_posVbo(0),
       m_cuda_posvbo_resource(0),
-      m_gridSize(gridSize),
+      m_context(0),
       m_rigidIndex(0),
       m_minBounds(minBounds),
       m_maxBounds(maxBounds),
       m_solverIterations(iterations),
+      m_substeps(0),
+      m_spatialOrderPeriod(0),
+      m_permuteStep(0),
+      m_sortedInPlace(false),
+      m_neighborsValid(false),
+      m_neighborSearches(0),
+      m_neighborDisplacement(0.f),
+      m_pendingVelocities(0),
+      m_pendingDeltaTime(0.f),
       m_precomputation(precomputation),
+      m_posVboSdf(0),
+      m_cuda_posvbosdf_resource(0),
+      m_dPosSdf(0),
       m_iterations(0)
 {
-    m_numGridCells = m_gridSize.x * m_gridSize.y * m_gridSize.z;
-
-    m_gridSortBits = 18;
-
-    // set simulation parameters
-    m_params.gridSize = m_gridSize;
-    m_params.numCells = m_numGridCells;
-    m_params.numBodies = m_numParticles;
-
     m_params.particleRadius = m_particleRadius;
+    m_params.neighborSkin = 0.f;
+    m_params.pairTraversal = 0;
+    m_params.clusterPairs = 0;
+    m_params.gridSort = GRID_SORT_INCREMENTAL;
+    m_params.cellOrder = CELL_ORDER_ROWS;
+    m_params.simdFluids = 0;
+    m_params.distanceSolver = DISTANCE_JACOBI;
+    m_params.deltaTime = 1.f / 60.f;
 
-    m_params.worldOrigin = make_float3(0.f, 0.f, 0.f);
     float cellSize = m_params.particleRadius * 2.0f;  // cell size equal to particle diameter
     m_params.cellSize = make_float3(cellSize);
 
+    // fluid neighbors are searched in blocks of cells at least H wide
+    // where the cells allow it. The occupied cells of a block are kept in
+    // 64 bits, so it has at most 4^3 cells, smaller particles search the
+    // more blocks that cover H.
+    uint blockSize = std::min(std::max(1, (int) ceilf(H / cellSize)), 4);
+    float blockWidth = blockSize * cellSize;
+    m_params.blockSize = blockSize;
+
+    // Cells are keyed on their true coordinates in the world box (plus
+    // a margin of one block), so distant particles never share a cell.
+    // Anything outside is clamped into the border blocks.
+    m_params.worldOrigin = make_float3(minBounds) - blockWidth;
+    float3 extent = make_float3(maxBounds - minBounds);
+    m_params.blockGridSize = make_uint3((uint) ceilf(extent.x / blockWidth) + 2,
+                                        (uint) ceilf(extent.y / blockWidth) + 2,
+                                        (uint) ceilf(extent.z / blockWidth) + 2);
+    m_params.numBlocks = m_params.blockGridSize.x * m_params.blockGridSize.y * m_params.blockGridSize.z;
+    m_params.gridSize = m_params.blockGridSize * blockSize;
+
+    calcCellKeys();
+
+    // set simulation parameters
+    m_params.numBodies = m_numParticles;
+
     m_params.gravity = make_float3(0.0f, -9.8f, 0.0f);
     m_params.globalDamping = 1.0f;
 
@@ -90,15 +171,22 @@ void ParticleSystem::_init(uint numParticles, uint maxParticles)
 {
     m_maxParticles = maxParticles;
     m_numParticles = numParticles;
-    initIntegration();
+
+    // all backend state of this simulation lives in its own context
+    m_context = createContext();
+    bindContext(m_context);
 
     /*
      *  allocate GPU data
      */
-    uint memSize = sizeof(GLfloat) * 4 * m_maxParticles;
+    uint memSize = sizeof(float) * 4 * m_maxParticles;
 
-    m_posVbo = createVBO(sizeof(GLfloat) * 4 * m_maxParticles);
+#ifdef HEADLESS
+    allocateArray((void **)&m_dPos, memSize);
+#else
+    m_posVbo = createVBO(memSize);
     registerGLBufferObject(m_posVbo, &m_cuda_posvbo_resource);
+#endif
 
     // grid and collisions
     allocateArray((void **)&m_dSortedPos, memSize);
@@ -108,21 +196,34 @@ void ParticleSystem::_init(uint numParticles, uint maxParticles)
     allocateArray((void **)&m_dGridParticleHash, m_maxParticles*sizeof(uint));
     allocateArray((void **)&m_dGridParticleIndex, m_maxParticles*sizeof(uint));
 
-    allocateArray((void **)&m_dCellStart, m_numGridCells*sizeof(uint));
-    allocateArray((void **)&m_dCellEnd, m_numGridCells*sizeof(uint));
+    // hash table of the occupied blocks and their occupied cells
+    uint tableSize = blockTableSize(m_maxParticles);
+    allocateArray((void **)&m_dBlockKeys, tableSize*sizeof(uint));
+    allocateArray((void **)&m_dBlockCells, tableSize*sizeof(unsigned long long));
+    allocateArray((void **)&m_dBlockFirstCell, tableSize*sizeof(uint));
+    allocateArray((void **)&m_dCellStart, m_maxParticles*sizeof(uint));
+    allocateArray((void **)&m_dCellEnd, m_maxParticles*sizeof(uint));
     
     // *************************
     // thesis modifications
     // *************************
-    m_maxSDFParticles = 45913;
-    m_posVboSdf = createVBO(sizeof(GLfloat) * 4 * m_maxSDFParticles);
+    m_maxSDFParticles = std::max(45913u, 3 * m_maxParticles);
+#ifdef HEADLESS
+    allocateArray((void **) &m_dPosSdf, sizeof(float) * 4 * m_maxSDFParticles);
+#else
+    m_posVboSdf = createVBO(sizeof(float) * 4 * m_maxSDFParticles);
     registerGLBufferObject(m_posVboSdf, &m_cuda_posvbosdf_resource);
+#endif
     
-    allocateArray((void **) &m_dSortedPosSdf, sizeof(GLfloat) * 4 * m_maxSDFParticles);
+    allocateArray((void **) &m_dSortedPosSdf, sizeof(float) * 4 * m_maxSDFParticles);
     allocateArray((void **) &m_dGridParticleHashSdf, m_maxSDFParticles * sizeof(uint));
     allocateArray((void **) &m_dGridParticleIndexSdf, m_maxSDFParticles * sizeof(uint));
-    allocateArray((void **) &m_dCellStartSdf, m_numGridCells * sizeof(uint));
-    allocateArray((void **) &m_dCellEndSdf, m_numGridCells * sizeof(uint));
+    uint tableSizeSdf = blockTableSize(m_maxSDFParticles);
+    allocateArray((void **) &m_dBlockKeysSdf, tableSizeSdf * sizeof(uint));
+    allocateArray((void **) &m_dBlockCellsSdf, tableSizeSdf * sizeof(unsigned long long));
+    allocateArray((void **) &m_dBlockFirstCellSdf, tableSizeSdf * sizeof(uint));
+    allocateArray((void **) &m_dCellStartSdf, m_maxSDFParticles * sizeof(uint));
+    allocateArray((void **) &m_dCellEndSdf, m_maxSDFParticles * sizeof(uint));
     
     setParameters(&m_params);
 
@@ -140,24 +241,33 @@ void ParticleSystem::_finalize()
 
     freeArray(m_dGridParticleHash);
     freeArray(m_dGridParticleIndex);
+    freeArray(m_dBlockKeys);
+    freeArray(m_dBlockCells);
+    freeArray(m_dBlockFirstCell);
     freeArray(m_dCellStart);
     freeArray(m_dCellEnd);
 
     freeArray(m_dSortedPosSdf);
     freeArray(m_dGridParticleHashSdf);
     freeArray(m_dGridParticleIndexSdf);
+    freeArray(m_dBlockKeysSdf);
+    freeArray(m_dBlockCellsSdf);
+    freeArray(m_dBlockFirstCellSdf);
     freeArray(m_dCellStartSdf);
     freeArray(m_dCellEndSdf);
 
+#ifdef HEADLESS
+    freeArray(m_dPos);
+    freeArray(m_dPosSdf);
+#else
     unregisterGLBufferObject(m_cuda_posvbo_resource);
     glDeleteBuffers(1, (const GLuint *)&m_posVbo);
 
     unregisterGLBufferObject(m_cuda_posvbosdf_resource);
     glDeleteBuffers(1, (const GLuint *) &m_posVboSdf);
+#endif
 
-    freeIntegrationVectors();
-    freeSolverVectors();
-    freeSharedVectors();
+    destroyContext(m_context);
 }
 
 /**
@@ -171,8 +281,11 @@ void ParticleSystem::_finalize()
 void ParticleSystem::update(float deltaTime)
 {
     assert(m_initialized);
-    
-    // auto start = std::chrono::high_resolution_clock::now();
+
+    TRACE_SCOPE("update");
+
+    bindContext(m_context);
+    commitConstraints();
 
     // avoid large timesteps
     deltaTime = std::min(deltaTime, .05f);
@@ -186,129 +299,256 @@ void ParticleSystem::update(float deltaTime)
     // get pointer to vbo of point positions
     // note: this should be changed eventually so the vbo can be
     // set to render things other than just points
-    float *dPos = (float *) mapGLBufferObject(&m_cuda_posvbo_resource);
-    float *dPosSdf = (float *) mapGLBufferObject(&m_cuda_posvbosdf_resource);
+    float *dPos = mapPositions();
     
-    // update constants
+    // update constants, in substep mode for the time of one substep
+    uint substeps = std::max(m_substeps, 1u);
+    uint iterations = m_substeps > 0 ? 1 : m_solverIterations;
+    float stepTime = deltaTime / substeps;
+    m_params.deltaTime = stepTime;
     setParameters(&m_params);
 
-    // store current positions then guess
-    // new positions based on forces
-    integrateSystem(dPos,
-                    deltaTime,
-                    m_numParticles);
-    
+    // the block tables only need to hold the current particles
+    uint tableSize = blockTableSize(m_numParticles);
+    uint tableSizeSdf = 0;
+
+    for (uint s = 0; s < substeps; s++)
+    {
+        // store current positions then guess new positions based on
+        // forces. The same sweep finishes the velocities of the last
+        // step (or substep) and, if the first iteration searches in any
+        // case, hashes the guesses into the grid.
+        bool hashed = m_params.neighborSkin == 0.f || !m_neighborsValid;
+        {
+            TRACE_SCOPE("integrateSystem");
+            integrateSystem(dPos,
+                            stepTime,
+                            m_numParticles,
+                            m_pendingDeltaTime,
+                            m_pendingVelocities,
+                            hashed ? m_dGridParticleHash : NULL,
+                            hashed ? m_dGridParticleIndex : NULL);
+            m_pendingVelocities = 0;
+        }
+
+        // the sdf particles follow the prediction of the first substep
+        if (s == 0)
+            tableSizeSdf = updateSdfGrid();
+
+        // the compliant constraints accumulate their multipliers over the
+        // iterations of a step
+        resetConstraints();
+        for (uint i = 0; i < iterations; i++)
+        {
+            TRACE_SCOPE_ARG("iteration", s * iterations + i);
+            solverIteration(dPos, hashed && i == 0, tableSize, tableSizeSdf);
+        }
+
+        // the velocities follow from the distance travelled during this
+        // step, integrateSystem derives them at the start of the next one
+        // (particles added in between keep the velocity they are added with)
+        m_pendingVelocities = m_numParticles;
+        m_pendingDeltaTime = stepTime;
+    }
+
+    // unmap at end here to avoid unnecessary graphics/CUDA context switch
+    unmapPositions();
+    unmapPositionsSdf();
+
+    m_iterations++;
+
+    // add new particles to the scene
+    addNewStuff();
+}
+
+
+// Maps the sdf particles (until the end of update), generates them
+// around the particles first unless they are precomputed and sorts them
+// into their grid. Returns the size of their block table.
+uint ParticleSystem::updateSdfGrid()
+{
     if (!m_precomputation)
     {
+        // the sdf particles change, so do their neighbors
+        m_neighborsValid = false;
+
         generateParticlesLocal();
         addSDFParticles();
     }
-    
-    if (!m_precomputation)
+
+    // map the sdf particles only after they have been uploaded
+    float *dPosSdf = mapPositionsSdf();
+    uint tableSizeSdf = blockTableSize(m_sdfParticles.size());
+
+    if (!m_precomputation && !m_sdfParticles.empty())
+    {
+        TRACE_SCOPE("sdfGrid");
+        calcHash(m_dGridParticleHashSdf, m_dGridParticleIndexSdf, dPosSdf, m_sdfParticles.size());
+        sortParticles(m_dGridParticleHashSdf, m_dGridParticleIndexSdf, m_sdfParticles.size(), m_gridSortBits,
+                      false);
+
+        reorderDataAndFindCellStart(m_dBlockKeysSdf, m_dBlockCellsSdf, m_dBlockFirstCellSdf, m_dCellStartSdf,
+                m_dCellEndSdf, m_dSortedPosSdf, NULL, NULL, m_dGridParticleHashSdf, m_dGridParticleIndexSdf,
+                dPosSdf, m_sdfParticles.size(), tableSizeSdf);
+    }
+
+    return tableSizeSdf;
+}
+
+// One pass of the solver over the predicted positions: the neighbor
+// search (if the skin does not cover it), collisions, fluids and the
+// constraints. hashed tells that integrateSystem hashed the positions.
+void ParticleSystem::solverIteration(float *dPos, bool hashed, uint tableSize, uint tableSizeSdf)
+{
+    // with a neighbor skin the grid and neighbor lists of an earlier
+    // iteration still hold until a particle moved half the skin
+    bool search = true;
+    if (m_params.neighborSkin > 0.f && m_neighborsValid)
     {
+        TRACE_SCOPE("reorderPositions");
+        m_neighborDisplacement = reorderPositions(m_dSortedPos, m_dGridParticleIndex, dPos, m_numParticles);
+        search = m_neighborDisplacement > 0.5f * m_params.neighborSkin;
+    }
 
-        if (!m_sdfParticles.empty())
+    if (search)
+    {
+        // calculate grid hash (unless integrateSystem just did)
+        if (!hashed)
         {
-            calcHash(m_dGridParticleHashSdf, m_dGridParticleIndexSdf, dPosSdf, m_sdfParticles.size());
-            sortParticles(m_dGridParticleHashSdf, m_dGridParticleIndexSdf, m_sdfParticles.size());
-    
-            reorderDataAndFindCellStart(m_dCellStartSdf, m_dCellEndSdf, m_dSortedPosSdf, NULL, NULL, m_dGridParticleHashSdf,
-                    m_dGridParticleIndexSdf, dPosSdf, m_sdfParticles.size(), m_numGridCells);
+            TRACE_SCOPE("calcHash");
+            calcHash(   m_dGridParticleHash,
+                        m_dGridParticleIndex,
+                        dPos,
+                        m_numParticles);
         }
+
+        // sort particles based on hash
+        {
+            TRACE_SCOPE("sortParticles");
+            sortParticles(m_dGridParticleHash,
+                          m_dGridParticleIndex,
+                          m_numParticles,
+                          m_gridSortBits,
+                          true);
+        }
+
+        // in spatial order mode the sorted order periodically becomes the
+        // storage order, the kernels then read the particle arrays directly
+        m_sortedInPlace = m_spatialOrderPeriod > 0 && m_iterations >= m_permuteStep;
+
+        if (m_sortedInPlace)
+        {
+            TRACE_SCOPE("permuteParticles");
+            permuteParticles(dPos, m_dSortedPos, m_dGridParticleIndex, m_numParticles);
+            m_permuteStep = m_iterations + m_spatialOrderPeriod;
+        }
+
+        // reorder particle arrays into sorted order (unless they are
+        // already) and find start and end of each cell and block
+        {
+            TRACE_SCOPE("reorderDataAndFindCellStart");
+            reorderDataAndFindCellStart(
+                        m_dBlockKeys,
+                        m_dBlockCells,
+                        m_dBlockFirstCell,
+                        m_dCellStart,
+                        m_dCellEnd,
+                        m_sortedInPlace ? NULL : m_dSortedPos,
+                        m_sortedInPlace ? NULL : m_dSortedW,
+                        m_sortedInPlace ? NULL : m_dSortedPhase,
+                        m_dGridParticleHash,
+                        m_dGridParticleIndex,
+                        dPos,
+                        m_numParticles,
+                        tableSize);
+        }
+
+        m_neighborSearches++;
+        m_neighborDisplacement = 0.f;
+        m_neighborsValid = true;
     }
 
-    for (uint i = 0; i < m_solverIterations; i++)
+    float *sortedW = m_sortedInPlace ? getWRawPtr() : m_dSortedW;
+    int *sortedPhase = m_sortedInPlace ? getPhaseRawPtr() : m_dSortedPhase;
+
+    // one search finds the contacts and the fluid neighbors of every
+    // particle, sorted into bands by distance
+    if (search)
     {
-        // calculate grid hash
-        calcHash(   m_dGridParticleHash,
-                    m_dGridParticleIndex,
-                    dPos,
-                    m_numParticles);
+        TRACE_SCOPE("findNeighbors");
+        findNeighbors(  m_dSortedPos,
+                        sortedW,
+                        sortedPhase,
+                        m_dSortedPosSdf,
+                        m_dBlockKeys,
+                        m_dBlockCells,
+                        m_dBlockFirstCell,
+                        m_dCellStart,
+                        m_dCellEnd,
+                        m_dBlockKeysSdf,
+                        m_dBlockCellsSdf,
+                        m_dBlockFirstCellSdf,
+                        m_dCellStartSdf,
+                        m_dCellEndSdf,
+                        m_numParticles,
+                        m_sdfParticles.size(),
+                        tableSize,
+                        tableSizeSdf);
+    }
 
-        // sort particles based on hash
-        sortParticles(m_dGridParticleHash,
-                      m_dGridParticleIndex,
-                      m_numParticles);
-        
-        // reorder particle arrays into sorted order and
-        // find start and end of each cell
-        reorderDataAndFindCellStart(
-                    m_dCellStart,
-                    m_dCellEnd,
-                    m_dSortedPos,
-                    m_dSortedW,
-                    m_dSortedPhase,
-                    m_dGridParticleHash,
-                    m_dGridParticleIndex,
-                    dPos,
-                    m_numParticles,
-                    m_numGridCells);
+    // the phases only change order when the grid is sorted again
+    if (search)
+    {
+        TRACE_SCOPE("sortByType");
+        sortByType(sortedPhase, m_numParticles);
+    }
 
-        // find particle neighbors and process collisions
+    // process collisions
+    {
+        TRACE_SCOPE("collide");
         collide(    dPos,
                     m_dSortedPos,
-                    m_dSortedW,
-                    m_dSortedPhase,
+                    sortedW,
+                    sortedPhase,
                     m_dSortedPosSdf,
                     m_dGridParticleIndex,
-                    m_dCellStart,
-                    m_dCellEnd,
-                    m_dCellStartSdf,
-                    m_dCellEndSdf,
                     m_numParticles,
-                    m_sdfParticles.size(),
-                    m_numGridCells);
+                    m_sdfParticles.size());
+    }
 
-        // find neighbors within a specified radius of fluids
-        // and apply fluid constraints
+    // apply fluid constraints
+    {
+        TRACE_SCOPE("solveFluids");
         solveFluids(m_dSortedPos,
-                    m_dSortedW,
-                    m_dSortedPhase,
+                    sortedW,
+                    sortedPhase,
                     m_dGridParticleIndex,
-                    m_dCellStart,
-                    m_dCellEnd,
                     dPos,
-                    m_numParticles,
-                    m_numGridCells);
+                    m_numParticles);
+    }
 
-        // apply collision constraints for the world borders
+    // apply collision constraints for the world borders
+    {
+        TRACE_SCOPE("collideWorld");
         collideWorld(dPos,
                      m_dSortedPos,
                      m_numParticles,
                      m_minBounds,
                      m_maxBounds);
-
-        // apply distance constraints
-        solveDistanceConstraints(dPos);
-
-        // apply point constraints
-        solvePointConstraints(dPos);
     }
 
-    // determine the current position based on distance
-    // travelled during current timestep
-    calcVelocity(dPos,
-                 deltaTime,
-                 m_numParticles);
-
-    // unmap at end here to avoid unnecessary graphics/CUDA context switch
-    unmapGLBufferObject(m_cuda_posvbo_resource);
-    unmapGLBufferObject(m_cuda_posvbosdf_resource);
-
-    /*auto finish = std::chrono::high_resolution_clock::now();
-    std::chrono::duration<double> elapsed = finish - start;*/
-    
-    m_iterations++;
-    
-    // std::cout << "Iteration " << m_iterations << "\tTime: " << elapsed.count() * 1000 << "ms\n";
-    
-    // add new particles to the scene
-    addNewStuff();
+    // apply the constraints, one kind after the other
+    for (uint type = 0; type < numConstraintTypes(); type++)
+    {
+        TRACE_SCOPE(constraintTypeName(type));
+        solveConstraints(type, dPos);
+    }
 }
 
 
 void ParticleSystem::addNewStuff()
 {
+    TRACE_SCOPE("addNewStuff");
     addParticles();
     addFluids();
 }
@@ -319,16 +559,22 @@ void ParticleSystem::addParticles()
     if (m_particlesToAdd.empty())
         return;
 
-    uint size = m_particlesToAdd.size() / 2;
-    float4 pos, vel;
+    // as many as still fit, the rest is dropped
+    uint size = std::min<uint>(m_particlesToAdd.size() / 2, m_maxParticles - m_numParticles);
+
+    std::vector<float4> pos(size), vel(size);
+    std::vector<float> w(size), ro(size, 1.5f);
+    std::vector<int> phase(size, SOLID);
     for (uint i = 0; i < size; i++)
     {
-        pos = m_particlesToAdd.front();
-        m_particlesToAdd.pop_front();
-        vel = m_particlesToAdd.front();
-        m_particlesToAdd.pop_front();
-        addParticle(pos, make_float4(vel.x, vel.y, vel.z, 0), vel.w, 1.5f, SOLID);
+        pos[i] = m_particlesToAdd[2 * i];
+        float4 v = m_particlesToAdd[2 * i + 1];
+        vel[i] = make_float4(v.x, v.y, v.z, 0);
+        w[i] = 1.f / v.w;
     }
+    m_particlesToAdd.clear();
+
+    addParticleMultiple((float *) pos.data(), (float *) vel.data(), w.data(), ro.data(), phase.data(), size);
 }
 
 void ParticleSystem::addFluids()
@@ -338,16 +584,23 @@ void ParticleSystem::addFluids()
 
     uint start = m_numParticles;
 
-    uint size = m_fluidsToAdd.size() / 2;
-    float4 pos, color;
+    uint size = std::min<uint>(m_fluidsToAdd.size() / 2, m_maxParticles - m_numParticles);
+    float4 color = m_fluidsToAdd.back();
+
+    std::vector<float4> pos(size), vel(size, make_float4(0, -1, 0, 0));
+    std::vector<float> w(size), ro(size);
+    std::vector<int> phase(size, FLUID);
     for (uint i = 0; i < size; i++)
     {
-        pos = m_fluidsToAdd.front();
-        m_fluidsToAdd.pop_front();
-        color = m_fluidsToAdd.front();
-        m_fluidsToAdd.pop_front();
-        addParticle(make_float4(make_float3(pos), 1), make_float4(0,-1,0,0), pos.w, color.w, FLUID);
+        float4 p = m_fluidsToAdd[2 * i];
+        pos[i] = make_float4(make_float3(p), 1);
+        w[i] = 1.f / p.w;
+        ro[i] = m_fluidsToAdd[2 * i + 1].w;
     }
+    m_fluidsToAdd.clear();
+
+    if (!addParticleMultiple((float *) pos.data(), (float *) vel.data(), w.data(), ro.data(), phase.data(), size))
+        return;
 
     m_colorIndex.push_back(make_int2(start, m_numParticles));
     m_colors.push_back(make_float4(make_float3(color), 1.f));
@@ -369,43 +622,53 @@ void ParticleSystem::setParticleToAdd(float3 pos, float3 vel, float mass)
 
 void ParticleSystem::addParticle(float4 pos, float4 vel, float mass, float ro, int phase)
 {
-    if (m_numParticles == m_maxParticles)
-        return;
-
-    float *data = (float*)&pos;
-    unregisterGLBufferObject(m_cuda_posvbo_resource);
-    glBindBuffer(GL_ARRAY_BUFFER, m_posVbo);
-    glBufferSubData(GL_ARRAY_BUFFER, m_numParticles*4*sizeof(float), 4*sizeof(float), data);
-    glBindBuffer(GL_ARRAY_BUFFER, 0);
-    registerGLBufferObject(m_posVbo, &m_cuda_posvbo_resource);
-
-    float *hv = (float*)&vel;
-    float *hro = &ro;
-    int *hphase = &phase;
     float w = 1.f / mass;
-    float *hw = &w;
-
-    appendIntegrationParticle(hv, hro, 1);
-    appendPhaseAndMass(hphase, hw, 1);
-    appendSolverParticle(1);
-    m_numParticles++;
+    addParticleMultiple((float*)&pos, (float*)&vel, &w, &ro, &phase, 1);
 }
 
-void ParticleSystem::addParticleMultiple(float *pos, float *vel, float *mass, float *ro, int *phase, int numParticles)
+/**
+ * @brief ParticleSystem::addParticleMultiple
+ *
+ *      Appends a block of particles with one upload per array.
+ *      All other ways of adding particles end up here.
+ *
+ * @param pos - positions (float4)
+ * @param vel - velocities (float4)
+ * @param w - inverse masses
+ * @param ro - rest densities
+ * @param phase - particle phases
+ * @param numParticles
+ * @return false if none were added (the batch would exceed maxParticles),
+ *      the caller then must not refer to them in constraints
+ */
+bool ParticleSystem::addParticleMultiple(float *pos, float *vel, float *w, float *ro, int *phase, int numParticles)
 {
-    if (m_numParticles + numParticles >= m_maxParticles)
-        return;
+    // also covers the constraints added right after the particles
+    bindContext(m_context);
 
-    unregisterGLBufferObject(m_cuda_posvbo_resource);
-    glBindBuffer(GL_ARRAY_BUFFER, m_posVbo);
-    glBufferSubData(GL_ARRAY_BUFFER, m_numParticles*4*sizeof(float), numParticles*4*sizeof(float), pos);
-    glBindBuffer(GL_ARRAY_BUFFER, 0);
-    registerGLBufferObject(m_posVbo, &m_cuda_posvbo_resource);
+    if (numParticles <= 0 || m_numParticles + numParticles > m_maxParticles)
+        return false;
 
-    appendIntegrationParticle(vel, ro, numParticles);
-    appendPhaseAndMass(phase, mass, numParticles);
-    appendSolverParticle(numParticles);
+    setArray(true, pos, m_numParticles, numParticles);
+
+    appendParticles(vel, ro, w, phase, numParticles);
     m_numParticles += numParticles;
+
+    // the grid and neighbor lists miss the new particles
+    m_neighborsValid = false;
+    return true;
+}
+
+/**
+ * @brief ParticleSystem::reserve
+ *
+ *      Allocates backend storage for numParticles particles up front
+ *      (capped at maxParticles), e.g. before emitting many particles.
+ */
+void ParticleSystem::reserve(uint numParticles)
+{
+    bindContext(m_context);
+    reserveParticles(std::min(numParticles, m_maxParticles));
 }
 
 void ParticleSystem::setFluidToAdd(float3 pos, float3 color, float mass, float density)
@@ -459,7 +722,8 @@ void ParticleSystem::addFluid(int3 ll, int3 ur, float mass, float density, float
     std::fill(ro, ro + arraySize, density);
     std::fill(phase, phase + arraySize, FLUID);
 
-    addParticleMultiple(pos, vel, w, ro, phase, arraySize);
+    if (!addParticleMultiple(pos, vel, w, ro, phase, arraySize))
+        return;
 
     m_colorIndex.push_back(make_int2(start, m_numParticles));
     m_colors.push_back(make_float4(color, 1.f));
@@ -512,14 +776,16 @@ void ParticleSystem::addParticleGrid(int3 ll, int3 ur, float mass, bool addJitte
     std::fill(ro, ro + arraySize, 1.f);
     std::fill(phase, phase + arraySize, SOLID);
 
-    addParticleMultiple(pos, vel, w, ro, phase, arraySize);
+    if (!addParticleMultiple(pos, vel, w, ro, phase, arraySize))
+        return;
 
     m_colorIndex.push_back(make_int2(start, m_numParticles));
     m_colors.push_back(make_float4(colors[rand() % numColors], 1.f));
 }
 
 
-void ParticleSystem::addHorizCloth(int2 ll, int2 ur, float3 spacing, float2 dist, float mass, bool holdEdges)
+void ParticleSystem::addHorizCloth(int2 ll, int2 ur, float3 spacing, float2 dist, float mass, bool holdEdges,
+                                   float compliance)
 {
     int start = m_numParticles;
 
@@ -619,16 +885,19 @@ void ParticleSystem::addHorizCloth(int2 ll, int2 ur, float3 spacing, float2 dist
     std::fill(ro, ro + arraySize, 1.f);
     std::fill(phase, phase + arraySize, RIGID + m_rigidIndex/*CLOTH*/);
 
-    addParticleMultiple(pos, vel, w, ro, phase, arraySize);
-    addPointConstraint(indicesP, points, numPoints);
-    addDistanceConstraint(indicesD, dists, numDists);
+    if (!addParticleMultiple(pos, vel, w, ro, phase, arraySize))
+        return;
+
+    queuePointConstraints(indicesP, points, 0.f, numPoints);
+    queueDistanceConstraints(indicesD, dists, compliance, numDists);
 
     m_colorIndex.push_back(make_int2(start, m_numParticles));
     m_colors.push_back(make_float4(colors[rand() % numColors], 1.f));
     m_rigidIndex++;
 }
 
-void ParticleSystem::addRope(float3 start, float3 spacing, float dist, int numLinks, float mass, bool constrainStart)
+void ParticleSystem::addRope(float3 start, float3 spacing, float dist, int numLinks, float mass, bool constrainStart,
+                             float compliance)
 {
     uint startI = m_numParticles;
 
@@ -665,11 +934,13 @@ void ParticleSystem::addRope(float3 start, float3 spacing, float dist, int numLi
     std::fill(ro, ro + arraySize, 1.f);
     std::fill(phase, phase + arraySize, RIGID + m_rigidIndex);
 
-    addParticleMultiple(pos, vel, w, ro, phase, arraySize);
-    addDistanceConstraint(indicesD, dists, numLinks);
+    if (!addParticleMultiple(pos, vel, w, ro, phase, arraySize))
+        return;
+
+    queueDistanceConstraints(indicesD, dists, compliance, numLinks);
 
     if (constrainStart)
-        addPointConstraint(&startI, (float*)&start, 1);
+        queuePointConstraints(&startI, (float*)&start, 0.f, 1);
 
     m_colorIndex.push_back(make_int2(startI, m_numParticles));
     m_colors.push_back(make_float4(colors[rand() % numColors], 1));
@@ -737,8 +1008,10 @@ void ParticleSystem::addStaticSphere(int3 ll, int3 ur, float spacing)
     std::fill(ro, ro + arraySize, 1.f);
     std::fill(phase, phase + arraySize, RIGID + m_rigidIndex);
 
-    addParticleMultiple(posV.data(), vel, w, ro, phase, arraySize);
-    addPointConstraint(indices.data(), points.data(), indices.size());
+    if (!addParticleMultiple(posV.data(), vel, w, ro, phase, arraySize))
+        return;
+
+    queuePointConstraints(indices.data(), points.data(), 0.f, indices.size());
 
     m_colorIndex.push_back(make_int2(startI, m_numParticles));
     m_colors.push_back(make_float4(colors[rand() % numColors], 1.f));
@@ -748,14 +1021,294 @@ void ParticleSystem::addStaticSphere(int3 ll, int3 ur, float spacing)
 }
 
 
-void ParticleSystem::makePointConstraint(uint index, float3 point)
+void ParticleSystem::makePointConstraint(uint index, float3 point, float compliance)
+{
+    queuePointConstraints(&index, (float*)&point, compliance, 1);
+}
+
+void ParticleSystem::queuePointConstraints(const uint *index, const float *point, float compliance,
+                                           uint numConstraints)
+{
+    m_pointsToAddI.insert(m_pointsToAddI.end(), index, index + numConstraints);
+    m_pointsToAdd.insert(m_pointsToAdd.end(), point, point + 3 * numConstraints);
+    m_pointsToAddCompliance.insert(m_pointsToAddCompliance.end(), numConstraints, compliance);
+}
+
+void ParticleSystem::queueDistanceConstraints(const uint *index, const float *distance, float compliance,
+                                              uint numConstraints)
+{
+    m_distsToAddI.insert(m_distsToAddI.end(), index, index + 2 * numConstraints);
+    m_distsToAdd.insert(m_distsToAdd.end(), distance, distance + numConstraints);
+    m_distsToAddCompliance.insert(m_distsToAddCompliance.end(), numConstraints, compliance);
+}
+
+// one backend call per kind, which grows the constraint arrays and
+// counts the occurrences of the particles once for the whole batch
+void ParticleSystem::commitConstraints()
+{
+    if (m_pointsToAddI.empty() && m_distsToAddI.empty())
+        return;
+
+    TRACE_SCOPE("commitConstraints");
+    bindContext(m_context);
+
+    // only handles of particles that were actually added reach the
+    // backend, it indexes its particle arrays with them
+    uint dropped = dropInvalidConstraints(m_pointsToAddI, m_pointsToAdd, m_pointsToAddCompliance, 1, 3,
+                                          m_numParticles)
+                 + dropInvalidConstraints(m_distsToAddI, m_distsToAdd, m_distsToAddCompliance, 2, 1,
+                                          m_numParticles);
+    if (dropped > 0)
+        fprintf(stderr, "ParticleSystem: dropped %u constraints on particles that do not exist\n", dropped);
+
+    if (!m_pointsToAddI.empty())
+    {
+        findParticleSlots(m_pointsToAddI.data(), m_pointsToAddI.size());
+        addPointConstraint(m_pointsToAddI.data(), m_pointsToAdd.data(), m_pointsToAddCompliance.data(),
+                           m_pointsToAddI.size());
+        m_pointsToAddI.clear();
+        m_pointsToAdd.clear();
+        m_pointsToAddCompliance.clear();
+    }
+
+    if (!m_distsToAddI.empty())
+    {
+        findParticleSlots(m_distsToAddI.data(), m_distsToAddI.size());
+        addDistanceConstraint(m_distsToAddI.data(), m_distsToAdd.data(), m_distsToAddCompliance.data(),
+                              m_distsToAdd.size());
+        m_distsToAddI.clear();
+        m_distsToAdd.clear();
+        m_distsToAddCompliance.clear();
+    }
+}
+
+void ParticleSystem::setNeighborSkin(float skin)
+{
+    // contacts are searched at most one more cell around a particle
+    m_params.neighborSkin = clamp(skin, 0.f, m_params.cellSize.x);
+    m_neighborsValid = false;
+}
+
+void ParticleSystem::setPairTraversal(bool pairs)
+{
+    m_params.pairTraversal = pairs;
+    m_neighborsValid = false;
+}
+
+void ParticleSystem::setClusterPairs(bool clusters)
+{
+    m_params.clusterPairs = clusters;
+    m_neighborsValid = false;
+}
+
+void ParticleSystem::setGridSort(GridSort sort)
+{
+    m_params.gridSort = sort;
+}
+
+void ParticleSystem::setCellOrder(CellOrder order)
+{
+    bindContext(m_context);
+    m_params.cellOrder = order;
+    calcCellKeys();
+    m_neighborsValid = false;
+
+    // the static sdf grid was sorted in the old order
+    if (m_precomputation && !m_sdfParticles.empty())
+        sortSdfGrid();
+}
+
+void ParticleSystem::setSimdFluids(bool simd)
+{
+    m_params.simdFluids = simd;
+}
+
+void ParticleSystem::setDistanceSolver(DistanceSolver solver)
+{
+    m_params.distanceSolver = solver;
+}
+
+uint ParticleSystem::distanceIterations(DistanceSolver solver, float tolerance, uint maxIterations)
 {
-    addPointConstraint(&index, (float*)&point, 1);
+    commitConstraints();
+    bindContext(m_context);
+
+    uint size = m_numParticles * 4 * sizeof(float);
+    std::vector<float> pos(m_numParticles * 4);
+    copyArrayFromDevice(pos.data(), mapPositions(), size);
+    unmapPositions();
+
+    float *dPos;
+    allocateArray((void **) &dPos, size);
+    copyArrayToDevice(dPos, pos.data(), 0, size);
+
+    SimParams params = m_params;
+    params.distanceSolver = solver;
+    setParameters(&params);
+
+    resetConstraints();
+    std::vector<float> errors(maxIterations + 1);
+    errors[0] = distanceConstraintError(dPos);
+    for (uint i = 1; i <= maxIterations; i++)
+    {
+        for (uint type = 0; type < numConstraintTypes(); type++)
+            solveConstraints(type, dPos);
+        errors[i] = distanceConstraintError(dPos);
+    }
+
+    setParameters(&m_params);
+    freeArray(dPos);
+
+    float final = errors[maxIterations];
+    if (fabsf(errors[maxIterations / 2] - final) > tolerance)
+        return maxIterations + 1;
+
+    uint iterations = 0;
+    while (errors[iterations] > final + tolerance)
+        iterations++;
+
+    return iterations;
 }
 
-void ParticleSystem::makeDistanceConstraint(uint2 index, float distance)
+float ParticleSystem::distanceError()
 {
-    addDistanceConstraint((uint*)&index, &distance, 1);
+    commitConstraints();
+    bindContext(m_context);
+
+    float error = distanceConstraintError(mapPositions());
+    unmapPositions();
+
+    return error;
+}
+
+float ParticleSystem::fluidDensityError()
+{
+    bindContext(m_context);
+
+    uint numParticles = m_numParticles;
+    std::vector<float4> pos(numParticles);
+    std::vector<float> w(numParticles), ros(numParticles);
+    std::vector<int> phase(numParticles);
+
+    copyArrayFromDevice(pos.data(), mapPositions(), numParticles * sizeof(float4));
+    unmapPositions();
+    copyArrayFromDevice(w.data(), getWRawPtr(), numParticles * sizeof(float));
+    copyArrayFromDevice(phase.data(), getPhaseRawPtr(), numParticles * sizeof(int));
+    copyArrayFromDevice(ros.data(), getRosRawPtr(), numParticles * sizeof(float));
+
+    // the particles sorted into cells as wide as the kernel radius
+    const int bias = 1 << 20;
+    auto cellKey = [=](int x, int y, int z)
+    {
+        return (unsigned long long) (x + bias) << 42 | (unsigned long long) (y + bias) << 21 | (z + bias);
+    };
+    auto cellOf = [](float x) { return (int) floorf(x / H); };
+
+    std::vector<std::pair<unsigned long long, uint> > cells(numParticles);
+    for (uint i = 0; i < numParticles; i++)
+        cells[i] = std::make_pair(cellKey(cellOf(pos[i].x), cellOf(pos[i].y), cellOf(pos[i].z)), i);
+    std::sort(cells.begin(), cells.end());
+
+    // the density of findLambda, over all particles within H
+    double error = 0.0;
+    uint numFluids = 0;
+    for (uint i = 0; i < numParticles; i++)
+    {
+        if (phase[i] != FLUID)
+            continue;
+
+        float3 p = make_float3(pos[i]);
+        int3 cell = make_int3(cellOf(p.x), cellOf(p.y), cellOf(p.z));
+        float ro = POLY6_COEFF * H6;
+
+        for (int z = cell.z - 1; z <= cell.z + 1; z++)
+        for (int y = cell.y - 1; y <= cell.y + 1; y++)
+        for (int x = cell.x - 1; x <= cell.x + 1; x++)
+        {
+            unsigned long long key = cellKey(x, y, z);
+            auto it = std::lower_bound(cells.begin(), cells.end(), std::make_pair(key, 0u));
+            for (; it != cells.end() && it->first == key; ++it)
+            {
+                float3 r = p - make_float3(pos[it->second]);
+                float rlen2 = dot(r, r);
+                if (it->second != i && rlen2 < H2)
+                    ro += POLY6_COEFF * (H2 - rlen2) * (H2 - rlen2) * (H2 - rlen2);
+            }
+        }
+
+        error += std::max(ro / w[i] / ros[i] - 1.f, 0.f);
+        numFluids++;
+    }
+
+    return numFluids ? float(error / numFluids) : 0.f;
+}
+
+// the range of the cell keys and the bits the sort has to look at
+void ParticleSystem::calcCellKeys()
+{
+    uint3 blocks = m_params.blockGridSize;
+    uint cellsPerBlock = m_params.blockSize * m_params.blockSize * m_params.blockSize;
+
+    // the keys are 32 bits, both backends hash with the order chosen
+    // here, so a world too large for Z-order keys keeps its cells in rows
+    if (m_params.cellOrder == CELL_ORDER_MORTON)
+    {
+        // the bits of the coordinates are interleaved x, y, z from the
+        // lowest one, 10 bits per axis, the largest key is that of the
+        // last block
+        unsigned long long numBlockKeys = 0;
+        if (max(blocks.x, max(blocks.y, blocks.z)) <= 1024)
+        {
+            uint last[3] = { blocks.x - 1, blocks.y - 1, blocks.z - 1 };
+            uint bits = 0;
+            for (uint axis = 0; axis < 3; axis++)
+            {
+                for (uint b = 0; b < 10; b++)
+                {
+                    if (last[axis] >> b)
+                        bits = max(bits, 3 * b + axis + 1);
+                }
+            }
+            numBlockKeys = 1ull << bits;
+        }
+
+        if (numBlockKeys == 0 || numBlockKeys * cellsPerBlock >= 0xffffffffull)
+        {
+            fprintf(stderr, "Z-order cell keys of a %u x %u x %u block grid exceed 32 bits, "
+                    "keeping the cells in rows\n", blocks.x, blocks.y, blocks.z);
+            m_params.cellOrder = CELL_ORDER_ROWS;
+        }
+        else
+            m_params.numCells = (uint) (numBlockKeys * cellsPerBlock);
+    }
+
+    if (m_params.cellOrder == CELL_ORDER_ROWS)
+    {
+        unsigned long long numKeys = (unsigned long long) blocks.x * blocks.y * blocks.z * cellsPerBlock;
+        if (numKeys >= 0xffffffffull)
+        {
+            fprintf(stderr, "ParticleSystem: a world of %llu cells is too large for 32 bit cell keys\n", numKeys);
+            exit(EXIT_FAILURE);
+        }
+        m_params.numCells = (uint) numKeys;
+    }
+
+    // the sort only needs to look at the bits of the largest key
+    m_gridSortBits = 0;
+    while (m_gridSortBits < 32 && (m_params.numCells - 1) >> m_gridSortBits)
+        m_gridSortBits++;
+}
+
+void ParticleSystem::makeDistanceConstraint(uint2 index, float distance, float compliance)
+{
+    queueDistanceConstraints((uint*)&index, &distance, compliance, 1);
+}
+
+void ParticleSystem::setDistanceCompliance(float compliance)
+{
+    commitConstraints();
+    bindContext(m_context);
+    ::setDistanceCompliance(compliance);
 }
 
 
@@ -765,15 +1318,57 @@ void ParticleSystem::setArray(bool isPosArray, const float *data, int start, int
 
     if (isPosArray)
     {
+#ifdef HEADLESS
+        copyArrayToDevice(m_dPos, data, start*4*sizeof(float), count*4*sizeof(float));
+#else
         unregisterGLBufferObject(m_cuda_posvbo_resource);
         glBindBuffer(GL_ARRAY_BUFFER, m_posVbo);
         glBufferSubData(GL_ARRAY_BUFFER, start*4*sizeof(float), count*4*sizeof(float), data);
         glBindBuffer(GL_ARRAY_BUFFER, 0);
         registerGLBufferObject(m_posVbo, &m_cuda_posvbo_resource);
+#endif
     }
 }
 
 
+/*
+ * Access to the particle positions. They live in VBOs shared with
+ * the renderer, or in plain device memory when built HEADLESS.
+ */
+float *ParticleSystem::mapPositions()
+{
+#ifdef HEADLESS
+    return m_dPos;
+#else
+    return (float *) mapGLBufferObject(&m_cuda_posvbo_resource);
+#endif
+}
+
+float *ParticleSystem::mapPositionsSdf()
+{
+#ifdef HEADLESS
+    return m_dPosSdf;
+#else
+    return (float *) mapGLBufferObject(&m_cuda_posvbosdf_resource);
+#endif
+}
+
+void ParticleSystem::unmapPositions()
+{
+#ifndef HEADLESS
+    unmapGLBufferObject(m_cuda_posvbo_resource);
+#endif
+}
+
+void ParticleSystem::unmapPositionsSdf()
+{
+#ifndef HEADLESS
+    unmapGLBufferObject(m_cuda_posvbosdf_resource);
+#endif
+}
+
+
+#ifndef HEADLESS
 GLuint ParticleSystem::createVBO(uint size)
 {
     GLuint vbo;
@@ -783,6 +1378,7 @@ GLuint ParticleSystem::createVBO(uint size)
     glBindBuffer(GL_ARRAY_BUFFER, 0);
     return vbo;
 }
+#endif
 
 
 // *************************
@@ -790,6 +1386,7 @@ GLuint ParticleSystem::createVBO(uint size)
 // *************************
 void ParticleSystem::computeSDFSurfaces()
 {
+    TRACE_SCOPE("computeSDFSurfaces");
     const float diameter = 2.f * m_particleRadius;
     
     m_sdfParticles.clear();
@@ -826,12 +1423,18 @@ void ParticleSystem::computeSDFSurfaces()
 void ParticleSystem::addSDFParticles()
 {
     if (m_sdfParticles.empty()) return;
+
+    TRACE_SCOPE("addSDFParticles");
     
     uint limit = static_cast<uint>(m_sdfParticles.size() <= m_maxSDFParticles ? m_sdfParticles.size() : m_maxSDFParticles);
     
+#ifdef HEADLESS
+    copyArrayToDevice(m_dPosSdf, m_sdfParticles.data(), 0, limit * 4 * sizeof(float));
+#else
     glBindBuffer(GL_ARRAY_BUFFER, m_posVboSdf);
     glBufferSubData(GL_ARRAY_BUFFER, 0, limit * 4 * sizeof(float), m_sdfParticles.data());
     glBindBuffer(GL_ARRAY_BUFFER, 0);
+#endif
 }
 
 void ParticleSystem::addSDF(SignedDistanceField sdf)
@@ -841,28 +1444,38 @@ void ParticleSystem::addSDF(SignedDistanceField sdf)
 
 void ParticleSystem::prepareScene()
 {
+    bindContext(m_context);
+    m_neighborsValid = false;
+
     if (m_precomputation && m_sdfs.size() > 0)
     {
         computeSDFSurfaces();
         addSDFParticles();
-    
-        float *dPosSdf = (float*) mapGLBufferObject(&m_cuda_posvbosdf_resource);
-    
-        setParameters(&m_params);
-        
-        calcHash(m_dGridParticleHashSdf, m_dGridParticleIndexSdf, dPosSdf, m_sdfParticles.size());
-        sortParticles(m_dGridParticleHashSdf, m_dGridParticleIndexSdf, m_sdfParticles.size());
-        reorderDataAndFindCellStart(m_dCellStartSdf, m_dCellEndSdf, m_dSortedPosSdf, NULL, NULL, m_dGridParticleHashSdf,
-                m_dGridParticleIndexSdf, dPosSdf, m_sdfParticles.size(), m_numGridCells);
-        
-        unmapGLBufferObject(m_cuda_posvbosdf_resource);
+        sortSdfGrid();
     }
 }
 
+// grid of the precomputed sdf particles, which never move
+void ParticleSystem::sortSdfGrid()
+{
+    float *dPosSdf = mapPositionsSdf();
+
+    setParameters(&m_params);
+
+    calcHash(m_dGridParticleHashSdf, m_dGridParticleIndexSdf, dPosSdf, m_sdfParticles.size());
+    sortParticles(m_dGridParticleHashSdf, m_dGridParticleIndexSdf, m_sdfParticles.size(), m_gridSortBits, false);
+    uint tableSizeSdf = blockTableSize(m_sdfParticles.size());
+    reorderDataAndFindCellStart(m_dBlockKeysSdf, m_dBlockCellsSdf, m_dBlockFirstCellSdf, m_dCellStartSdf,
+            m_dCellEndSdf, m_dSortedPosSdf, NULL, NULL, m_dGridParticleHashSdf, m_dGridParticleIndexSdf,
+            dPosSdf, m_sdfParticles.size(), tableSizeSdf);
+
+    unmapPositionsSdf();
+}
+
 void ParticleSystem::generateParticlesLocal()
 {
-    // auto start = std::chrono::high_resolution_clock::now();
-    
+    TRACE_SCOPE("generateParticlesLocal");
+
     const float diameter = 2.f * m_particleRadius;
     const float MAX_RANGE = 4.f * m_particleRadius;
     
@@ -870,10 +1483,15 @@ void ParticleSystem::generateParticlesLocal()
     
     m_sdfParticles.clear();
     
-    float pos[4 * m_numParticles];
+    // heap, scaled scenes overflow the stack
+    std::vector<float> pos(4 * m_numParticles);
+#ifdef HEADLESS
+    copyArrayFromDevice(pos.data(), m_dPos, 4 * sizeof(float) * m_numParticles);
+#else
     glBindBuffer(GL_ARRAY_BUFFER, m_posVbo);
-    glGetBufferSubData(GL_ARRAY_BUFFER, 0, 4 * sizeof(float) * m_numParticles, pos);
+    glGetBufferSubData(GL_ARRAY_BUFFER, 0, 4 * sizeof(float) * m_numParticles, pos.data());
     glBindBuffer(GL_ARRAY_BUFFER, 0);
+#endif
     
     for (uint i = 0; i < m_numParticles; i++)
     {
@@ -910,14 +1528,8 @@ void ParticleSystem::generateParticlesLocal()
         }
     }
     
-    /*auto finish = std::chrono::high_resolution_clock::now();
-    std::chrono::duration<double> elapsed = finish - start;*/
-    
     if (!particles.empty())
     {
-        // uncomment for data output
-        /*std::cout << "Iteration " << m_iterations << ": " << particles.size() << "\tTime: " << elapsed.count() * 1000
-                << "ms\n";*/
         m_sdfParticles.assign(particles.begin(), particles.end());
     }
     
@@ -938,7 +1550,7 @@ void ParticleSystem::alignToGrid(float3 &min, float3 &max)
 }
 
 
-void ParticleSystem::addDeformableCube(int3 position, float mass, bool addJitter)
+void ParticleSystem::addDeformableCube(int3 position, float mass, bool addJitter, float compliance)
 {
     int start = m_numParticles;
     float jitter = 0.f;
@@ -976,7 +1588,8 @@ void ParticleSystem::addDeformableCube(int3 position, float mass, bool addJitter
     std::fill(ro, ro + arraySize, 1.f);
     std::fill(phase, phase + arraySize, SOLID);
     
-    addParticleMultiple(pos, vel, w, ro, phase, arraySize);
+    if (!addParticleMultiple(pos, vel, w, ro, phase, arraySize))
+        return;
     
     m_colorIndex.push_back(make_int2(start, m_numParticles));
     m_colors.push_back(make_float4(colors[rand() % numColors], 1.f));
@@ -992,17 +1605,17 @@ void ParticleSystem::addDeformableCube(int3 position, float mass, bool addJitter
                 
                 if (z != 2)
                 {
-                    makeDistanceConstraint(make_uint2(currentIndex, currentIndex + 9), distance);
+                    makeDistanceConstraint(make_uint2(currentIndex, currentIndex + 9), distance, compliance);
                 }
                 
                 if (y != 2)
                 {
-                    makeDistanceConstraint(make_uint2(currentIndex, currentIndex + 3), distance);
+                    makeDistanceConstraint(make_uint2(currentIndex, currentIndex + 3), distance, compliance);
                 }
                 
                 if (x != 2)
                 {
-                    makeDistanceConstraint(make_uint2(currentIndex, currentIndex + 1), distance);
+                    makeDistanceConstraint(make_uint2(currentIndex, currentIndex + 1), distance, compliance);
                 }
             }
         }
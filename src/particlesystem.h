@@ -24,8 +24,8 @@ const float3 sdfColor = make_float3(1.f, 1.f, 1.f);
 class ParticleSystem
 {
 public:
-    ParticleSystem(float particleRadius, uint3 gridSize, uint maxParticles, int3 minBounds, int3 maxBounds, int
-    iterations, bool precomputation = true);
+    ParticleSystem(float particleRadius, uint maxParticles, int3 minBounds, int3 maxBounds, int iterations,
+    bool precomputation = true);
     ~ParticleSystem();
 
     void update(float deltaTime);
@@ -33,15 +33,120 @@ public:
 
     void addFluid(int3 ll, int3 ur, float mass, float density, float3 color);
     void addParticleGrid(int3 ll, int3 ur, float mass, bool addJitter);
-    void addHorizCloth(int2 ll, int2 ur, float3 spacing, float2 dist, float mass, bool holdEdges);
-    void addRope(float3 start, float3 spacing, float dist, int numLinks, float mass, bool constrainStart);
+    // compliance is that of the distance constraints, see makeDistanceConstraint
+    void addHorizCloth(int2 ll, int2 ur, float3 spacing, float2 dist, float mass, bool holdEdges,
+                       float compliance = 0.f);
+    void addRope(float3 start, float3 spacing, float dist, int numLinks, float mass, bool constrainStart,
+                 float compliance = 0.f);
     void addStaticSphere(int3 ll, int3 ur, float spacing);
 
+    // preallocates storage for numParticles particles in total
+    void reserve(uint numParticles);
+
     void setParticleToAdd(float3 pos, float3 vel, float mass);
     void setFluidToAdd(float3 pos, float3 color, float mass, float density);
 
-    void makePointConstraint(uint index, float3 point);
-    void makeDistanceConstraint(uint2 index, float distance);
+    // particles are identified by their index in order of creation.
+    // Constraints are collected, also those of the add* functions, and
+    // reach the solver in one batch per kind with commitConstraints(),
+    // which update() calls first. Constraints on particles that do not
+    // exist by then are dropped (with a warning). The compliance of a constraint is its
+    // inverse stiffness (extended PBD), 0 makes it rigid. Unlike a
+    // stiffness factor its effect does not depend on the time step or
+    // the number of solver iterations.
+    void makePointConstraint(uint index, float3 point, float compliance = 0.f);
+    void makeDistanceConstraint(uint2 index, float distance, float compliance = 0.f);
+    void commitConstraints();
+
+    // replaces the compliance of all distance constraints so far
+    void setDistanceCompliance(float compliance);
+
+    void setSolverIterations(uint iterations) { m_solverIterations = iterations; }
+
+    // Splits every step into this many substeps of one solver iteration
+    // each, predicting the positions again in every substep, instead of
+    // the solver iterations on one prediction. The neighbor lists carry
+    // over between substeps as far as the skin allows. 0 (the default)
+    // switches it off.
+    void setSubsteps(uint substeps) { m_substeps = substeps; }
+    uint getSubsteps() const { return m_substeps; }
+
+    // Every period steps (0 switches it off, the default) the particle
+    // arrays are permuted into grid order in place, so the collision and
+    // fluid kernels of that step read them without gathering. Particles
+    // then no longer stay where they were added: the ranges of
+    // getColorIndex() stop matching the position buffer.
+    void setSpatialOrder(uint period) { m_spatialOrderPeriod = period; }
+
+    // Contacts and fluid neighbors are searched this much further (up to
+    // a particle diameter) and the lists are reused by later solver
+    // iterations and steps until a particle moved more than half the
+    // skin. The default 0 searches in every iteration.
+    void setNeighborSkin(float skin);
+    float getNeighborSkin() const { return m_params.neighborSkin; }
+
+    // Contacts between colliding particles and the density terms between
+    // fluid particles are computed once per pair and applied to both
+    // sides, instead of once from each side (CPU backend only, off by
+    // default). The sums then run in a different order.
+    void setPairTraversal(bool pairs);
+    bool getPairTraversal() const { return m_params.pairTraversal != 0; }
+
+    // Neighbors are searched and solved for clusters of a few nearby
+    // particles at a time, one SIMD lane per particle, instead of for
+    // every particle on its own (CPU backend only, off by default, takes
+    // precedence over pair traversal). The sums run in a different order.
+    void setClusterPairs(bool clusters);
+    bool getClusterPairs() const { return m_params.clusterPairs != 0; }
+
+    // The algorithm that sorts the grid hashes (CPU backend only), all
+    // give the same order. By default the order of the previous search
+    // is repaired if only a few particles changed cells.
+    void setGridSort(GridSort sort);
+    GridSort getGridSort() const { return (GridSort) m_params.gridSort; }
+
+    // The order of the blocks of cells in the sorted particle arrays:
+    // row by row (the default) or along a Z-order curve, which keeps the
+    // blocks around a particle closer together in memory. Pair
+    // traversal then sweeps single blocks instead of rows.
+    void setCellOrder(CellOrder order);
+    CellOrder getCellOrder() const { return (CellOrder) m_params.cellOrder; }
+
+    // The fluid density constraints of a particle are solved over
+    // several neighbors at once in SIMD lanes (CPU backend only, off by
+    // default, cluster pairs and pair traversal take precedence). The
+    // sums run in a different order.
+    void setSimdFluids(bool simd);
+    bool getSimdFluids() const { return m_params.simdFluids != 0; }
+
+    // How the distance constraints are solved: Jacobi, averaging the
+    // corrections of all constraints of a particle (the default), or
+    // Gauss-Seidel over the colours of the constraint graph, which
+    // converges in fewer iterations and needs no sorting.
+    void setDistanceSolver(DistanceSolver solver);
+    DistanceSolver getDistanceSolver() const { return (DistanceSolver) m_params.distanceSolver; }
+
+    // Solves the constraints alone (all kinds), on a copy of the
+    // positions, for maxIterations iterations, and returns after how
+    // many the mean error of the distance constraints (relative to their
+    // rest distances) came within tolerance of the error it ends with.
+    // Pinned particles can keep that above zero. maxIterations + 1 if
+    // the error still changed by more than tolerance in the second half.
+    uint distanceIterations(DistanceSolver solver, float tolerance, uint maxIterations);
+
+    // the mean error of the distance constraints now, relative to their
+    // rest distances (how far ropes and cloth are stretched)
+    float distanceError();
+
+    // the mean compression of the fluid particles now: how far their
+    // density (as the solver computes it) exceeds the rest density,
+    // relative to it. 0 without fluids.
+    float fluidDensityError();
+
+    // neighbor searches so far, and how far a particle moved at most
+    // since the last one (compared against half the skin)
+    uint getNeighborSearches() const { return m_neighborSearches; }
+    float getNeighborDisplacement() const { return m_neighborDisplacement; }
 
     // getters
     std::vector<int2> getColorIndex() { return m_colorIndex; }
@@ -52,6 +157,7 @@ public:
     uint getNumParticles() const { return m_numParticles; }
     uint getNumParticlesSdf() const { return m_sdfParticles.size(); }
     float getParticleRadius() const { return m_particleRadius; }
+    uint getSolverIterations() const { return m_solverIterations; }
 
     int3 getMinBounds() { return m_minBounds; }
     int3 getMaxBounds() { return m_maxBounds; }
@@ -61,18 +167,30 @@ public:
 private:
     void _init(uint numParticles, uint maxParticles);
     void _finalize();
+    void calcCellKeys();
 
     GLuint createVBO(uint size);
     void setArray(bool isVboArray, const float *data, int start, int count);
 
+    float *mapPositions();
+    float *mapPositionsSdf();
+    void unmapPositions();
+    void unmapPositionsSdf();
+
     void addParticle(float4 pos, float4 vel, float mass, float ro, int phase);
-    void addParticleMultiple(float *pos, float *vel, float *mass, float *ro, int *phase, int numParticles);
+    bool addParticleMultiple(float *pos, float *vel, float *w, float *ro, int *phase, int numParticles);
     void addParticles();
 
     void addFluids();
 
+    void queuePointConstraints(const uint *index, const float *point, float compliance, uint numConstraints);
+    void queueDistanceConstraints(const uint *index, const float *distance, float compliance, uint numConstraints);
+
     void addNewStuff();
 
+    uint updateSdfGrid();
+    void solverIteration(float *dPos, bool hashed, uint tableSize, uint tableSizeSdf);
+
     bool m_initialized;
 
     float m_particleRadius;
@@ -88,21 +206,29 @@ private:
     // grid data for sorting method
     uint  *m_dGridParticleHash; // grid hash value for each particle
     uint  *m_dGridParticleIndex;// particle index for each particle
-    uint  *m_dCellStart;        // index of start of each cell in sorted list
+    uint  *m_dBlockKeys;        // hash table of the occupied blocks of cells
+    unsigned long long *m_dBlockCells; // occupied cells of each block
+    uint  *m_dBlockFirstCell;   // first occupied cell of each block
+    uint  *m_dCellStart;        // index of start of each occupied cell in sorted list
     uint  *m_dCellEnd;          // index of end of cell
 
     uint   m_gridSortBits;
 
+    // particle positions when built HEADLESS (no GL context)
+    float *m_dPos;
+
     // vertex buffer object for particle positions
     GLuint   m_posVbo;
 
     // handles OpenGL-CUDA exchange
     struct cudaGraphicsResource *m_cuda_posvbo_resource;
 
+    // backend state (velocities, constraints, neighbors) of this
+    // simulation, bound to the thread before every backend call
+    struct SimContext *m_context;
+
     // params
     SimParams m_params;
-    uint3 m_gridSize;
-    uint m_numGridCells;
 
     // phase number for rigid bodies
     int m_rigidIndex;
@@ -111,6 +237,14 @@ private:
     std::deque<float4> m_particlesToAdd;
     std::deque<float4> m_fluidsToAdd;
 
+    // constraints waiting for commitConstraints(), by particle handle
+    std::vector<uint> m_pointsToAddI;
+    std::vector<float> m_pointsToAdd;
+    std::vector<float> m_pointsToAddCompliance;
+    std::vector<uint> m_distsToAddI;
+    std::vector<float> m_distsToAdd;
+    std::vector<float> m_distsToAddCompliance;
+
     // particle colors
     std::vector<int2> m_colorIndex;
     std::vector<float4> m_colors;
@@ -120,6 +254,17 @@ private:
     int3 m_maxBounds;
 
     uint m_solverIterations;
+    uint m_substeps;
+    uint m_spatialOrderPeriod;
+    uint m_permuteStep;         // step of the next permutation
+    bool m_sortedInPlace;       // the last search permuted the particle arrays
+
+    bool m_neighborsValid;      // grid and neighbor lists are up to date
+    uint m_neighborSearches;
+    float m_neighborDisplacement;
+
+    uint m_pendingVelocities;   // particles whose velocity the next step derives first
+    float m_pendingDeltaTime;   // from the positions travelled during this time
     
     
     // *************************
@@ -129,11 +274,12 @@ public:
     void addSDF(SignedDistanceField sdf);
     void prepareScene();
     
-    void addDeformableCube(int3 position, float mass, bool addJitter);
+    void addDeformableCube(int3 position, float mass, bool addJitter, float compliance = 0.f);
     
 private:
     void computeSDFSurfaces();
     void addSDFParticles();
+    void sortSdfGrid();
 
     void alignToGrid(float3 &min, float3 &max);
     
@@ -147,10 +293,15 @@ private:
     
     uint *m_dGridParticleHashSdf;
     uint *m_dGridParticleIndexSdf;
+    uint *m_dBlockKeysSdf;
+    unsigned long long *m_dBlockCellsSdf;
+    uint *m_dBlockFirstCellSdf;
     uint *m_dCellStartSdf;
     uint *m_dCellEndSdf;
     
     struct cudaGraphicsResource *m_cuda_posvbosdf_resource;
+
+    float *m_dPosSdf;
     
     std::vector<SignedDistanceField> m_sdfs;
     std::vector<float4> m_sdfParticles;
@@ -0,0 +1,224 @@
+/*
+ * The built-in scenes. They are shared by the interactive viewer,
+ * the headless runner and the benchmarks.
+ */
+
+#include <math.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <functional>
+
+#include "scenes.h"
+#include "particlesystem.h"
+#include "helper_math.h"
+
+const char sceneKeys[] = "0123456789BNM";
+
+
+ParticleSystem *createScene(char key, int *sdfSceneID, uint scale)
+{
+    int3 minBounds = make_int3(-50, 0, -50);
+    int3 maxBounds = make_int3(50, 200, 50);
+    bool precomputation = true;
+    int sdfScene = 0;
+
+    // footprint of one copy of the scene in x and z, scaled scenes
+    // place copies side by side at this distance
+    int2 tile;
+
+    // adds one copy of the scene shifted by offset
+    std::function<void(ParticleSystem *, int3)> populate;
+
+    switch (key)
+    {
+    case '1': // single rope
+        tile = make_int2(4, 4);
+        populate = [](ParticleSystem *particleSystem, int3 o)
+        {
+            particleSystem->addRope(make_float3(o.x, 20, o.z), make_float3(0, -.5, 0), .4f, 32, 1.f, true);
+        };
+        break;
+    case '2': // single cloth
+        tile = make_int2(10, 10);
+        populate = [](ParticleSystem *particleSystem, int3 o)
+        {
+            particleSystem->addHorizCloth(make_int2(o.x, o.z - 3), make_int2(o.x + 6, o.z + 3), make_float3(.5f,7.f,.5f), make_float2(.3f, .3f), 3.f, false);
+        };
+        break;
+    case '3': // two fluids, different densities
+        // the copies fill a larger tank of the same depth
+        minBounds = make_int3(-7, 0, -5);
+        maxBounds = make_int3(7, 20, 5);
+        tile = make_int2(14, 10);
+        populate = [](ParticleSystem *particleSystem, int3 o)
+        {
+            particleSystem->addFluid(make_int3(o.x - 7, 0, o.z - 5), make_int3(o.x + 7, 5, o.z + 5), 1.f, 2.f, colors[rand() % numColors]);
+            particleSystem->addFluid(make_int3(o.x - 7, 5, o.z - 5), make_int3(o.x + 7, 10, o.z + 5), 1.f, 3.f, colors[rand() % numColors]);
+        };
+        break;
+    case '4': // one solid particle stack
+        tile = make_int2(10, 10);
+        populate = [](ParticleSystem *particleSystem, int3 o)
+        {
+            particleSystem->addParticleGrid(make_int3(-3, 0, -3) + o, make_int3(3, 20, 3) + o, 1.f, false);
+        };
+        break;
+    case '5': // three solid particle stacks
+        tile = make_int2(24, 10);
+        populate = [](ParticleSystem *particleSystem, int3 o)
+        {
+            particleSystem->addParticleGrid(make_int3(-10, 0, -3) + o, make_int3(-7, 10, 3) + o, 1.f, false);
+            particleSystem->addParticleGrid(make_int3(-3, 0, -3) + o, make_int3(3, 10, 3) + o, 1.f, false);
+            particleSystem->addParticleGrid(make_int3(7, 0, -3) + o, make_int3(10, 10, 3) + o, 1.f, false);
+        };
+        break;
+    case '6': // particles on cloth
+        tile = make_int2(24, 24);
+        populate = [](ParticleSystem *particleSystem, int3 o)
+        {
+            particleSystem->addHorizCloth(make_int2(o.x - 10, o.z - 10), make_int2(o.x + 10, o.z + 10), make_float3(.3f, 5.5f, .3f), make_float2(.1f, .1f), 10.f, true);
+            particleSystem->addParticleGrid(make_int3(-3, 6, -3) + o, make_int3(3, 15, 3) + o, 1.f, false);
+        };
+        break;
+    case '7': // fluid blob
+        tile = make_int2(20, 20);
+        populate = [](ParticleSystem *particleSystem, int3 o)
+        {
+            particleSystem->addFluid(make_int3(-7, 6, -7) + o, make_int3(7, 13, 7) + o, 1.f, 1.5f, colors[rand() % numColors]);
+        };
+        break;
+    case '8': // combo scene
+        tile = make_int2(50, 50);
+        populate = [](ParticleSystem *particleSystem, int3 o)
+        {
+            float3 of = make_float3(o);
+            particleSystem->addHorizCloth(make_int2(o.x + 14, o.z - 4), make_int2(o.x + 24, o.z + 6), make_float3(.3f, 2.5f, .3f), make_float2(.25f, .25f), 10.f, true);
+            particleSystem->addHorizCloth(make_int2(o.x + 10, o.z - 10), make_int2(o.x + 25, o.z - 5), make_float3(.3f, 15.5f, .3f), make_float2(.25f, .25f), 3.f, false);
+            particleSystem->addRope(make_float3(-17, 20, -17) + of, make_float3(0, -.5, 0.001f), .4f, 30, 1.f, true);
+            particleSystem->addRope(make_float3(-16, 20, -17) + of, make_float3(0, 0, .5f), .4f, 50, 1.f, true);
+            particleSystem->addRope(make_float3(-17, 20, -16) + of, make_float3(0, -.5, 0.001f), .4f, 40, 1.f, true);
+            particleSystem->addParticleGrid(make_int3(17, 6, 0) + o, make_int3(21, 11, 4) + o, 1.f, false);
+            particleSystem->addParticleGrid(make_int3(-12, 0, -20) + o, make_int3(0, 12, -17) + o, 1.f, false);
+            particleSystem->addParticleGrid(make_int3(-18, 0, -15) + o, make_int3(-16, 9, -12) + o, 1.f, false);
+            particleSystem->addStaticSphere(make_int3(5, 5, -10) + o, make_int3(10, 10, -5) + o, .5f);
+        };
+        break;
+    case '9': // ropes on immovable sphere
+        tile = make_int2(44, 10);
+        populate = [](ParticleSystem *particleSystem, int3 o)
+        {
+            float3 h = make_float3(0, 10, 0) + make_float3(o);
+            for(int i = 0; i < 50; i++)
+            {
+                float angle = M_PI * i * 0.02f;
+                float3 vec = make_float3(cos(angle), sin(angle), 0.f);
+                particleSystem->addRope(vec*5.f + h, vec*.5f, .35f, 30, 1.f, true);
+            }
+            particleSystem->addStaticSphere(make_int3(-4, 7, -4) + o, make_int3(4, 16, 4) + o, .5f);
+        };
+        break;
+    case 'B':
+        maxBounds = make_int3(50, 50, 50);
+        precomputation = false;
+        sdfScene = 1;
+        tile = make_int2(16, 16);
+        populate = [](ParticleSystem *particleSystem, int3 o)
+        {
+            particleSystem->addParticleGrid(make_int3(-3, 3, -3) + o, make_int3(3, 13, 3) + o, 1.f, false);
+            std::function<float(glm::vec3)> sphere = [](glm::vec3 p) -> float {
+                const float radius = 3.f;
+                return glm::length(p) - radius;
+            };
+            particleSystem->addSDF(SignedDistanceField(sphere, glm::vec3(4.f + o.x, 0.f, o.z)));
+        };
+        break;
+    case 'N':
+        maxBounds = make_int3(50, 50, 50);
+        precomputation = false;
+        sdfScene = 2;
+        tile = make_int2(14, 14);
+        populate = [](ParticleSystem *particleSystem, int3 o)
+        {
+            particleSystem->addParticleGrid(make_int3(-3, 4, -3) + o, make_int3(3, 13, 3) + o, 1.f, false);
+            std::function<float(glm::vec3)> box = [](glm::vec3 p) -> float {
+                glm::vec3 d = glm::abs(p) - glm::vec3(5, 3, 5);
+                glm::vec3 tmp = glm::min(d, glm::vec3(0));
+                return glm::length(glm::max(d, glm::vec3(0))) + glm::max(glm::max(tmp.x, tmp.y), tmp.z);
+            };
+            particleSystem->addSDF(SignedDistanceField(box, glm::vec3(o.x, 0.f, o.z)));
+        };
+        break;
+    case 'M':
+        // the terrain is periodic, only the cubes are repeated
+        minBounds = make_int3(-25, 0, -25);
+        maxBounds = make_int3(25, 50, 25);
+        precomputation = false;
+        sdfScene = 3;
+        tile = make_int2(45, 45);
+        populate = [](ParticleSystem *particleSystem, int3 o)
+        {
+            for (int x = -20; x <= 20; x +=5 )
+            {
+                for (int z = -20; z <= 20; z += 5)
+                {
+                    particleSystem->addDeformableCube(make_int3(x + o.x, 10, z + o.z), 1.f, false);
+                }
+            }
+        };
+        break;
+    case '0': // empty scene
+        tile = make_int2(0, 0);
+        populate = [](ParticleSystem *, int3) {};
+        break;
+    default:
+        if (sdfSceneID)
+            *sdfSceneID = 0;
+        return NULL;
+    }
+
+    scale = std::max(scale, 1u);
+
+    // lay the copies out in a roughly square grid centered on the origin
+    int columns = static_cast<int>(ceil(sqrt(static_cast<float>(scale))));
+    int rows = (scale + columns - 1) / columns;
+    int3 first = make_int3(-((columns - 1) * tile.x) / 2, 0, -((rows - 1) * tile.y) / 2);
+
+    minBounds = minBounds + first;
+    maxBounds = maxBounds + first + make_int3((columns - 1) * tile.x, 0, (rows - 1) * tile.y);
+
+    ParticleSystem *particleSystem = new ParticleSystem(PARTICLE_RADIUS, MAX_PARTICLES * scale, minBounds, maxBounds,
+            5, precomputation);
+
+    for (uint i = 0; i < scale; i++)
+    {
+        int3 offset = first + make_int3((i % columns) * tile.x, 0, (i / columns) * tile.y);
+        populate(particleSystem, offset);
+    }
+
+    if (key == 'M')
+    {
+        std::function<float(glm::vec3)> terrain = [](glm::vec3 p) -> float {
+            glm::vec3 fp = p - glm::mod(p - glm::vec3(1.0f), 2.0f);
+            float d = glm::sin(fp.x * 0.3f) + glm::cos(fp.z * 0.3f);
+            glm::vec2 ret(p.x, p.z);
+            ret = ret + glm::vec2(1.0f);
+            ret = glm::fract(ret / 2.0f) * 2.0f - 1.0f;
+            p = glm::vec3(ret.x, p.y + d, ret.y);
+            float c1 = glm::length(glm::max(glm::abs(p)- glm::vec3(0.6f, 0.6f, 0.6f), 0.0f)) - 0.35f;
+            float c2 = glm::length(p) - 1.0f;
+            float cf = 0.5f;
+            return glm::mix(c1, c2, cf);
+        };
+        particleSystem->addSDF(SignedDistanceField(terrain, glm::vec3(0.f, 4.f, 0.f)));
+    }
+
+    particleSystem->commitConstraints();
+
+    if (sdfScene)
+        particleSystem->prepareScene();
+
+    if (sdfSceneID)
+        *sdfSceneID = sdfScene;
+
+    return particleSystem;
+}
@@ -0,0 +1,25 @@
+#ifndef SCENES_H
+#define SCENES_H
+
+class ParticleSystem;
+
+#define MAX_PARTICLES 15000 // (vbo size)
+#define PARTICLE_RADIUS 0.25f
+
+/**
+ * Builds one of the built-in scenes. Scenes are identified by the
+ * key that selects them in the viewer: '0' - '9', 'B', 'N' and 'M'.
+ * Returns NULL for an unknown key.
+ *
+ * sdfSceneID (optional) receives the id of the matching SDF shader
+ * used by the renderer, 0 for scenes without an SDF.
+ *
+ * scale > 1 places that many copies of the scene side by side in a
+ * correspondingly larger world, for benchmarking larger particle counts.
+ */
+ParticleSystem *createScene(char key, int *sdfSceneID = 0, unsigned int scale = 1);
+
+// all scene keys, in the order they are listed above
+extern const char sceneKeys[];
+
+#endif // SCENES_H
@@ -0,0 +1,122 @@
+/*
+ * Per-thread ring buffers behind the TRACE_SCOPE timers.
+ */
+
+#include <stdio.h>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+
+#include "trace.h"
+
+namespace
+{
+
+const uint64_t RING_SIZE = 1 << 16; // events per thread, power of two
+
+struct ThreadBuffer
+{
+    trace::Event events[RING_SIZE];
+    std::atomic<uint64_t> head; // number of events ever written
+    unsigned thread;
+};
+
+// buffers are never freed so they stay readable after their thread exits
+std::mutex registryMutex;
+std::vector<std::unique_ptr<ThreadBuffer> > registry;
+
+const std::chrono::steady_clock::time_point epoch = std::chrono::steady_clock::now();
+
+ThreadBuffer *registerThread()
+{
+    std::unique_ptr<ThreadBuffer> buffer(new ThreadBuffer);
+    buffer->head.store(0);
+
+    std::lock_guard<std::mutex> lock(registryMutex);
+    buffer->thread = registry.size();
+    registry.push_back(std::move(buffer));
+    return registry.back().get();
+}
+
+ThreadBuffer *threadBuffer()
+{
+    static thread_local ThreadBuffer *buffer = registerThread();
+    return buffer;
+}
+
+} // namespace
+
+
+namespace trace
+{
+
+uint64_t now()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - epoch).count();
+}
+
+void record(const char *name, uint64_t begin, uint64_t end, int arg)
+{
+    ThreadBuffer *buffer = threadBuffer();
+
+    // only this thread writes head, readers pick it up with acquire
+    uint64_t head = buffer->head.load(std::memory_order_relaxed);
+    Event &e = buffer->events[head & (RING_SIZE - 1)];
+    e.name = name;
+    e.begin = begin;
+    e.end = end;
+    e.arg = arg;
+    e.thread = buffer->thread;
+    buffer->head.store(head + 1, std::memory_order_release);
+}
+
+std::vector<Event> collect()
+{
+    std::vector<Event> events;
+
+    std::lock_guard<std::mutex> lock(registryMutex);
+    for (const std::unique_ptr<ThreadBuffer> &buffer : registry)
+    {
+        uint64_t head = buffer->head.load(std::memory_order_acquire);
+        uint64_t first = head > RING_SIZE ? head - RING_SIZE : 0;
+
+        for (uint64_t i = first; i < head; i++)
+            events.push_back(buffer->events[i & (RING_SIZE - 1)]);
+    }
+
+    return events;
+}
+
+void clear()
+{
+    std::lock_guard<std::mutex> lock(registryMutex);
+    for (const std::unique_ptr<ThreadBuffer> &buffer : registry)
+        buffer->head.store(0, std::memory_order_release);
+}
+
+bool writeChromeTrace(const char *path)
+{
+    FILE *file = fopen(path, "w");
+    if (!file)
+        return false;
+
+    std::vector<Event> events = collect();
+
+    // complete ("X") events, timestamps in microseconds
+    fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    for (size_t i = 0; i < events.size(); i++)
+    {
+        const Event &e = events[i];
+        fprintf(file, "{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f",
+                e.name, e.thread, e.begin * 1e-3, (e.end - e.begin) * 1e-3);
+        if (e.arg >= 0)
+            fprintf(file, ",\"args\":{\"i\":%d}", e.arg);
+        fprintf(file, "}%s\n", i + 1 < events.size() ? "," : "");
+    }
+    fprintf(file, "]}\n");
+
+    return fclose(file) == 0;
+}
+
+} // namespace trace
@@ -0,0 +1,88 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+/*
+ * Scoped timers for the stages of the simulation loop.
+ *
+ *     TRACE_SCOPE("collide");
+ *     TRACE_SCOPE_ARG("iteration", i);
+ *
+ * time the rest of the enclosing block. Every thread records into its
+ * own fixed size ring buffer, so recording takes no locks; only the
+ * first event of a thread registers its buffer. When a buffer is full
+ * the oldest events are overwritten.
+ *
+ * The macros expand to nothing unless THESIS_TRACE is defined (cmake
+ * -DTHESIS_TRACE=ON), so instrumented code costs nothing by default.
+ *
+ * With the CUDA backend kernel launches are asynchronous and the
+ * timers measure the host side only, run with CUDA_LAUNCH_BLOCKING=1
+ * to attribute kernel time to the right stage.
+ */
+
+#include <stdint.h>
+#include <vector>
+
+namespace trace
+{
+
+// a finished scope, times in nanoseconds since program start
+struct Event
+{
+    const char *name;   // must outlive the trace, i.e. a string literal
+    uint64_t begin;
+    uint64_t end;
+    int arg;            // -1 if the scope has no argument
+    unsigned thread;    // order in which the recording thread registered
+};
+
+uint64_t now();
+void record(const char *name, uint64_t begin, uint64_t end, int arg);
+
+/**
+ * Copies the events of all threads, oldest first per thread. Should be
+ * called while the simulation is not running, events recorded during
+ * the copy may be torn.
+ */
+std::vector<Event> collect();
+
+// drops all recorded events, same restriction as collect()
+void clear();
+
+/**
+ * Writes all recorded events in the Chrome trace_event JSON format
+ * (load in chrome://tracing or https://ui.perfetto.dev).
+ * Returns false if the file could not be written.
+ */
+bool writeChromeTrace(const char *path);
+
+class Scope
+{
+public:
+    explicit Scope(const char *name, int arg = -1)
+        : m_name(name), m_arg(arg), m_begin(now()) {}
+    ~Scope() { record(m_name, m_begin, now(), m_arg); }
+
+private:
+    Scope(const Scope &);
+    Scope &operator=(const Scope &);
+
+    const char *m_name;
+    int m_arg;
+    uint64_t m_begin;
+};
+
+} // namespace trace
+
+#define TRACE_CONCAT_(a, b) a ## b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+
+#ifdef THESIS_TRACE
+#define TRACE_SCOPE(name) trace::Scope TRACE_CONCAT(traceScope, __LINE__)(name)
+#define TRACE_SCOPE_ARG(name, arg) trace::Scope TRACE_CONCAT(traceScope, __LINE__)(name, static_cast<int>(arg))
+#else
+#define TRACE_SCOPE(name)
+#define TRACE_SCOPE_ARG(name, arg)
+#endif
+
+#endif // TRACE_H